@@ -40,6 +40,8 @@
 #include "mathopd.h"
 
 #include "safte-monitor.h"
+#include "safte_poller.h"
+#include "safte_startup.h"
 
 #ifdef USE_DMALLOC
 #include "dmalloc.h"
@@ -563,14 +565,13 @@ void httpd_main(void)
 	int rv;
 	fd_set rfds, wfds;
 	int m;
+	int startup_logged;
+	char report[SAFTE_STARTUP_REPORT_LEN];
 
 	struct timeval timeout;
-	uid_t saveuid;
-	time_t lsafte, csafte;
-	csafte = time(NULL);
-	lsafte = csafte - 5;
 
 	first = 1;
+	startup_logged = 0;
 	error = 0;
 	log_file = -1;
 	error_file = -1;
@@ -582,15 +583,20 @@ void httpd_main(void)
 			if (first) {
 				first = 0;
 				log_d("*** %s starting", server_version);
-				if(!safte_num) {
-				  log_d("No SAF-TE devices present. exiting");
-				  exit(0);
-				} else {
-				  log_d("Found %d SAF-TE devices", safte_num);
+				/* the poller finds the enclosures while
+				   requests are being served */
+				log_d("Discovering SAF-TE devices");
+				if (safte_poller_start() == -1) {
+					lerror("safte_poller_start");
+					break;
 				}
 			} else
 				log_d("logs reopened");
 		}
+		if (!startup_logged && safte_startup_report_r(report, sizeof report)) {
+			startup_logged = 1;
+			log_d("startup: %s", report);
+		}
 		if (gotsigusr1) {
 			gotsigusr1 = 0;
 			nuke_connections();
@@ -647,15 +653,6 @@ void httpd_main(void)
 		if (debug)
 			log_d("httpd_main: select(%d) ...", m + 1);
 
-		csafte = time(NULL);
-		if(csafte-lsafte >= 5) {
-		  saveuid = geteuid();
-		  seteuid(0);
-		  check_safte_status();
-		  seteuid(saveuid);
-		  lsafte = csafte;
-		}
-
 		timeout.tv_sec = 1;
 		timeout.tv_usec = 0;
 		rv = select(m + 1, &rfds, &wfds, 0, &timeout);
@@ -695,5 +692,6 @@ void httpd_main(void)
 			cleanup_connections();
 		}
 	}
+	safte_poller_stop();
 	log_d("*** shutting down", my_pid);
 }
@@ -37,7 +37,10 @@
 
 //static const char rcsid[] = "$Id: main.c,v 1.3 2005/02/13 23:13:08 mclark Exp $";
 
+#include <dirent.h>
+#include <sys/syscall.h>
 #include "mathopd.h"
+#include "safte_startup.h"
 
 #ifdef USE_DMALLOC
 #include "dmalloc.h"
@@ -146,14 +149,42 @@ static void sigquit(int sig)
 	gotsigquit = 1;
 }
 
+/* close every fd from lowfd up. close_range() does it in one call and
+   /proc/self/fd lists only the open ones; closing each fd up to the
+   limit, which may be in the millions, is the last resort */
+static void close_fds(int lowfd, int n)
+{
+	DIR *d;
+	struct dirent *de;
+	int fd;
+
+#ifdef SYS_close_range
+	if (syscall(SYS_close_range, lowfd, ~0U, 0) == 0)
+		return;
+#endif
+	d = opendir("/proc/self/fd");
+	if (d) {
+		while ((de = readdir(d)) != 0) {
+			fd = atoi(de->d_name);
+			if (fd >= lowfd && fd != dirfd(d))
+				close(fd);
+		}
+		closedir(d);
+		return;
+	}
+	for (fd = lowfd; fd < n; fd++)
+		close(fd);
+}
+
 int mathopd_main()
 {
-	int i, n, daemon, version, pid_fd, null_fd;
+	int n, daemon, version, pid_fd, null_fd;
 	struct server *s;
 	char buf[10];
 	struct rlimit rl;
 	struct passwd *pwd;
 	const char *message;
+	long long start;
 
 	progname = "safte-monitor";
 	daemon = 1;
@@ -164,21 +195,26 @@ int mathopd_main()
 	if (debug)
 		fprintf(stderr, "Number of fds available: %d\n", n);
 	setrlimit(RLIMIT_NOFILE, &rl);
-	for (i = 3; i < n; i++)
-		close(i);
+	start = safte_startup_now();
+	close_fds(3, n);
+	safte_startup_time(SAFTE_STARTUP_FDS, start);
 	null_fd = open(devnull, O_RDWR);
 	if (null_fd == -1)
 		die("open", "Cannot open %s", devnull);
 	while (null_fd < 3)
 		null_fd = dup(null_fd);
+	start = safte_startup_now();
 	message = config();
 	if (message)
 		die(0, "%s", message);
+	safte_startup_time(SAFTE_STARTUP_CONFIG, start);
+	start = safte_startup_now();
 	s = servers;
 	while (s) {
 		startup_server(s);
 		s = s->next;
 	}
+	safte_startup_time(SAFTE_STARTUP_LISTEN, start);
 	if (rootdir) {
 		if (chroot(rootdir) == -1)
 			die("chroot", 0);
@@ -381,6 +381,5 @@ extern int mathopd_main();
 /* safte-monitor linkage */
 
 extern int process_safte(struct request *r);
-extern int check_safte_status();
 
 #endif
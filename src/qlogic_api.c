@@ -3,6 +3,7 @@
 
 #include "scsi_api.h"
 #include "qlogic_api.h"
+#include "scsi_index.h"
 
 #ifdef USE_DMALLOC
 #include "dmalloc.h"
@@ -87,19 +88,18 @@ int qlogic_map_wwn_to_sd()
 {
     fc_device_t *qldev = qldev_head; 
     scsi_device_t *scsidev;
-    int lun;
 
     if(!qldev) return;
     while(qldev->next) {
-      for(lun=0; lun<256; lun++) {
-	/* all luns have the same WWPN */
-	if(scsidev = find_dev_by_loc(qldev->host, 0, qldev->id, lun)) {
-	  scsidev->isfc = 1;
-	  strcpy(scsidev->wwpn, qldev->wwpn);
-	  strcpy(scsidev->wwnn, qldev->wwnn);
-	  strcpy(scsidev->portid, qldev->portid);
-	  scsidev->loopid = qldev->loopid;
-	}
+      /* all luns have the same WWPN */
+      for(scsidev = find_dev_by_target(qldev->host, 0, qldev->id); scsidev;
+	  scsidev = scsi_index_next(SCSI_INDEX_TARGET, scsidev)) {
+	scsidev->isfc = 1;
+	strcpy(scsidev->wwpn, qldev->wwpn);
+	strcpy(scsidev->wwnn, qldev->wwnn);
+	strcpy(scsidev->portid, qldev->portid);
+	scsidev->loopid = qldev->loopid;
+	scsi_index_update(scsidev);
       }
       qldev = qldev->next;
     }
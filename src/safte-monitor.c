@@ -22,6 +22,17 @@
 #include <sys/wait.h>
 
 #include "safte-monitor.h"
+#include "safte_poll.h"
+#include "safte_poller.h"
+#include "safte_sched.h"
+#include "safte_sim.h"
+#include "scsi_sysfs.h"
+#include "safte_hotplug.h"
+#include "scsi_cache.h"
+#include "scsi_index.h"
+#include "safte_discover.h"
+#include "safte_startup.h"
+#include "safte_slot.h"
 #include "mathopd.h"
 
 /* max temperature for alert */
@@ -39,6 +50,7 @@ static int sg_numeric = 1;      /* use numeric sg device names */
 static int log_temp = 0;        /* log temperature changes */
 static int alert_noncrit = 0;   /* alert for non critical state changes */
 static char* alert_prog = NULL; /* alert notifcation program */
+static char* sim_file = NULL;   /* simulated enclosures, -S */
 static float max_temp = MAX_TEMP_DEFAULT; /* max temp */
 
 safte_device_t *saftedev_head = NULL;
@@ -107,15 +119,59 @@ safte_status_code_t statuscodes[] = {
    "okay"},
   {SAFTE_TEMP_STATUS, SAFTE_TEMP_STATUS_ALERT, 1,
    "alert"},
+  {SAFTE_LINK_STATUS, SAFTE_LINK_STATUS_OK, 0,
+   "responding"},
+  {SAFTE_LINK_STATUS, SAFTE_LINK_STATUS_RETRYING, 0,
+   "not responding, retrying"},
+  {SAFTE_LINK_STATUS, SAFTE_LINK_STATUS_QUARANTINED, 1,
+   "not responding, quarantined"},
+  {SAFTE_GLOBAL_STATUS, SAFTE_GLOBAL_AUDIBLE_ALARM, 0,
+   "audible alarm"},
+  {SAFTE_GLOBAL_STATUS, SAFTE_GLOBAL_FAILURE, 1,
+   "failure"},
+  {SAFTE_GLOBAL_STATUS, SAFTE_GLOBAL_WARNING, 1,
+   "warning"},
+  {SAFTE_GLOBAL_STATUS, SAFTE_GLOBAL_POWER, 0,
+   "power off requested"},
+  {SAFTE_GLOBAL_STATUS, SAFTE_GLOBAL_COOLING_FAILURE, 1,
+   "cooling failure"},
+  {SAFTE_GLOBAL_STATUS, SAFTE_GLOBAL_POWER_FAILURE, 1,
+   "power failure"},
+  {SAFTE_GLOBAL_STATUS, SAFTE_GLOBAL_DRIVE_FAILURE, 1,
+   "drive failure"},
+  {SAFTE_GLOBAL_STATUS, SAFTE_GLOBAL_DRIVE_WARNING, 1,
+   "drive warning"},
+  {SAFTE_GLOBAL_STATUS, SAFTE_GLOBAL_ARRAY_FAILURE, 1,
+   "array failure"},
+  {SAFTE_GLOBAL_STATUS, SAFTE_GLOBAL_ARRAY_WARNING, 1,
+   "array warning"},
+  {SAFTE_GLOBAL_STATUS, SAFTE_GLOBAL_ENCLOSURE_LOCK, 0,
+   "enclosure locked"},
+  {SAFTE_GLOBAL_STATUS, SAFTE_GLOBAL_IDENTIFY, 0,
+   "identify"},
   {0, 0, 0, NULL}
 };
 
+/* statuscodes[] indexed by system and code, and the slot status bits
+   that are severe, filled in by safte_status_init() */
+static const char *status_desc[SAFTE_STATUS_SYSTEMS][256];
+static unsigned char status_sev[SAFTE_STATUS_SYSTEMS][256];
+static unsigned char slot_severe0, slot_severe3;
+static unsigned short global_severe;
 
-/* request saf-te data */
-static unsigned char *safte_read (int fd, int safte_cmd)
+/* slot status descriptions by html, byte 0 and the byte 3 bits, built
+   the first time each is asked for. Byte 3 with only unknown bits set
+   is kept apart from 0, which reads as not present */
+static char *slot_desc[2][256][(SAFTE_SLOT_BYTE3_MASK + 1) * 2];
+
+static void render_forget_slots(safte_device_t *saftedev);
+
+
+/* request saf-te data into the caller's buffer. Returns 0 on success or
+   -1 with errno set and the command status in st (if not NULL) */
+int safte_read_r (int fd, int safte_cmd, unsigned char *buf, unsigned len,
+		  scsi_cmd_status_t *st)
 {
-  static unsigned char cmd[SCSI_OFF + 18];      /* SCSI command buffer */
-  static unsigned char safte_read_buffer[ SCSI_OFF + READ_REPLY_LEN ];
   unsigned char cmdblk [ READ_CMDLEN ] = 
   { READ_CMD,  /* command */
     1,  /* lun/reserved/mode */
@@ -124,28 +180,183 @@ static unsigned char *safte_read (int fd, int safte_cmd)
     0,  /* reserved */
     0,  /* reserved */
     0,  /* reserved */
-    READ_REPLY_LEN / 0x100,  /* allocation length MSB */
-    READ_REPLY_LEN % 0x100,  /* allocation length LSB */
+    len / 0x100,  /* allocation length MSB */
+    len % 0x100,  /* allocation length LSB */
     0 };/* reserved/flag/link */
 
-  memcpy( cmd + SCSI_OFF, cmdblk, sizeof(cmdblk) );
+  memset(buf, 0, len);
 
-  if (handle_scsi_cmd(fd, sizeof(cmdblk), 0, cmd, 
-                      sizeof(safte_read_buffer) - SCSI_OFF,
-		      safte_read_buffer )) {
-    fprintf( stderr, "read failed\n" );
-    exit(2);
+  return scsi_cmd(fd, cmdblk, sizeof(cmdblk), SG_DXFER_FROM_DEV,
+		  buf, len, scsi_timeout, st);
+}
+
+
+static void safte_read_error(int safte_cmd, scsi_cmd_status_t *st)
+{
+  syslog(LOG_ERR, "read buffer 0x%02x failed: %s (status 0x%x, "
+	 "host_status 0x%x, driver_status 0x%x)", safte_cmd,
+	 strerror(errno), st->status, st->host_status, st->driver_status);
+  fprintf(stderr, "read buffer 0x%02x failed: %s\n",
+	  safte_cmd, strerror(errno));
+}
+
+
+/* non-reentrant version of safte_read_r() using a static buffer.
+   Returns NULL if the command fails */
+unsigned char *safte_read (int fd, int safte_cmd)
+{
+  static unsigned char safte_read_buffer[ READ_REPLY_LEN ];
+  scsi_cmd_status_t st;
+
+  if (safte_read_r(fd, safte_cmd, safte_read_buffer,
+		   sizeof(safte_read_buffer), &st) < 0) {
+    safte_read_error(safte_cmd, &st);
+    return NULL;
   }
-  return (safte_read_buffer + SCSI_OFF);
+  return safte_read_buffer;
+}
+
+
+/* build a READ BUFFER request for a saf-te buffer id into buf */
+void safte_setup_read(scsi_req_t *req, int safte_cmd,
+		      unsigned char *buf, unsigned len)
+{
+  memset(req, 0, sizeof(scsi_req_t));
+  req->cdb[0] = READ_CMD;
+  req->cdb[1] = 1;                  /* mode */
+  req->cdb[2] = safte_cmd;          /* buffer id */
+  req->cdb[7] = len / 0x100;        /* allocation length MSB */
+  req->cdb[8] = len % 0x100;        /* allocation length LSB */
+  req->cdb_len = READ_CMDLEN;
+  req->dxfer_dir = SG_DXFER_FROM_DEV;
+  req->buf = buf;
+  req->buf_len = len;
+  req->timeout = scsi_timeout;
+  req->pack_id = safte_cmd;
+  memset(buf, 0, len);
+}
+
+
+/* read a buffer through the device's transport and decode it into
+   safte_dev */
+static int get_safte_buffer(safte_device_t *safte_dev, int safte_cmd,
+			    int (*decode)(safte_device_t *, unsigned char *))
+{
+  unsigned char buf[READ_REPLY_LEN];
+  scsi_req_t req;
+
+  safte_setup_read(&req, safte_cmd, buf, sizeof(buf));
+  if (scsi_dev_cmd(safte_dev->device, &req) < 0) {
+    safte_read_error(safte_cmd, &req.st);
+    return -1;
+  }
+  safte_dev->valid |= SAFTE_POLL_MASK(safte_cmd);
+  return decode(safte_dev, buf);
+}
+
+
+/* bytes a generation of an enclosure's element state takes, rounded
+   up so the next generation is aligned */
+static size_t safte_state_size(safte_device_t *saftedev)
+{
+  size_t size = sizeof(safte_state_t) +
+    saftedev->slots * sizeof(safte_slot_t) +
+    SAFTE_SLOT_WORDS(saftedev->slots) * sizeof(unsigned int) +
+    saftedev->tempsensors * sizeof(float) +
+    saftedev->slots * 4 +
+    saftedev->fans + saftedev->psus + saftedev->tempsensors;
+
+  return (size + sizeof(long) - 1) & ~(sizeof(long) - 1);
 }
 
 
-int get_safte_enclosure_config(int fd, safte_device_t *safte_dev)
+/* lay out a zeroed generation in mem, safte_state_size() bytes */
+static safte_state_t *safte_state_init(safte_device_t *saftedev,
+					void *mem)
 {
-  unsigned char* buf;
+  safte_state_t *state = mem;
+  unsigned char *p = (unsigned char*)(state + 1);
+
+  memset(mem, 0, safte_state_size(saftedev));
+  state->slot = (safte_slot_t*)p;
+  p += saftedev->slots * sizeof(safte_slot_t);
+  state->slot_changed = (unsigned int*)p;
+  p += SAFTE_SLOT_WORDS(saftedev->slots) * sizeof(unsigned int);
+  state->temp = (float*)p;
+  p += saftedev->tempsensors * sizeof(float);
+  state->status0 = p;
+  p += saftedev->slots;
+  state->status1 = p;
+  p += saftedev->slots;
+  state->status2 = p;
+  p += saftedev->slots;
+  state->status3 = p;
+  p += saftedev->slots;
+  state->fan = p;
+  p += saftedev->fans;
+  state->psu = p;
+  p += saftedev->psus;
+  state->temp_oor = p;
+
+  return state;
+}
+
+
+static void safte_state_copy(safte_device_t *saftedev, safte_state_t *to,
+			     safte_state_t *from)
+{
+  memcpy(to->slot, from->slot, saftedev->slots * sizeof(safte_slot_t));
+  memcpy(to->status0, from->status0, saftedev->slots);
+  memcpy(to->status1, from->status1, saftedev->slots);
+  memcpy(to->status2, from->status2, saftedev->slots);
+  memcpy(to->status3, from->status3, saftedev->slots);
+  memcpy(to->temp, from->temp, saftedev->tempsensors * sizeof(float));
+  memcpy(to->fan, from->fan, saftedev->fans);
+  memcpy(to->psu, from->psu, saftedev->psus);
+  memcpy(to->temp_oor, from->temp_oor, saftedev->tempsensors);
+  to->power_on_minutes = from->power_on_minutes;
+  to->power_cycles = from->power_cycles;
+  to->global_flags = from->global_flags;
+  to->doorlock = from->doorlock;
+  to->speaker = from->speaker;
+  to->temp_alert = from->temp_alert;
+}
+
+
+/* both generations of element state, in one allocation made when the
+   configuration is known. Polling allocates nothing after this */
+static int safte_state_alloc(safte_device_t *saftedev)
+{
+  size_t size = safte_state_size(saftedev);
+  void *mem;
+
+  if(!(mem = malloc(size * 2))) return -1;
+  free(saftedev->gen[0]);
+  saftedev->gen[0] = safte_state_init(saftedev, mem);
+  saftedev->gen[1] = safte_state_init(saftedev, (char*)mem + size);
+  saftedev->state = saftedev->gen[0];
+  saftedev->last = NULL;
+
+  return 0;
+}
 
-  buf = safte_read(fd, SAFTE_READ_ENCLOSURE_CONFIG);
 
+/* the state just checked becomes the last generation. The other one
+   carries it forward, as not every buffer is read every cycle, with no
+   slots changed yet */
+static void safte_state_swap(safte_device_t *saftedev)
+{
+  saftedev->last = saftedev->state;
+  saftedev->state = saftedev->gen[saftedev->state == saftedev->gen[0]];
+  safte_state_copy(saftedev, saftedev->state, saftedev->last);
+  memset(saftedev->state->slot_changed, 0,
+	 SAFTE_SLOT_WORDS(saftedev->slots) * sizeof(unsigned int));
+}
+
+
+int decode_safte_enclosure_config(safte_device_t *safte_dev,
+				unsigned char *buf)
+{
   safte_dev->fans = *(buf);
   safte_dev->psus = *(buf+1);
   safte_dev->slots = *(buf+2);
@@ -155,148 +366,386 @@ int get_safte_enclosure_config(int fd, safte_device_t *safte_dev)
   safte_dev->thermostats = *(buf+6) & 0x7f;
   safte_dev->celsius_flag = *(buf+6) & 0x80;
 
+  return safte_state_alloc(safte_dev);
+}
+
+int get_safte_enclosure_config(safte_device_t *safte_dev)
+{
+  return get_safte_buffer(safte_dev, SAFTE_READ_ENCLOSURE_CONFIG,
+			  decode_safte_enclosure_config);
+}
+
+/* the enclosure configuration from the discovery cache if it has it,
+   otherwise read from the device and remembered */
+static int get_safte_enclosure_config_cached(safte_device_t *safte_dev)
+{
+  unsigned char buf[SAFTE_CONFIG_LEN];
+
+  if(scsi_cache_data(safte_dev->device, buf, sizeof(buf)) == sizeof(buf)) {
+    safte_dev->valid |= SAFTE_POLL_MASK(SAFTE_READ_ENCLOSURE_CONFIG);
+    return decode_safte_enclosure_config(safte_dev, buf);
+  }
+  if(get_safte_enclosure_config(safte_dev) < 0) return -1;
+
+  buf[0] = safte_dev->fans;
+  buf[1] = safte_dev->psus;
+  buf[2] = safte_dev->slots;
+  buf[3] = safte_dev->doorlocks;
+  buf[4] = safte_dev->tempsensors;
+  buf[5] = safte_dev->audiblealarm;
+  buf[6] = safte_dev->thermostats | safte_dev->celsius_flag;
+  scsi_cache_set_data(safte_dev->device, buf, sizeof(buf));
+
   return 0;
 }
 
-int get_safte_enclosure_status(int fd, safte_device_t *safte_dev)
+int decode_safte_enclosure_status(safte_device_t *safte_dev,
+				unsigned char *buf)
 {
-  unsigned char* buf;
   int i;
   int toorf;
 
-  buf = safte_read(fd, SAFTE_READ_ENCLOSURE_STATUS);
-
   for(i=0; i < safte_dev->fans; i++) {
-    safte_dev->fan[i] = *(buf + i);
+    safte_dev->state->fan[i] = *(buf + i);
   }
 
   for(i=0; i < safte_dev->psus; i++) {
-    safte_dev->psu[i] = *(buf + safte_dev->fans + i);
+    safte_dev->state->psu[i] = *(buf + safte_dev->fans + i);
   }
 
   for(i=0; i < safte_dev->slots; i++) {
-    safte_dev->slot[i].id = *(buf + safte_dev->fans + safte_dev->psus + i);
+    safte_dev->state->slot[i].id = *(buf + safte_dev->fans + safte_dev->psus + i);
   }
 
-  safte_dev->doorlock = *(buf + safte_dev->fans + safte_dev->psus +
+  safte_dev->state->doorlock = *(buf + safte_dev->fans + safte_dev->psus +
 			  safte_dev->slots);
 
-  safte_dev->speaker = *(buf + safte_dev->fans + safte_dev->psus +
-			 safte_dev->slots + i);
+  safte_dev->state->speaker = *(buf + safte_dev->fans + safte_dev->psus +
+			 safte_dev->slots + 1);
 
   for(i=0; i < safte_dev->tempsensors; i++) {
-	safte_dev->temp[i] = *(buf + safte_dev->fans + safte_dev->psus +
+	safte_dev->state->temp[i] = *(buf + safte_dev->fans + safte_dev->psus +
 		   safte_dev->slots + 2 + i) - 10;
 #ifdef USE_CELCIUS
 	if ( ! safte_dev->celsius_flag )
 		/* Convert from Fahrenheit. */
-		safte_dev->temp[i] = (safte_dev->temp[i] - 32.0) * 5.0 / 9.0;
+		safte_dev->state->temp[i] = (safte_dev->state->temp[i] - 32.0) * 5.0 / 9.0;
 #else
 	if ( safte_dev->celsius_flag )
-		safte_dev->temp[i] = (safte_dev->temp[i] * 9.0 / 5.0) + 32.0;
+		safte_dev->state->temp[i] = (safte_dev->state->temp[i] * 9.0 / 5.0) + 32.0;
 #endif
   }
   toorf = *(buf + safte_dev->fans + safte_dev->psus + safte_dev->slots +
-	    safte_dev->tempsensors + 2 + i);
+	    safte_dev->tempsensors + 2);
   toorf <<= 8;
-  toorf &= *(buf + safte_dev->fans + safte_dev->psus + safte_dev->slots +
-	     safte_dev->tempsensors + 3 + i);
+  toorf |= *(buf + safte_dev->fans + safte_dev->psus + safte_dev->slots +
+	     safte_dev->tempsensors + 3);
   for(i=0; i < safte_dev->tempsensors; i++) {
-    safte_dev->temp_oor[i] = (toorf & (1 << i)) ? 1 : 0;
+    safte_dev->state->temp_oor[i] = (toorf & (1 << i)) ? 1 : 0;
   }
-  safte_dev->temp_alert = (toorf & 0xf000) ? 1 : 0;
+  safte_dev->state->temp_alert = (toorf & 0xf000) ? 1 : 0;
 
   return 0;
 }
 
-int get_safte_device_insertions(int fd, safte_device_t *safte_dev)
+int get_safte_enclosure_status(safte_device_t *safte_dev)
 {
-  unsigned char* buf;
-  int i;
+  return get_safte_buffer(safte_dev, SAFTE_READ_ENCLOSURE_STATUS,
+			  decode_safte_enclosure_status);
+}
 
-  buf = safte_read(fd, SAFTE_READ_DEVICE_INSERTIONS);
+int decode_safte_device_insertions(safte_device_t *safte_dev,
+				unsigned char *buf)
+{
+  int i, n = safte_dev->slots;
 
-  for(i=0; i < safte_dev->slots; i++) {
-    safte_dev->slot[i].insertions = (*(buf + i*2) << 8) + *(buf + i*2 + 1);
+  /* no more than fit in the reply */
+  if(n > READ_REPLY_LEN / 2) n = READ_REPLY_LEN / 2;
+  for(i=0; i < n; i++) {
+    safte_dev->state->slot[i].insertions = (*(buf + i*2) << 8) + *(buf + i*2 + 1);
   }
 
   return 0;
 }
 
-int get_safte_device_slot_status(int fd, safte_device_t *safte_dev)
+int get_safte_device_insertions(safte_device_t *safte_dev)
 {
-  unsigned char* buf;
-  int i;
+  return get_safte_buffer(safte_dev, SAFTE_READ_DEVICE_INSERTIONS,
+			  decode_safte_device_insertions);
+}
 
-  buf = safte_read(fd, SAFTE_READ_DEVICE_SLOT_STATUS);
+/* the slots that changed since the last check are flagged as the
+   bytes are unpacked */
+int decode_safte_device_slot_status(safte_device_t *safte_dev,
+				unsigned char *buf)
+{
+  safte_state_t *state = safte_dev->state;
+  safte_state_t *last = safte_dev->last ? safte_dev->last : state;
+  unsigned char *status[4];
+  int n = safte_dev->slots;
+
+  /* no more than fit in the reply */
+  if(n > READ_REPLY_LEN / 4) n = READ_REPLY_LEN / 4;
+  status[0] = state->status0;
+  status[1] = state->status1;
+  status[2] = state->status2;
+  status[3] = state->status3;
+  safte_slot_unpack(buf, n, status, last->status0, last->status3,
+		    state->slot_changed);
 
-  for(i=0; i < safte_dev->slots; i++) {
-    safte_dev->slot[i].status0 = *(buf + i*4);
-    safte_dev->slot[i].status1 = *(buf + i*4 + 1);
-    safte_dev->slot[i].status2 = *(buf + i*4 + 2);
-    safte_dev->slot[i].status3 = *(buf + i*4 + 3);
-  }
+  return 0;
+}
+
+int get_safte_device_slot_status(safte_device_t *safte_dev)
+{
+  return get_safte_buffer(safte_dev, SAFTE_READ_DEVICE_SLOT_STATUS,
+			  decode_safte_device_slot_status);
+}
+
+int decode_safte_usage_statistics(safte_device_t *safte_dev,
+				  unsigned char *buf)
+{
+  safte_dev->state->power_on_minutes = ((unsigned long)*(buf) << 24) +
+    (*(buf+1) << 16) + (*(buf+2) << 8) + *(buf+3);
+  safte_dev->state->power_cycles = ((unsigned long)*(buf+4) << 24) +
+    (*(buf+5) << 16) + (*(buf+6) << 8) + *(buf+7);
 
   return 0;
 }
 
+int get_safte_usage_statistics(safte_device_t *safte_dev)
+{
+  return get_safte_buffer(safte_dev, SAFTE_READ_USAGE_STATISTICS,
+			  decode_safte_usage_statistics);
+}
 
-int map_slots_to_devices()
+int decode_safte_global_flags(safte_device_t *safte_dev,
+			      unsigned char *buf)
+{
+  safte_dev->state->global_flags = *(buf) + (*(buf+1) << 8);
+
+  return 0;
+}
+
+int get_safte_global_flags(safte_device_t *safte_dev)
+{
+  return get_safte_buffer(safte_dev, SAFTE_READ_GLOBAL_FLAGS,
+			  decode_safte_global_flags);
+}
+
+
+/* decoders indexed by read buffer id */
+static int (*safte_decode[])(safte_device_t *, unsigned char *) = {
+  decode_safte_enclosure_config,
+  decode_safte_enclosure_status,
+  decode_safte_usage_statistics,
+  decode_safte_device_insertions,
+  decode_safte_device_slot_status,
+  decode_safte_global_flags
+};
+
+
+/* the disk on the same bus as an enclosure at a slot's SCSI id, found
+   through the target index. Only devices with a block device count, a
+   hardware RAID logical drive won't map to a physical slot */
+static scsi_device_t *slot_find_device(safte_device_t *saftedev, int s)
+{
+  scsi_device_t *scsidev;
+
+  scsidev = find_dev_by_target(saftedev->device->host,
+			       saftedev->device->channel,
+			       saftedev->state->slot[s].id);
+  while(scsidev && (!scsidev->device || scsidev->active <= 0))
+    scsidev = scsi_index_next(SCSI_INDEX_TARGET, scsidev);
+
+  return scsidev;
+}
+
+
+/* map every slot of an enclosure to the disk in it */
+void safte_map_slots(safte_device_t *saftedev)
 {
   int i;
+
+  for(i=0; i < saftedev->slots; i++)
+    saftedev->state->slot[i].device = slot_find_device(saftedev, i);
+  render_forget_slots(saftedev);
+}
+
+
+int map_slots_to_devices()
+{
   safte_device_t *saftedev;
-  scsi_device_t *scsidev;
 
-  scsidev = scsidev_head;
-  while(scsidev->next) {
-    saftedev = saftedev_head;
-    while(saftedev->next) {
-      for(i=0; i < saftedev->slots; i++)
-	{
-	  if(saftedev->device->host == scsidev->host &&
-	     saftedev->device->channel == scsidev->channel &&
-	     saftedev->slot[i].id == scsidev->id && scsidev->device)
-	    {
-	      saftedev->slot[i].device = scsidev;
-	    }
-	}
-      saftedev = saftedev->next;
+  for(saftedev = saftedev_head; saftedev->next; saftedev = saftedev->next)
+    safte_map_slots(saftedev);
+
+  return 0;
+}
+
+
+/* remap the slots a disk that came or went sits in. Returns the number
+   of slots remapped, which the page has to show again even if the
+   same entry came back under another name */
+int safte_map_device(scsi_device_t *scsidev)
+{
+  safte_device_t *saftedev;
+  int i, n = 0;
+
+  for(saftedev = saftedev_head; saftedev->next; saftedev = saftedev->next) {
+    if(saftedev->device->host != scsidev->host ||
+       saftedev->device->channel != scsidev->channel) continue;
+    for(i=0; i < saftedev->slots; i++) {
+      if(saftedev->state->slot[i].id != scsidev->id) continue;
+      saftedev->state->slot[i].device = slot_find_device(saftedev, i);
+      render_forget_slots(saftedev);
+      n++;
     }
-    scsidev = scsidev->next;
   }
 
-  return 0;
+  return n;
 }
 
 
-int scan_safte_devices()
+/* two SCSI devices are paths to the same enclosure if they report the
+   same INQUIRY serial number or, on fibre channel, the same WWNN */
+static int safte_same_enclosure(scsi_device_t *a, scsi_device_t *b)
 {
-  int fd, safte_num = 0;
-  safte_device_t *saftedev = saftedev_head;
-  scsi_device_t *scsidev = scsidev_head;
+  if(a->serial[0] && b->serial[0]) return !strcmp(a->serial, b->serial);
+  return a->isfc && b->isfc && a->wwnn[0] && !strcmp(a->wwnn, b->wwnn);
+}
 
-  while(scsidev->next) {
-    if(scsidev->type == TYPE_PROCESSOR &&
-       strncmp(scsidev->safteid, "SAF-TE", 6) == 0) {
-	
-      saftedev->device = scsidev;
-      fd = open(scsidev->sg_device, O_RDWR);
-      if (fd < 0) {
-	perror("open");
-	exit(1);
-      }
-      get_safte_enclosure_config(fd, saftedev);
-      get_safte_enclosure_status(fd, saftedev);
-      get_safte_device_insertions(fd, saftedev);
-      close(fd);
-      saftedev->next = calloc(1, sizeof(safte_device_t));
-      saftedev = saftedev->next;
-      safte_num++;
+
+/* the enclosure a SCSI device is a path to, NULL if none */
+static safte_device_t *safte_find_enclosure(scsi_device_t *scsidev)
+{
+  safte_device_t *saftedev;
+
+  for(saftedev = saftedev_head; saftedev->next; saftedev = saftedev->next)
+    if(safte_same_enclosure(saftedev->device, scsidev)) return saftedev;
+  return NULL;
+}
+
+
+/* the enclosure a SCSI device is one of the paths of, NULL if none */
+safte_device_t *safte_find_path(scsi_device_t *scsidev)
+{
+  safte_device_t *saftedev;
+  int i;
+
+  for(saftedev = saftedev_head; saftedev->next; saftedev = saftedev->next)
+    for(i = 0; i < saftedev->paths; i++)
+      if(saftedev->path[i] == scsidev) return saftedev;
+  return NULL;
+}
+
+
+/* add a SCSI device to the end of the enclosure list if it is a SAF-TE
+   device that answers. A further path to an enclosure already on the
+   list is kept as an alternate instead. Returns the new enclosure or
+   NULL */
+safte_device_t *safte_attach(scsi_device_t *scsidev)
+{
+  safte_device_t *saftedev, *next;
+  char name[SAFTE_NAME_LEN];
+  long long start;
+  int rv;
+
+  if(scsidev->type != TYPE_PROCESSOR ||
+     strncmp(scsidev->safteid, "SAF-TE", 6) != 0) return NULL;
+
+  if((saftedev = safte_find_enclosure(scsidev))) {
+    if(saftedev->paths < SAFTE_MAX_PATHS &&
+       !safte_find_path(scsidev)) {
+      saftedev->path[saftedev->paths++] = scsidev;
+      syslog(LOG_INFO, "%s: alternate path %s",
+	     safte_name_r(saftedev, name, sizeof(name)), scsidev->sg_device);
     }
-    scsidev = scsidev->next;
+    return NULL;
+  }
+
+  for(saftedev = saftedev_head; saftedev->next; saftedev = saftedev->next);
+  saftedev->device = scsidev;
+  start = safte_startup_now();
+  rv = scsi_dev_open(scsidev) < 0 ||
+    get_safte_enclosure_config_cached(saftedev) < 0 ||
+    get_safte_enclosure_status(saftedev) < 0 ||
+    get_safte_device_insertions(saftedev) < 0;
+  safte_startup_time(SAFTE_STARTUP_ENCLOSURE, start);
+  if(rv || !(next = calloc(1, sizeof(safte_device_t)))) {
+    fprintf(stderr, "%s: can't read SAF-TE configuration, skipping\n",
+	    scsidev->sg_device);
+    scsi_dev_close(scsidev);
+    free(saftedev->gen[0]);
+    memset(saftedev, 0, sizeof(safte_device_t));
+    return NULL;
+  }
+  saftedev->path[0] = scsidev;
+  saftedev->paths = 1;
+  saftedev->next = next;
+
+  return saftedev;
+}
+
+
+/* take an enclosure that has gone away off the list */
+void safte_detach(safte_device_t *saftedev)
+{
+  safte_device_t **p;
+
+  for(p = &saftedev_head; *p != saftedev; p = &(*p)->next)
+    if(!(*p)->next) return;
+  *p = saftedev->next;
+
+  safte_poll_detach(saftedev);
+  safte_sched_detach(saftedev);
+  safte_render_free(saftedev);
+  scsi_dev_close(saftedev->device);
+  free(saftedev->gen[0]);
+  free(saftedev);
+}
+
+
+/* drop a path that has gone away. If the enclosure was being polled
+   through it the preferred remaining path takes over. Returns the
+   number of paths left */
+int safte_detach_path(safte_device_t *saftedev, scsi_device_t *scsidev)
+{
+  int i;
+
+  for(i = 0; i < saftedev->paths && saftedev->path[i] != scsidev; i++);
+  if(i == saftedev->paths) return saftedev->paths;
+  memmove(&saftedev->path[i], &saftedev->path[i + 1],
+	  (saftedev->paths - i - 1) * sizeof(scsi_device_t*));
+  saftedev->paths--;
+
+  if(saftedev->device == scsidev && saftedev->paths) {
+    scsi_dev_close(scsidev);
+    saftedev->device = saftedev->path[0];
   }
 
-  return safte_num;
+  return saftedev->paths;
+}
+
+
+/* poll an enclosure that stopped answering through its next path.
+   Returns 1 if it has another path to try */
+int safte_failover(safte_device_t *saftedev)
+{
+  char name[SAFTE_NAME_LEN];
+  scsi_device_t *from = saftedev->device;
+  int i;
+
+  if(saftedev->paths < 2) return 0;
+  safte_name_r(saftedev, name, sizeof(name));
+  for(i = 0; i < saftedev->paths && saftedev->path[i] != from; i++);
+  saftedev->device = saftedev->path[(i + 1) % saftedev->paths];
+  scsi_dev_close(from);
+
+  syslog(LOG_WARNING, "%s: path %s failed, failing over to %s",
+	 name, from->sg_device, saftedev->device->sg_device);
+  safte_map_slots(saftedev);
+  return 1;
 }
 
 
@@ -313,70 +762,157 @@ int free_saftedev(scsi_device_t *saftedev)
 }
 
 
-static char* status_str(int system, int code)
+/* build the lookup tables from statuscodes[]. Codes not in the table
+   are an unknown status, which is severe */
+void safte_status_init(void)
 {
-  safte_status_code_t *s = statuscodes;
-  while(s->system) {
-    if(s->system == system && s->code == code) return s->desc;
-    s++;
+  safte_status_code_t *s;
+  int system, code;
+
+  for(system = 0; system < SAFTE_STATUS_SYSTEMS; system++)
+    for(code = 0; code < 256; code++) {
+      status_desc[system][code] = "unknown status";
+      status_sev[system][code] = 1;
+    }
+  for(s = statuscodes; s->system; s++) {
+    if(s->system == SAFTE_SLOT_BYTE0_STATUS && s->severity > 0)
+      slot_severe0 |= s->code;
+    if(s->system == SAFTE_SLOT_BYTE3_STATUS && s->severity > 0)
+      slot_severe3 |= s->code;
+    if(s->system == SAFTE_GLOBAL_STATUS && s->severity > 0)
+      global_severe |= s->code;
+    if(s->code & ~0xff) continue;
+    status_desc[s->system][s->code] = s->desc;
+    status_sev[s->system][s->code] = s->severity;
   }
-  return "unknown status";
 }
 
 
-static char* slot_status_str(int byte0, int byte3, int html)
+static const char* status_str(int system, int code)
+{
+  if(code < 0 || code > 0xff) return "unknown status";
+  return status_desc[system][code];
+}
+
+
+/* append to a bounded string buffer */
+static void str_append(char *buf, size_t size, const char *s)
+{
+  size_t l = strlen(buf);
+
+  if(l + 1 < size) strncat(buf, s, size - l - 1);
+}
+
+
+/* describe the slot status bytes in the caller's buffer */
+static char* slot_status_build(int byte0, int byte3, int html,
+			       char *buf, size_t size)
 {
-  static char message[1024];
   safte_status_code_t *s = statuscodes;
 
   int first = 1;
-  message[0] = '\0';
+  buf[0] = '\0';
   if(byte3 == 0) {
-    strcat(message, status_str(SAFTE_SLOT_BYTE3_STATUS,
-			       SAFTE_SLOT_BYTE3_NOTPRESENT));
+    str_append(buf, size, status_str(SAFTE_SLOT_BYTE3_STATUS,
+				     SAFTE_SLOT_BYTE3_NOTPRESENT));
     first = 0;
   }
   while(s->system) {
     if((s->system == SAFTE_SLOT_BYTE0_STATUS && (s->code & byte0)) ||
        (s->system == SAFTE_SLOT_BYTE3_STATUS && (s->code & byte3))) {
       if(!first) {
-	if(html) strcat(message, "<br>");
-	else strcat(message, ",");
+	if(html) str_append(buf, size, "<br>");
+	else str_append(buf, size, ",");
       }
-      strcat(message, s->desc);
+      str_append(buf, size, s->desc);
       first = 0;
     }
     s++;
   }
-  return message;
+  return buf;
 }
 
 
-static int status_severity(int system, int code)
+/* the disk mapped to a slot as " (sdc, serial ...)", empty if there
+   isn't one */
+static char* slot_disk_str_r(safte_slot_t *slot, char *buf, size_t size)
 {
-  safte_status_code_t *s = statuscodes;
-  while(s->system) {
-    if(s->system == system && s->code == code) return s->severity;
-    s++;
+  scsi_device_t *scsidev = slot->device;
+  const char *name;
+  int room = size - sizeof(" (, serial )"), len;
+
+  buf[0] = '\0';
+  if(!scsidev || !scsidev->device || room < 0) return buf;
+  name = strncmp(scsidev->device, "/dev/", 5) ? scsidev->device :
+    scsidev->device + 5;
+  /* the serial number gives way to the name */
+  if((len = strlen(name)) > room) len = room;
+  if(scsidev->serial[0])
+    snprintf(buf, size, " (%.*s, serial %.*s)", len, name, room - len,
+	     scsidev->serial);
+  else
+    snprintf(buf, size, " (%.*s)", len, name);
+
+  return buf;
+}
+
+
+/* the description of the slot status bytes, shared and never freed.
+   The poller and the web server both ask, so a description built by
+   both at once is kept by whichever stores it first */
+const char* slot_status_str(int byte0, int byte3, int html)
+{
+  int key3 = (byte3 & SAFTE_SLOT_BYTE3_MASK) |
+    ((byte3 & ~SAFTE_SLOT_BYTE3_MASK & 0xff) ? SAFTE_SLOT_BYTE3_MASK + 1 : 0);
+  char **desc = &slot_desc[html ? 1 : 0][byte0 & 0xff][key3];
+  char buf[SAFTE_SLOT_STATUS_LEN], *str, *prev = NULL;
+
+  if((str = __atomic_load_n(desc, __ATOMIC_ACQUIRE))) return str;
+
+  slot_status_build(byte0 & 0xff, byte3 & 0xff, html, buf, sizeof(buf));
+  if(!(str = strdup(buf))) return "unknown status";
+  if(!__atomic_compare_exchange_n(desc, &prev, str, 0, __ATOMIC_ACQ_REL,
+				  __ATOMIC_ACQUIRE)) {
+    free(str);
+    str = prev;
   }
-  /* unknown status is severe */
-  return 1;
+  return str;
+}
+
+
+static int status_severity(int system, int code)
+{
+  if(code < 0 || code > 0xff) return 1;
+  return status_sev[system][code];
 }
 
 
 static int slot_status_severity(int byte0, int byte3)
 {
-  safte_status_code_t *s = statuscodes;
-  int severity = 0;
+  return ((byte0 & slot_severe0) | (byte3 & slot_severe3)) != 0;
+}
 
-  while(s->system) {
-    if(s->system == SAFTE_SLOT_BYTE0_STATUS &&
-       (s->code & byte0) && s->severity > severity) severity = s->severity;
-    if(s->system == SAFTE_SLOT_BYTE3_STATUS &&
-       (s->code & byte3) && s->severity > severity) severity = s->severity;
-    s++;
+
+/* describe the global flags that are set in the caller's buffer */
+static char* global_flags_str_r(int flags, int html, char *buf, size_t size)
+{
+  safte_status_code_t *s;
+
+  buf[0] = '\0';
+  for(s = statuscodes; s->system; s++) {
+    if(s->system != SAFTE_GLOBAL_STATUS || !(s->code & flags)) continue;
+    if(buf[0]) str_append(buf, size, html ? "<br>" : ",");
+    str_append(buf, size, s->desc);
   }
-  return severity;
+  if(!buf[0]) str_append(buf, size, "none");
+
+  return buf;
+}
+
+
+static int global_flags_severity(int flags)
+{
+  return (flags & global_severe) != 0;
 }
 
 
@@ -396,48 +932,71 @@ static char* system_name(int system)
     return "speaker";
   case SAFTE_TEMP_STATUS:
     return "temp sensor";
+  case SAFTE_LINK_STATUS:
+    return "enclosure";
+  case SAFTE_GLOBAL_STATUS:
+    return "global flags";
   }
 
   return "unknown";
 }
 
 
-static char* safte_name(safte_device_t *saftedev)
+/* format the device name in the caller's buffer */
+char* safte_name_r(safte_device_t *saftedev, char *buf, size_t size)
 {
-  static char saftename[256];
+  snprintf(buf, size, "SAF-TE Device %s %s (%d:%d:%d:%d)",
+	   saftedev->device->vendor, saftedev->device->product,
+	   saftedev->device->host, saftedev->device->channel,
+	   saftedev->device->id, saftedev->device->lun);
 
-  sprintf(saftename, "SAF-TE Device %s %s (%d:%d:%d:%d)",
-	  saftedev->device->vendor, saftedev->device->product,
-	  saftedev->device->host, saftedev->device->channel,
-	  saftedev->device->id, saftedev->device->lun);
+  return buf;
+}
 
-  return saftename;
+
+char* safte_name(safte_device_t *saftedev)
+{
+  static char saftename[SAFTE_NAME_LEN];
+
+  return safte_name_r(saftedev, saftename, sizeof(saftename));
 }
 
 
 static int run_alert_prog(safte_device_t *saftedev,
 			  int system, int partno, int code, char *message)
 {
+  pid_t pid;
   int status;
   char system_str[16];
   char code_str[16];
   char partno_str[16];
+  char name[SAFTE_NAME_LEN];
+
+  safte_name_r(saftedev, name, sizeof(name));
 
   sprintf(system_str, "%d", system);
   sprintf(partno_str, "%d", partno);
   sprintf(code_str, "%d", code);
 
-  if(fork() == 0) {
-    if(execl(alert_prog, alert_prog,
-	     safte_name(saftedev), message,
-	     system_str, partno_str, code_str, NULL) < 0) {
-      syslog(LOG_ERR, "error exec %s: %s", alert_prog, strerror(errno));
-      return -1;
-    }
-  } else {
-    if(wait(&status) < 0) {
+  /* we run on the poller thread, so the child may only exec or exit,
+     and only our own child is waited for. mathopd's SIGCHLD handler
+     can get to it first, which shows up here as ECHILD */
+  pid = fork();
+  if(pid == 0) {
+    execl(alert_prog, alert_prog,
+	  name, message, system_str, partno_str, code_str, NULL);
+    _exit(127);
+  } else if(pid < 0) {
+    syslog(LOG_ERR, "error fork: %s", strerror(errno));
+    return -1;
+  }
+
+  if(waitpid(pid, &status, 0) < 0) {
+    if(errno != ECHILD)
       syslog(LOG_ERR, "error wait: %s", strerror(errno));
-    }
+  } else if(WIFEXITED(status) && WEXITSTATUS(status) == 127) {
+    syslog(LOG_ERR, "error exec %s", alert_prog);
+    return -1;
   }
 
   return 0;
@@ -447,13 +1006,16 @@ static void log_status_alert(safte_device_t *saftedev,
 			     int system, int partno, int code)
 {
   char message[1024];
+  char name[SAFTE_NAME_LEN];
+
+  safte_name_r(saftedev, name, sizeof(name));
 
   if(partno == -1) sprintf(message, "%s is %s",
 			   system_name(system), status_str(system, code));
   else sprintf(message, "%s %d %s",
 	       system_name(system), partno, status_str(system, code));
 
-  syslog(LOG_ALERT, "%s: ALERT %s", safte_name(saftedev), message);
+  syslog(LOG_ALERT, "%s: ALERT %s", name, message);
 
   if(alert_prog) run_alert_prog(saftedev, system, partno, code, message);
 }
@@ -463,15 +1025,20 @@ static void log_slot_status_alert(safte_device_t *saftedev,
 				  int partno, int byte0, int byte3)
 {
   char message[1024];
+  const char *slotmsg = slot_status_str(byte0, byte3, 0);
+  char name[SAFTE_NAME_LEN];
+  char disk[SAFTE_NAME_LEN] = "";
+
+  safte_name_r(saftedev, name, sizeof(name));
+  if(partno >= 0)
+    slot_disk_str_r(&saftedev->state->slot[partno], disk, sizeof(disk));
 
   if(partno == -1) sprintf(message, "%s is %s",
-			   system_name(SAFTE_SLOT_BYTE3_STATUS),
-			   slot_status_str(byte0, byte3, 0));
-  else sprintf(message, "%s %d is %s",
-	       system_name(SAFTE_SLOT_BYTE3_STATUS),
-	       partno, slot_status_str(byte0, byte3, 0));
+			   system_name(SAFTE_SLOT_BYTE3_STATUS), slotmsg);
+  else sprintf(message, "%s %d%s is %s",
+	       system_name(SAFTE_SLOT_BYTE3_STATUS), partno, disk, slotmsg);
 
-  syslog(LOG_ALERT, "%s: ALERT %s", safte_name(saftedev), message);
+  syslog(LOG_ALERT, "%s: ALERT %s", name, message);
 
   if(alert_prog) run_alert_prog(saftedev, SAFTE_SLOT_BYTE3_STATUS,
 				partno, byte3, message);
@@ -481,12 +1048,15 @@ static void log_slot_status_alert(safte_device_t *saftedev,
 static void log_temp_alert(safte_device_t *saftedev, int sensorno, float temp)
 {
   char message[1024];
+  char name[SAFTE_NAME_LEN];
+
+  safte_name_r(saftedev, name, sizeof(name));
 
   sprintf(message, "temp sensor %d reads %0.1f degrees "
 	  "which is %0.1f degrees over max temp of %0.1f degrees",
 	  sensorno, temp, temp - max_temp, max_temp);
 
-  syslog(LOG_ALERT, "%s: ALERT %s", safte_name(saftedev), message);
+  syslog(LOG_ALERT, "%s: ALERT %s", name, message);
 
   if(alert_prog) run_alert_prog(saftedev,
 				SAFTE_TEMP_STATUS, sensorno,
@@ -498,13 +1068,16 @@ static void log_status_change(safte_device_t *saftedev,
 			      int system, int partno, int oldcode, int newcode)
 {
   char message[1024];
+  char name[SAFTE_NAME_LEN];
+
+  safte_name_r(saftedev, name, sizeof(name));
 
   if(partno == -1) sprintf(message, "%s: %s changed from '%s' to '%s'",
-			   safte_name(saftedev), system_name(system),
+			   name, system_name(system),
 			   status_str(system, oldcode),
 			   status_str(system, newcode));
   else sprintf(message, "%s: %s %d changed from '%s' to '%s'",
-	       safte_name(saftedev), system_name(system), partno,
+	       name, system_name(system), partno,
 	       status_str(system, oldcode),
 	       status_str(system, newcode));
 
@@ -522,19 +1095,22 @@ static void log_slot_status_change(safte_device_t *saftedev, int partno,
 				   int newbyte0, int newbyte3)
 {
   char message[1024];
-  char old_slotmsg[1024];
-  char new_slotmsg[1024];
+  const char *old_slotmsg = slot_status_str(oldbyte0, oldbyte3, 0);
+  const char *new_slotmsg = slot_status_str(newbyte0, newbyte3, 0);
+  char name[SAFTE_NAME_LEN];
+  char disk[SAFTE_NAME_LEN] = "";
 
-  strcpy(old_slotmsg, slot_status_str(oldbyte0, oldbyte3, 0));
-  strcpy(new_slotmsg, slot_status_str(newbyte0, newbyte3, 0));
+  safte_name_r(saftedev, name, sizeof(name));
+  if(partno >= 0)
+    slot_disk_str_r(&saftedev->state->slot[partno], disk, sizeof(disk));
 
   if(partno == -1) sprintf(message, "%s: %s changed from '%s' to '%s'",
-			   safte_name(saftedev),
+			   name,
 			   system_name(SAFTE_SLOT_BYTE3_STATUS),
 			   old_slotmsg, new_slotmsg);
-  else sprintf(message, "%s: %s %d changed from '%s' to '%s'",
-	       safte_name(saftedev),
-	       system_name(SAFTE_SLOT_BYTE3_STATUS), partno,
+  else sprintf(message, "%s: %s %d%s changed from '%s' to '%s'",
+	       name,
+	       system_name(SAFTE_SLOT_BYTE3_STATUS), partno, disk,
 	       old_slotmsg, new_slotmsg);
 
   syslog(LOG_INFO, "%s", message);
@@ -546,15 +1122,54 @@ static void log_slot_status_change(safte_device_t *saftedev, int partno,
 }
 
 
+static void log_global_flags_alert(safte_device_t *saftedev, int flags)
+{
+  char message[1024];
+  char flagmsg[SAFTE_SLOT_STATUS_LEN];
+  char name[SAFTE_NAME_LEN];
+
+  safte_name_r(saftedev, name, sizeof(name));
+  global_flags_str_r(flags, 0, flagmsg, sizeof(flagmsg));
+  sprintf(message, "%s are %s", system_name(SAFTE_GLOBAL_STATUS), flagmsg);
+
+  syslog(LOG_ALERT, "%s: ALERT %s", name, message);
+
+  if(alert_prog) run_alert_prog(saftedev, SAFTE_GLOBAL_STATUS, -1,
+				flags, message);
+}
+
+
+static void log_global_flags_change(safte_device_t *saftedev,
+				    int oldflags, int newflags)
+{
+  char old_flagmsg[SAFTE_SLOT_STATUS_LEN];
+  char new_flagmsg[SAFTE_SLOT_STATUS_LEN];
+  char name[SAFTE_NAME_LEN];
+
+  safte_name_r(saftedev, name, sizeof(name));
+  global_flags_str_r(oldflags, 0, old_flagmsg, sizeof(old_flagmsg));
+  global_flags_str_r(newflags, 0, new_flagmsg, sizeof(new_flagmsg));
+
+  syslog(LOG_INFO, "%s: %s changed from '%s' to '%s'", name,
+	 system_name(SAFTE_GLOBAL_STATUS), old_flagmsg, new_flagmsg);
+
+  if(global_flags_severity(newflags) > 0 || alert_noncrit)
+    log_global_flags_alert(saftedev, newflags);
+}
+
+
 static void log_temp_change(safte_device_t *saftedev,
 			    int sensorno, float oldtemp, float newtemp)
 {
   char message[1024];
+  char name[SAFTE_NAME_LEN];
+
+  safte_name_r(saftedev, name, sizeof(name));
 
   if(log_temp) {
     sprintf(message, "%s: temp sensor %d changed from "
 	    "'%0.1f degrees' to '%0.1f degrees'",
-	    safte_name(saftedev), sensorno, oldtemp, newtemp);
+	    name, sensorno, oldtemp, newtemp);
 
     syslog(LOG_INFO, "%s", message);
   }
@@ -568,8 +1183,9 @@ static void parse_command_line(int argc, char *argv[])
 {
   int c;
   int error_flag = 0, help_flag = 0;
+  int timeout;
 
-  while ((c = getopt(argc, argv, "hpnaNTA:t:")) != EOF)
+  while ((c = getopt(argc, argv, "hpnaNTA:t:w:Q:S:U:C:R:")) != EOF)
     switch (c)
       {
       case 'p':
@@ -599,6 +1215,35 @@ static void parse_command_line(int argc, char *argv[])
 	  fprintf(stderr, "max temp must be a number\n");
 	}
 	break;
+      case 'w':
+	if(sscanf(optarg, "%d", &timeout) != 1 || timeout <= 0 ||
+	   timeout > UINT_MAX / 1000) {
+	  error_flag++;
+	  fprintf(stderr, "scsi timeout must be a positive number of "
+		  "seconds no more than %u\n", UINT_MAX / 1000);
+	} else {
+	  scsi_timeout = (unsigned)timeout * 1000;
+	}
+	break;
+      case 'Q':
+	if(sscanf(optarg, "%d", &safte_poll_host_max) != 1 ||
+	   safte_poll_host_max < 0) {
+	  error_flag++;
+	  fprintf(stderr, "commands per host adapter must be a number\n");
+	}
+	break;
+      case 'S':
+	sim_file = optarg;
+	break;
+      case 'U':
+	safte_hotplug_replay = optarg;
+	break;
+      case 'C':
+	scsi_cache_file = strcmp(optarg, "none") ? optarg : NULL;
+	break;
+      case 'R':
+	scsi_sysfs_root = optarg;
+	break;
       case '?':
 	error_flag++;
       }
@@ -607,7 +1252,10 @@ static void parse_command_line(int argc, char *argv[])
   if (error_flag || help_flag)
     {
       fprintf(stderr, "usage:\t%s [-h] [-p] [-n] [-a] [-T] "
-	      "[-t <max_temp>] [-A <alert_prog>]\n\n", argv[0]);
+	      "[-t <max_temp>] [-w <timeout>] [-Q <cmds>] "
+	      "[-A <alert_prog>] [-S <sim_file>] [-U <socket>] "
+	      "[-C <cache_file>] [-R <sysfs_root>]\n\n",
+	      argv[0]);
       fprintf(stderr,
 	      "-h     show this help message\n"
 	      "-p     print - print device scan information\n"
@@ -615,166 +1263,307 @@ static void parse_command_line(int argc, char *argv[])
 	      "-N     alert for non critical state changes\n"
 	      "-A <f> program to run for alerts\n"
 	      "-t <n> max temperature (default %0.1f " TEMP_UNIT ")\n"
+	      "-w <n> SCSI command timeout in seconds (default %d)\n"
+	      "-Q <n> max commands in flight per host adapter, 0 for no "
+	      "limit (default %d)\n"
 	      "-n     numeric sg device names eg. /dev/sg0 (default)\n"
-	      "-a     alpha sg device names eg. /dev/sga\n",
-	      MAX_TEMP_DEFAULT);
+	      "-a     alpha sg device names eg. /dev/sga\n"
+	      "-S <f> monitor simulated enclosures described in <f> instead "
+	      "of SCSI devices\n"
+	      "-U <s> read hot-plug uevents from a datagram socket bound at <s> "
+	      "instead of netlink\n"
+	      "-C <f> discovery cache file, none for no cache (default %s)\n"
+	      "-R <d> where sysfs is mounted (default %s)\n",
+	      MAX_TEMP_DEFAULT, SCSI_DEFAULT_TIMEOUT / 1000,
+	      SAFTE_POLL_HOST_MAX, SCSI_CACHE_FILE, SCSI_SYSFS_ROOT);
       exit(1);
     }
 }
 
 
-int check_safte_status()
+static void check_safte_device(safte_device_t *saftedev)
 {
-  int fd, s;
-  safte_device_t *saftedev = saftedev_head;
+  unsigned int bits;
+  int s, w;
+
+  if(saftedev->last) {
+    /* compare safte data for status changes */
+
+    /* check power supplies */
+    for(s =0; s<saftedev->psus; s++)
+      if(saftedev->state->psu[s] != saftedev->last->psu[s])
+	log_status_change(saftedev, SAFTE_PSU_STATUS, s,
+			  saftedev->last->psu[s],
+			  saftedev->state->psu[s]);
+
+    /* check fans */
+    for(s =0; s<saftedev->fans; s++)
+      if(saftedev->state->fan[s] != saftedev->last->fan[s])
+	log_status_change(saftedev, SAFTE_FAN_STATUS, s,
+			  saftedev->last->fan[s],
+			  saftedev->state->fan[s]);
+
+    /* check device slots, only those flagged as they were unpacked */
+    for(w = 0; w < SAFTE_SLOT_WORDS(saftedev->slots); w++)
+      for(bits = saftedev->state->slot_changed[w]; bits; bits &= bits - 1) {
+	s = w * 32 + __builtin_ctz(bits);
+	log_slot_status_change(saftedev, s,
+			       saftedev->last->status0[s],
+			       saftedev->last->status3[s],
+			       saftedev->state->status0[s],
+			       saftedev->state->status3[s]);
+      }
 
-  while(saftedev->next) {
-    /* fetch safte data */
-    fd = open(saftedev->device->sg_device, O_RDWR);
-    if (fd < 0) {
-      syslog(LOG_ERR, "open(%s): %s",
-	     saftedev->device->sg_device, strerror(errno));
-      exit(1);
+    /* check door lock */
+    if(saftedev->doorlocks &&
+       saftedev->state->doorlock != saftedev->last->doorlock)
+      log_status_change(saftedev, SAFTE_SLOT_BYTE3_STATUS, -1,
+			saftedev->last->doorlock,
+			saftedev->state->doorlock);
+
+    /* check speaker */
+    if(saftedev->audiblealarm &&
+       saftedev->state->speaker != saftedev->last->speaker)
+      log_status_change(saftedev, SAFTE_SPEAKER_STATUS, -1,
+			saftedev->last->speaker,
+			saftedev->state->speaker);
+
+    /* check temp sensors */
+    for(s =0; s<saftedev->tempsensors; s++) {
+      if(saftedev->state->temp[s] != saftedev->last->temp[s])
+	log_temp_change(saftedev, s,
+			saftedev->last->temp[s],
+			saftedev->state->temp[s]);
+      if(saftedev->state->temp_oor[s] !=
+	 saftedev->last->temp_oor[s])
+	log_status_change(saftedev, SAFTE_TEMP_STATUS, s,
+			  saftedev->last->temp[s],
+			  saftedev->state->temp[s]);
     }
-    get_safte_enclosure_status(fd, saftedev);
-    get_safte_device_slot_status(fd, saftedev);
-    close(fd);
-
-    if(saftedev->copy) {
-      /* compare safte data for status changes */
-
-      /* check power supplies */
-      for(s =0; s<saftedev->psus; s++)
-	if(saftedev->psu[s] != saftedev->copy->psu[s])
-	  log_status_change(saftedev, SAFTE_PSU_STATUS, s,
-			    saftedev->copy->psu[s],
-			    saftedev->psu[s]);
-
-      /* check fans */
-      for(s =0; s<saftedev->fans; s++)
-	if(saftedev->fan[s] != saftedev->copy->fan[s])
-	  log_status_change(saftedev, SAFTE_FAN_STATUS, s,
-			    saftedev->copy->fan[s],
-			    saftedev->fan[s]);
-
-      /* check device slots */
-      for(s =0; s<saftedev->slots; s++)
-	if(saftedev->slot[s].status0 != saftedev->copy->slot[s].status0 ||
-	   saftedev->slot[s].status3 != saftedev->copy->slot[s].status3)
-	  log_slot_status_change(saftedev, s,
-				 saftedev->copy->slot[s].status0,
-				 saftedev->copy->slot[s].status3,
-				 saftedev->slot[s].status0,
-				 saftedev->slot[s].status3);
-
-      /* check door lock */
-      if(saftedev->doorlocks &&
-	 saftedev->doorlock != saftedev->copy->doorlock)
-	log_status_change(saftedev, SAFTE_SLOT_BYTE3_STATUS, -1,
-			  saftedev->copy->doorlock,
-			  saftedev->doorlock);
-
-      /* check speaker */
-      if(saftedev->audiblealarm &&
-	 saftedev->speaker != saftedev->copy->speaker)
-	log_status_change(saftedev, SAFTE_SPEAKER_STATUS, -1,
-			  saftedev->copy->speaker,
-			  saftedev->speaker);
-
-      /* check temp sensors */
-      for(s =0; s<saftedev->tempsensors; s++) {
-	if(saftedev->temp[s] != saftedev->copy->temp[s])
-	  log_temp_change(saftedev, s,
-			  saftedev->copy->temp[s],
-			  saftedev->temp[s]);
-	if(saftedev->temp_oor[s] !=
-	   saftedev->copy->temp_oor[s])
-	  log_status_change(saftedev, SAFTE_TEMP_STATUS, s,
-			    saftedev->copy->temp[s],
-			    saftedev->temp[s]);
-      }
 
-      /* check overall temp alert */
-      if(saftedev->temp_alert != saftedev->copy->temp_alert)
-	log_status_change(saftedev, SAFTE_TEMP_STATUS, -1,
-			  saftedev->copy->temp_alert,
-			  saftedev->temp_alert);
-
-    } else { 
-      /* check for initial alert conditions */
-
-      /* check power supplies */
-      for(s =0; s<saftedev->psus; s++)
-	if(status_severity(SAFTE_PSU_STATUS, saftedev->psu[s]) > 0
-	   || alert_noncrit)
-	  log_status_alert(saftedev, SAFTE_PSU_STATUS, s,
-			   saftedev->psu[s]);
-
-      /* check fans */
-      for(s =0; s<saftedev->fans; s++)
-	if(status_severity(SAFTE_FAN_STATUS, saftedev->fan[s]) > 0
-	   || alert_noncrit)
-	  log_status_alert(saftedev, SAFTE_FAN_STATUS, s,
-			   saftedev->fan[s]);
-
-      /* check device slots */
-      for(s =0; s<saftedev->slots; s++)
-	if(slot_status_severity(saftedev->slot[s].status0,
-				saftedev->slot[s].status3) > 0
-	   || alert_noncrit)
-	  log_slot_status_alert(saftedev, s, saftedev->slot[s].status0,
-				saftedev->slot[s].status3);
-
-      /* check door lock */
-      if(saftedev->doorlocks &&
-	 (status_severity(SAFTE_DOOR_STATUS, saftedev->doorlock) > 0
-	 || alert_noncrit))
-	log_status_alert(saftedev, SAFTE_DOOR_STATUS, -1,
-			 saftedev->doorlock);
-
-      /* check speaker */
-      if(saftedev->audiblealarm &&
-	 status_severity(SAFTE_SPEAKER_STATUS,
-			 saftedev->speaker) > 0)
-	log_status_alert(saftedev, SAFTE_SPEAKER_STATUS, -1,
-			 saftedev->speaker);
-
-      /* check temp sensors */
-      for(s =0; s<saftedev->tempsensors; s++) {
-	if(saftedev->temp[s] >= max_temp
-	   || alert_noncrit)
-	  log_temp_alert(saftedev, s, saftedev->temp[s]);
-	if(status_severity(SAFTE_TEMP_STATUS,
-			   saftedev->temp_oor[s]) > 0
-	   || alert_noncrit)
-	  log_status_alert(saftedev, SAFTE_TEMP_STATUS, s,
-			   saftedev->temp_oor[s]);
-      }
+    /* check overall temp alert */
+    if(saftedev->state->temp_alert != saftedev->last->temp_alert)
+      log_status_change(saftedev, SAFTE_TEMP_STATUS, -1,
+			saftedev->last->temp_alert,
+			saftedev->state->temp_alert);
+
+    /* check global flags */
+    if((saftedev->valid & SAFTE_POLL_MASK(SAFTE_READ_GLOBAL_FLAGS)) &&
+       saftedev->state->global_flags != saftedev->last->global_flags)
+      log_global_flags_change(saftedev, saftedev->last->global_flags,
+			      saftedev->state->global_flags);
+
+  } else { 
+    /* check for initial alert conditions */
+
+    /* check power supplies */
+    for(s =0; s<saftedev->psus; s++)
+      if(status_severity(SAFTE_PSU_STATUS, saftedev->state->psu[s]) > 0
+	 || alert_noncrit)
+	log_status_alert(saftedev, SAFTE_PSU_STATUS, s,
+			 saftedev->state->psu[s]);
+
+    /* check fans */
+    for(s =0; s<saftedev->fans; s++)
+      if(status_severity(SAFTE_FAN_STATUS, saftedev->state->fan[s]) > 0
+	 || alert_noncrit)
+	log_status_alert(saftedev, SAFTE_FAN_STATUS, s,
+			 saftedev->state->fan[s]);
 
-      /* check overall temp alert */
+    /* check device slots */
+    for(s =0; s<saftedev->slots; s++)
+      if(slot_status_severity(saftedev->state->status0[s],
+			      saftedev->state->status3[s]) > 0
+	 || alert_noncrit)
+	log_slot_status_alert(saftedev, s, saftedev->state->status0[s],
+			      saftedev->state->status3[s]);
+
+    /* check door lock */
+    if(saftedev->doorlocks &&
+       (status_severity(SAFTE_DOOR_STATUS, saftedev->state->doorlock) > 0
+       || alert_noncrit))
+      log_status_alert(saftedev, SAFTE_DOOR_STATUS, -1,
+		       saftedev->state->doorlock);
+
+    /* check speaker */
+    if(saftedev->audiblealarm &&
+       status_severity(SAFTE_SPEAKER_STATUS,
+		       saftedev->state->speaker) > 0)
+      log_status_alert(saftedev, SAFTE_SPEAKER_STATUS, -1,
+		       saftedev->state->speaker);
+
+    /* check temp sensors */
+    for(s =0; s<saftedev->tempsensors; s++) {
+      if(saftedev->state->temp[s] >= max_temp
+	 || alert_noncrit)
+	log_temp_alert(saftedev, s, saftedev->state->temp[s]);
       if(status_severity(SAFTE_TEMP_STATUS,
-			 saftedev->temp_alert) > 0
+			 saftedev->state->temp_oor[s]) > 0
 	 || alert_noncrit)
-	log_status_alert(saftedev, SAFTE_TEMP_STATUS, -1,
-			 saftedev->temp_alert);
+	log_status_alert(saftedev, SAFTE_TEMP_STATUS, s,
+			 saftedev->state->temp_oor[s]);
     }
-		
-
-    /* copy safte data for comparison next time around */
-    if(saftedev->copy) free(saftedev->copy);
-    saftedev->copy = malloc(sizeof(safte_device_t));
-    memcpy(saftedev->copy, saftedev, sizeof(safte_device_t));
 
-    saftedev = saftedev->next;
+    /* check overall temp alert */
+    if(status_severity(SAFTE_TEMP_STATUS,
+		       saftedev->state->temp_alert) > 0
+       || alert_noncrit)
+      log_status_alert(saftedev, SAFTE_TEMP_STATUS, -1,
+		       saftedev->state->temp_alert);
+
+    /* check global flags */
+    if((saftedev->valid & SAFTE_POLL_MASK(SAFTE_READ_GLOBAL_FLAGS)) &&
+       (global_flags_severity(saftedev->state->global_flags) > 0
+	|| alert_noncrit))
+      log_global_flags_alert(saftedev, saftedev->state->global_flags);
   }
 
+  /* keep this generation for comparison next time around */
+  safte_state_swap(saftedev);
+}
+
+
+/* track whether the device's sg node can be opened. A device that
+   can't is marked degraded and skipped until it comes back */
+static int check_safte_open(safte_device_t *saftedev)
+{
+  int error = safte_poll_open_error(saftedev);
+  char name[SAFTE_NAME_LEN];
+
+  safte_name_r(saftedev, name, sizeof(name));
+
+  if(error && !saftedev->degraded)
+    syslog(LOG_ERR, "%s: open(%s) failed, device degraded: %s",
+	   name, saftedev->device->sg_device, strerror(error));
+  else if(!error && saftedev->degraded)
+    syslog(LOG_INFO, "%s: open(%s) succeeded, device recovered",
+	   name, saftedev->device->sg_device);
+  saftedev->degraded = error;
+
+  return !error;
+}
+
+
+/* log a failed read from the poll engine */
+static int check_safte_reply(safte_device_t *saftedev, int bufid)
+{
+  char name[SAFTE_NAME_LEN];
+
+  if(safte_poll_reply(saftedev, bufid)) return 1;
+
+  syslog(LOG_ERR, "%s: read buffer 0x%02x failed: %s",
+	 safte_name_r(saftedev, name, sizeof(name)), bufid,
+	 strerror(safte_poll_error(saftedev, bufid)));
   return 0;
 }
 
 
+/* worst severity of any element in the enclosure */
+static int safte_device_severity(safte_device_t *saftedev)
+{
+  int s, severity = 0;
+
+  for(s =0; s<saftedev->psus; s++)
+    severity |= status_severity(SAFTE_PSU_STATUS, saftedev->state->psu[s]);
+  for(s =0; s<saftedev->fans; s++)
+    severity |= status_severity(SAFTE_FAN_STATUS, saftedev->state->fan[s]);
+  for(s =0; s<saftedev->slots; s++)
+    severity |= slot_status_severity(saftedev->state->status0[s],
+				     saftedev->state->status3[s]);
+  for(s =0; s<saftedev->tempsensors; s++)
+    severity |= status_severity(SAFTE_TEMP_STATUS, saftedev->state->temp_oor[s]);
+  severity |= status_severity(SAFTE_TEMP_STATUS, saftedev->state->temp_alert);
+  if(saftedev->valid & SAFTE_POLL_MASK(SAFTE_READ_GLOBAL_FLAGS))
+    severity |= global_flags_severity(saftedev->state->global_flags);
+
+  return severity;
+}
+
+
+#define SAFTE_CHECK_MASK (SAFTE_POLL_MASK(SAFTE_READ_ENCLOSURE_STATUS) | \
+			  SAFTE_POLL_MASK(SAFTE_READ_DEVICE_SLOT_STATUS))
+/* buffers whose changes are checked, once those above have been read */
+#define SAFTE_CHECKED_MASK (SAFTE_CHECK_MASK | \
+			    SAFTE_POLL_MASK(SAFTE_READ_GLOBAL_FLAGS))
+
+/* read whatever buffers are due on each enclosure, check the results
+   and reschedule. A reply the same as the last one from its buffer
+   isn't decoded or checked again. Returns the number of enclosures
+   whose state changed */
+int check_safte_status()
+{
+  safte_device_t *saftedev;
+  unsigned char *reply;
+  long now = safte_poll_now();
+  int bufid, mask, changed, degraded, ok, link, alerting, n = 0;
+
+  for(saftedev = saftedev_head; saftedev->next; saftedev = saftedev->next) {
+    mask = safte_sched_due(saftedev, now);
+    if(safte_poll_request(saftedev, mask) == 0 && mask) n++;
+  }
+  if(!n) return 0;
+  n = 0;
+
+  /* fetch safte data from every enclosure at once */
+  safte_poll_run(saftedev_head);
+
+  now = safte_poll_now();
+  for(saftedev = saftedev_head; saftedev->next; saftedev = saftedev->next) {
+    mask = safte_poll_wanted(saftedev);
+    if(!mask) continue;
+
+    /* an enclosure that answers nothing is retried with backoff and
+       then quarantined, which is alerted like any other failure */
+    ok = 0;
+    for(bufid = 0; bufid < SAFTE_POLL_MAX_READS; bufid++)
+      if(safte_poll_reply(saftedev, bufid)) ok = 1;
+    link = safte_sched_result(saftedev, ok);
+    changed = 0;
+    if(link != saftedev->link) {
+      log_status_change(saftedev, SAFTE_LINK_STATUS, -1,
+			saftedev->link, link);
+      saftedev->link = link;
+      changed = 1;
+    }
+
+    degraded = saftedev->degraded;
+    if(check_safte_open(saftedev)) {
+      for(bufid = 0; bufid < SAFTE_POLL_MAX_READS; bufid++) {
+	if(!(mask & SAFTE_POLL_MASK(bufid)) ||
+	   !check_safte_reply(saftedev, bufid)) continue;
+	reply = safte_poll_reply(saftedev, bufid);
+	if(safte_sched_unchanged(saftedev, bufid, reply) &&
+	   (saftedev->valid & SAFTE_POLL_MASK(bufid))) continue;
+	safte_decode[bufid](saftedev, reply);
+	saftedev->valid |= SAFTE_POLL_MASK(bufid);
+	changed |= SAFTE_POLL_MASK(bufid);
+      }
+      if((changed & SAFTE_CHECKED_MASK) &&
+	 (saftedev->valid & SAFTE_CHECK_MASK) == SAFTE_CHECK_MASK)
+	check_safte_device(saftedev);
+    }
+
+    alerting = saftedev->degraded || safte_device_severity(saftedev) > 0;
+    for(bufid = 0; bufid < SAFTE_POLL_MAX_READS; bufid++)
+      if(mask & SAFTE_POLL_MASK(bufid))
+	safte_sched_update(saftedev, bufid, safte_poll_reply(saftedev, bufid),
+			   alerting, now);
+
+    /* the retry goes out on another path, if there is one */
+    if(!ok && safte_failover(saftedev)) changed = 1;
+
+    if(changed || degraded != saftedev->degraded) n++;
+  }
+
+  return n;
+}
+
+
 static void print_safte_dev_info(FILE *out, safte_device_t *saftedev)
 {
   int s;
+  char disk[SAFTE_NAME_LEN];
+  char flagmsg[SAFTE_SLOT_STATUS_LEN];
 
   fprintf(out, "SAF-TE Device %s %s (%d:%d:%d:%d)\n",
 	  saftedev->device->vendor, saftedev->device->product,
@@ -787,39 +1576,52 @@ static void print_safte_dev_info(FILE *out, safte_device_t *saftedev)
   fprintf(out, "no. of temp sensors   = %d\n", saftedev->tempsensors);
   fprintf(out, "audible alarm         = %d\n", saftedev->audiblealarm);
   fprintf(out, "no. of thermostats    = %d\n", saftedev->thermostats);
+  if(saftedev->paths > 1)
+    fprintf(out, "no. of paths          = %d, using %s\n", saftedev->paths,
+	    saftedev->device->sg_device);
   for(s =0; s<saftedev->psus; s++)
     fprintf(out, "%s %d is %s\n", system_name(SAFTE_PSU_STATUS), s,
-	    status_str(SAFTE_PSU_STATUS, saftedev->psu[s]));
+	    status_str(SAFTE_PSU_STATUS, saftedev->state->psu[s]));
   for(s =0; s<saftedev->fans; s++)
     fprintf(out, "%s %d is %s\n", system_name(SAFTE_FAN_STATUS), s,
-	    status_str(SAFTE_FAN_STATUS, saftedev->fan[s]));
+	    status_str(SAFTE_FAN_STATUS, saftedev->state->fan[s]));
   for(s =0; s<saftedev->slots; s++)
-    fprintf(out, "%s %d %s\n", system_name(SAFTE_SLOT_BYTE3_STATUS), s,
-	    slot_status_str(saftedev->slot[s].status0,
-			    saftedev->slot[s].status3, 0));
+    fprintf(out, "%s %d %s%s\n", system_name(SAFTE_SLOT_BYTE3_STATUS), s,
+	    slot_status_str(saftedev->state->status0[s],
+			    saftedev->state->status3[s], 0),
+	    slot_disk_str_r(&saftedev->state->slot[s], disk, sizeof(disk)));
   if(saftedev->doorlocks)
     fprintf(out, "%s is %s\n", system_name(SAFTE_DOOR_STATUS),
-	    status_str(SAFTE_DOOR_STATUS, saftedev->doorlock));
+	    status_str(SAFTE_DOOR_STATUS, saftedev->state->doorlock));
   if(saftedev->audiblealarm)
     fprintf(out, "%s is %s\n", system_name(SAFTE_SPEAKER_STATUS),
-	    status_str(SAFTE_SPEAKER_STATUS, saftedev->speaker));
+	    status_str(SAFTE_SPEAKER_STATUS, saftedev->state->speaker));
   for(s =0; s<saftedev->tempsensors; s++)
     fprintf(out, "%s %d is %0.1f " TEMP_UNIT " and %s\n",
-	    system_name(SAFTE_TEMP_STATUS), s, saftedev->temp[s],
-	    status_str(SAFTE_TEMP_STATUS, saftedev->temp_oor[s]));
+	    system_name(SAFTE_TEMP_STATUS), s, saftedev->state->temp[s],
+	    status_str(SAFTE_TEMP_STATUS, saftedev->state->temp_oor[s]));
   fprintf(out, "overall temperature is %s\n",
-	  status_str(SAFTE_TEMP_STATUS, saftedev->temp_alert));
+	  status_str(SAFTE_TEMP_STATUS, saftedev->state->temp_alert));
+  if(saftedev->valid & SAFTE_POLL_MASK(SAFTE_READ_USAGE_STATISTICS)) {
+    fprintf(out, "power on minutes      = %lu\n", saftedev->state->power_on_minutes);
+    fprintf(out, "power cycles          = %lu\n", saftedev->state->power_cycles);
+  }
+  if(saftedev->valid & SAFTE_POLL_MASK(SAFTE_READ_GLOBAL_FLAGS))
+    fprintf(out, "global flags          = 0x%04x (%s)\n",
+	    saftedev->state->global_flags,
+	    global_flags_str_r(saftedev->state->global_flags, 0, flagmsg,
+			       sizeof(flagmsg)));
   fprintf(out, "\n");
 }
 
 
-static void table_title(FILE *out, char *s) {
+static void table_title(FILE *out, const char *s) {
   fprintf(out, "<table border='1' cellpadding='2' cellspacing='0'>"
 	  "<tr><td bgcolor='#c0c0c0' width='70' align='left' "
 	  "valign='top' rowspan='2'><b>%s</b></td>", s);
 }
 
-static void table_heading(FILE *out, char *s) {
+static void table_heading(FILE *out, const char *s) {
   fprintf(out, "<td bgcolor='#e0e0e0' align='center'>%s</td>", s);
 }
 
@@ -827,19 +1629,210 @@ static void table_data_start(FILE *out) {
   fprintf(out, "</tr><tr>");
 }
 
-static void table_data(FILE *out, char *s, int severity) {
-  if(severity) {
-    fprintf(out, "<td bgcolor='#ffa0a0' align='center'>%s</td>", s);
-  } else {
-    fprintf(out, "<td bgcolor='#a0ffa0' align='center'>%s</td>", s);
+static void table_data_end(FILE *out) {
+  fprintf(out, "</tr></table><img src='wpixel.gif' width='1' height='3'><br>");
+}
+
+
+/* An enclosure's web page block is put together from a cell per
+   element, each rendered once and kept with the value it shows. When
+   the poller publishes, only the cells whose value changed are
+   rendered again, and the block only rebuilt if a cell or the
+   enclosure heading changed. The snapshot carries the blocks, so a
+   request just writes them out */
+
+/* the overall cells come first, then one per psu, temp sensor, fan and
+   slot */
+#define SAFTE_CELL_DOOR 0
+#define SAFTE_CELL_SPEAKER 1
+#define SAFTE_CELL_TEMP 2
+#define SAFTE_CELL_LINK 3
+#define SAFTE_CELL_POWER 4
+#define SAFTE_CELL_FLAGS 5
+#define SAFTE_CELLS_OVERALL 6
+
+typedef struct safte_cell {
+
+  char *html;                  /* the table cell, NULL until rendered */
+  unsigned long key[2];        /* the value it shows */
+  int severity;
+
+} safte_cell_t;
+
+
+typedef struct safte_render {
+
+  safte_cell_t *cell;
+  int cells;
+  int psu, temp, fan, slot;    /* first cell of each */
+  int stale;                   /* render every cell again */
+  unsigned long key[4];        /* what the enclosure heading shows */
+  char *html;                  /* the enclosure's block */
+  size_t len;
+
+} safte_render_t;
+
+
+static safte_render_t *render_alloc(safte_device_t *saftedev)
+{
+  safte_render_t *render;
+  int cells = SAFTE_CELLS_OVERALL + saftedev->psus + saftedev->tempsensors +
+    saftedev->fans + saftedev->slots;
+
+  if((render = saftedev->render) && render->cells == cells) return render;
+  safte_render_free(saftedev);
+  if(!(render = calloc(1, sizeof(safte_render_t))) ||
+     !(render->cell = calloc(cells, sizeof(safte_cell_t)))) {
+    free(render);
+    return NULL;
   }
+  render->cells = cells;
+  render->psu = SAFTE_CELLS_OVERALL;
+  render->temp = render->psu + saftedev->psus;
+  render->fan = render->temp + saftedev->tempsensors;
+  render->slot = render->fan + saftedev->fans;
+  render->stale = 1;
+  saftedev->render = render;
+
+  return render;
 }
 
-static void table_data_end(FILE *out) {
-  fprintf(out, "</tr></table><img src='wpixel.gif' width='1' height='3'><br>");
+
+void safte_render_free(safte_device_t *saftedev)
+{
+  safte_render_t *render = saftedev->render;
+  int i;
+
+  if(!render) return;
+  for(i = 0; i < render->cells; i++) free(render->cell[i].html);
+  free(render->cell);
+  free(render->html);
+  free(render);
+  saftedev->render = NULL;
+}
+
+
+/* slot cells name the mapped disk, which can change without the slot
+   status changing */
+static void render_forget_slots(safte_device_t *saftedev)
+{
+  if(saftedev->render) saftedev->render->stale = 1;
+}
+
+
+/* whether a cell needs rendering to show k0, k1 */
+static int cell_changed(safte_render_t *render, safte_cell_t *cell,
+			unsigned long k0, unsigned long k1)
+{
+  if(cell->html && !render->stale && cell->key[0] == k0 &&
+     cell->key[1] == k1) return 0;
+  cell->key[0] = k0;
+  cell->key[1] = k1;
+  return 1;
+}
+
+
+static void cell_set(safte_cell_t *cell, const char *text, int severity)
+{
+  char tmp[1024 + 64];
+
+  snprintf(tmp, sizeof(tmp), "<td bgcolor='%s' align='center'>%s</td>",
+	   severity ? "#ffa0a0" : "#a0ffa0", text);
+  free(cell->html);
+  cell->html = strdup(tmp);
+  cell->severity = severity;
+}
+
+
+static int cell_status(safte_render_t *render, safte_cell_t *cell,
+		       int system, int code, const char *nl)
+{
+  char tmp[SAFTE_SLOT_STATUS_LEN];
+
+  if(!cell_changed(render, cell, code, 0)) return 0;
+  snprintf(tmp, sizeof(tmp), "%s%s", status_str(system, code), nl);
+  cell_set(cell, tmp, status_severity(system, code));
+  return 1;
+}
+
+
+static void table_cell(FILE *out, safte_cell_t *cell)
+{
+  if(cell->html) fputs(cell->html, out);
+}
+
+
+/* render the cells whose element changed. Returns the number rendered */
+static int render_cells(safte_device_t *saftedev, safte_render_t *render)
+{
+  safte_state_t *state = saftedev->state;
+  safte_cell_t *cell;
+  char tmp[1024], disk[SAFTE_NAME_LEN];
+  unsigned int bits;
+  int s, n = 0;
+
+  if(saftedev->doorlocks)
+    n += cell_status(render, &render->cell[SAFTE_CELL_DOOR],
+		     SAFTE_DOOR_STATUS, state->doorlock, "\n");
+  if(saftedev->audiblealarm)
+    n += cell_status(render, &render->cell[SAFTE_CELL_SPEAKER],
+		     SAFTE_SPEAKER_STATUS, state->speaker, "\n");
+  n += cell_status(render, &render->cell[SAFTE_CELL_TEMP],
+		   SAFTE_TEMP_STATUS, state->temp_alert, "");
+  n += cell_status(render, &render->cell[SAFTE_CELL_LINK],
+		   SAFTE_LINK_STATUS, saftedev->link, "");
+  cell = &render->cell[SAFTE_CELL_POWER];
+  if(cell_changed(render, cell, state->power_on_minutes / 60,
+		  state->power_cycles)) {
+    sprintf(tmp, "%lu hours, %lu cycles\n",
+	    state->power_on_minutes / 60, state->power_cycles);
+    cell_set(cell, tmp, 0);
+    n++;
+  }
+  cell = &render->cell[SAFTE_CELL_FLAGS];
+  if(cell_changed(render, cell, state->global_flags, 0)) {
+    global_flags_str_r(state->global_flags, 1, tmp, sizeof(tmp));
+    cell_set(cell, tmp, global_flags_severity(state->global_flags));
+    n++;
+  }
+
+  for(s =0; s<saftedev->psus; s++)
+    n += cell_status(render, &render->cell[render->psu + s],
+		     SAFTE_PSU_STATUS, state->psu[s], "\n");
+  for(s =0; s<saftedev->tempsensors; s++) {
+    cell = &render->cell[render->temp + s];
+    memcpy(&bits, &state->temp[s], sizeof(bits));
+    if(!cell_changed(render, cell, bits, state->temp_oor[s])) continue;
+    sprintf(tmp, "%0.1f " TEMP_UNIT " and %s\n", state->temp[s],
+	    status_str(SAFTE_TEMP_STATUS, state->temp_oor[s]));
+    cell_set(cell, tmp,
+	     status_severity(SAFTE_TEMP_STATUS, state->temp_oor[s]));
+    n++;
+  }
+  for(s =0; s<saftedev->fans; s++)
+    n += cell_status(render, &render->cell[render->fan + s],
+		     SAFTE_FAN_STATUS, state->fan[s], "\n");
+  for(s =0; s<saftedev->slots; s++) {
+    cell = &render->cell[render->slot + s];
+    if(!cell_changed(render, cell,
+		     state->status0[s] << 8 | state->status3[s],
+		     (unsigned long)state->slot[s].device)) continue;
+    slot_disk_str_r(&state->slot[s], disk, sizeof(disk));
+    snprintf(tmp, sizeof(tmp), "%s%s%s\n",
+	     slot_status_str(state->status0[s], state->status3[s], 1),
+	     disk[0] ? "<br>" : "", disk);
+    cell_set(cell, tmp, slot_status_severity(state->status0[s],
+					     state->status3[s]));
+    n++;
+  }
+  render->stale = 0;
+
+  return n;
 }
 
-static void print_safte_dev_info_html(FILE *out, safte_device_t *saftedev)
+
+static void print_safte_dev_info_html(FILE *out, safte_device_t *saftedev,
+				      safte_render_t *render)
 {
   int s;
   char tmp[1024];
@@ -852,26 +1845,33 @@ static void print_safte_dev_info_html(FILE *out, safte_device_t *saftedev)
 	  saftedev->device->host, saftedev->device->channel,
 	  saftedev->device->id, saftedev->device->lun);
 
+  if(saftedev->degraded)
+    fprintf(out, "<b>Device degraded: %s</b><br>",
+	    strerror(saftedev->degraded));
+  if(saftedev->paths > 1)
+    fprintf(out, "%d paths, using %s<br>", saftedev->paths,
+	    saftedev->device->sg_device);
+
   fprintf(out, "<table cellpadding='0' cellspacing='0' border='0'><tr><td>");
   table_title(out, "Overall");
   if(saftedev->doorlocks) table_heading(out, "Door lock");
   if(saftedev->audiblealarm) table_heading(out, "Speaker");
   table_heading(out, "Temp");
+  table_heading(out, "Link");
+  if(saftedev->valid & SAFTE_POLL_MASK(SAFTE_READ_USAGE_STATISTICS))
+    table_heading(out, "Power on");
+  if(saftedev->valid & SAFTE_POLL_MASK(SAFTE_READ_GLOBAL_FLAGS))
+    table_heading(out, "Flags");
   table_data_start(out);
-  if(saftedev->doorlocks) {
-    sprintf(tmp, "%s\n",
-	    status_str(SAFTE_DOOR_STATUS, saftedev->doorlock));
-    table_data(out, tmp,
-	       status_severity(SAFTE_DOOR_STATUS, saftedev->doorlock));
-  }
-  if(saftedev->audiblealarm) {
-    sprintf(tmp, "%s\n",
-	    status_str(SAFTE_SPEAKER_STATUS, saftedev->speaker));
-    table_data(out, tmp,
-	       status_severity(SAFTE_SPEAKER_STATUS, saftedev->speaker));
-  }
-  table_data(out, status_str(SAFTE_TEMP_STATUS, saftedev->temp_alert),
-	     status_severity(SAFTE_TEMP_STATUS, saftedev->temp_alert));
+  if(saftedev->doorlocks) table_cell(out, &render->cell[SAFTE_CELL_DOOR]);
+  if(saftedev->audiblealarm)
+    table_cell(out, &render->cell[SAFTE_CELL_SPEAKER]);
+  table_cell(out, &render->cell[SAFTE_CELL_TEMP]);
+  table_cell(out, &render->cell[SAFTE_CELL_LINK]);
+  if(saftedev->valid & SAFTE_POLL_MASK(SAFTE_READ_USAGE_STATISTICS))
+    table_cell(out, &render->cell[SAFTE_CELL_POWER]);
+  if(saftedev->valid & SAFTE_POLL_MASK(SAFTE_READ_GLOBAL_FLAGS))
+    table_cell(out, &render->cell[SAFTE_CELL_FLAGS]);
   table_data_end(out);
   fprintf(out, "</td>");
 
@@ -883,11 +1883,8 @@ static void print_safte_dev_info_html(FILE *out, safte_device_t *saftedev)
     table_heading(out, tmp);
   }
   table_data_start(out);
-  for(s =0; s<saftedev->psus; s++) {
-    sprintf(tmp, "%s\n", status_str(SAFTE_PSU_STATUS, saftedev->psu[s]));
-    table_data(out, tmp,
-	       status_severity(SAFTE_PSU_STATUS, saftedev->psu[s]));
-  }
+  for(s =0; s<saftedev->psus; s++)
+    table_cell(out, &render->cell[render->psu + s]);
   table_data_end(out);
 
  temp:
@@ -900,12 +1897,8 @@ static void print_safte_dev_info_html(FILE *out, safte_device_t *saftedev)
     table_heading(out, tmp);
   }
   table_data_start(out);
-  for(s =0; s<saftedev->tempsensors; s++) {
-    sprintf(tmp, "%0.1f " TEMP_UNIT " and %s\n", saftedev->temp[s],
-	    status_str(SAFTE_TEMP_STATUS, saftedev->temp_oor[s]));
-    table_data(out, tmp,
-	       status_severity(SAFTE_TEMP_STATUS, saftedev->temp_oor[s]));
-  }
+  for(s =0; s<saftedev->tempsensors; s++)
+    table_cell(out, &render->cell[render->temp + s]);
   table_data_end(out);
 
  fans:
@@ -917,11 +1910,8 @@ static void print_safte_dev_info_html(FILE *out, safte_device_t *saftedev)
     table_heading(out, tmp);
   }
   table_data_start(out);
-  for(s =0; s<saftedev->fans; s++) {
-    sprintf(tmp, "%s\n", status_str(SAFTE_FAN_STATUS, saftedev->fan[s]));
-    table_data(out, tmp,
-	       status_severity(SAFTE_FAN_STATUS, saftedev->fan[s]));
-  }
+  for(s =0; s<saftedev->fans; s++)
+    table_cell(out, &render->cell[render->fan + s]);
   table_data_end(out);
 
  slots:
@@ -932,21 +1922,79 @@ static void print_safte_dev_info_html(FILE *out, safte_device_t *saftedev)
     table_heading(out, tmp);
   }
   table_data_start(out);
-  for(s =0; s<saftedev->slots; s++) {
-    sprintf(tmp, "%s\n", slot_status_str(saftedev->slot[s].status0,
-					 saftedev->slot[s].status3, 1));
-    table_data(out, tmp, slot_status_severity(saftedev->slot[s].status0,
-					      saftedev->slot[s].status3));
-  }
+  for(s =0; s<saftedev->slots; s++)
+    table_cell(out, &render->cell[render->slot + s]);
   table_data_end(out);
   fprintf(out, "</td></tr></table><br>");
 
 }
 
+
+/* the enclosure's web page block, brought up to date. Called by the
+   poller as it publishes; the block stays the enclosure's, so the
+   caller copies it. NULL if it can't be rendered */
+const char *safte_render_html(safte_device_t *saftedev, size_t *len)
+{
+  safte_render_t *render;
+  unsigned long key[4];
+  char *html;
+  size_t size;
+  FILE *out;
+
+  if(!(render = render_alloc(saftedev))) return NULL;
+
+  key[0] = (unsigned long)saftedev->device;
+  key[1] = saftedev->degraded;
+  key[2] = saftedev->paths;
+  key[3] = saftedev->valid & (SAFTE_POLL_MASK(SAFTE_READ_USAGE_STATISTICS) |
+			      SAFTE_POLL_MASK(SAFTE_READ_GLOBAL_FLAGS));
+  if(render_cells(saftedev, render) == 0 && render->html &&
+     memcmp(key, render->key, sizeof(key)) == 0) {
+    *len = render->len;
+    return render->html;
+  }
+  memcpy(render->key, key, sizeof(key));
+
+  if(!(out = open_memstream(&html, &size))) return NULL;
+  print_safte_dev_info_html(out, saftedev, render);
+  if(fclose(out) != 0) return NULL;
+  free(render->html);
+  render->html = html;
+  render->len = size;
+
+  *len = render->len;
+  return render->html;
+}
+
+/* how many replies to each polled buffer were the same as the last,
+   and so weren't decoded */
+static void print_reply_stats_html(FILE *out)
+{
+  static const char *buffer_name[SAFTE_POLL_MAX_READS] = {
+    NULL, "enclosure status", "usage statistics", "insertions",
+    "slot status", "global flags"
+  };
+  unsigned long reads[SAFTE_POLL_MAX_READS];
+  unsigned long unchanged[SAFTE_POLL_MAX_READS];
+  const char *sep = "";
+  int bufid;
+
+  safte_sched_stats(reads, unchanged);
+  fprintf(out, "<small>Unchanged replies: ");
+  for(bufid = 0; bufid < SAFTE_POLL_MAX_READS; bufid++) {
+    if(!buffer_name[bufid]) continue;
+    fprintf(out, "%s%s %lu/%lu", sep, buffer_name[bufid], unchanged[bufid],
+	    reads[bufid]);
+    sep = ", ";
+  }
+  fprintf(out, "</small><br>");
+}
+
 int process_safte(struct request *r)
 {
   FILE *fp;
-  safte_device_t *saftedev = saftedev_head;
+  safte_snapshot_t *snap;
+  char report[SAFTE_STARTUP_REPORT_LEN];
 
   char *response_hdr = "HTTP/1.1 200 OK\nContent-type: text/html\n\n"
     "<html><head><title>safte-monitor</title>"
@@ -962,15 +2010,27 @@ int process_safte(struct request *r)
     return 405;
   }
 
+  /* render the poller's last published state, never the live list */
+  snap = safte_snapshot_get();
+
   fp = fdopen(r->cn->fd, "r+");
   fprintf(fp, response_hdr, r->servername, r->path);
-  while(saftedev->next) {
-    print_safte_dev_info_html(fp, saftedev);
-    saftedev = saftedev->next;
+  if(snap) {
+    if(snap->discovering)
+      fprintf(fp, "<b>Discovering SAF-TE devices, %d found so far</b><br>",
+	      snap->count);
+    fwrite(snap->html, 1, snap->html_len, fp);
+    print_reply_stats_html(fp);
+    if(safte_startup_report_r(report, sizeof(report)))
+      fprintf(fp, "<small>Startup: %s</small>", report);
+  } else {
+    fprintf(fp, "<b>Waiting for the first poll to complete</b>");
   }
   fprintf(fp, "%s", response_ftr);
   fclose(fp);
 
+  safte_snapshot_put(snap);
+
   return -1;
 }
 
@@ -980,24 +2040,24 @@ int main(int argc, char **argv)
   int fd;
   safte_device_t *saftedev;
 
+  safte_startup_init();
+  safte_status_init();
   parse_command_line(argc, argv);
 
-  scsidev_head = calloc(1, sizeof(scsi_device_t));
+  scsidev_head = alloc_scsidev();
   saftedev_head = calloc(1, sizeof(safte_device_t));
-  scan_scsi_devices(sg_numeric);
-  safte_num = scan_safte_devices();
-
-  /* We can actually map SCSI disk devices to the SAF-TE device slots
-     although this functionality is not presently used. It also will not
-     work if you have hardware RAID as a logical device won't map to
-     physical slots. */
-#if 0
-  map_sg_devices(TYPE_DISK, "sd", 0);
-  map_slots_to_devices();
-#endif
+  safte_hotplug_sg_numeric = sg_numeric;
+  if(sim_file) {
+    /* simulated enclosures don't come and go with the kernel's devices */
+    safte_hotplug_enabled = 0;
+    scsi_cache_file = NULL;
+    if(safte_sim_load(sim_file) < 0 || safte_sim_scan() < 0) exit(1);
+  }
+  safte_discover_init(sg_numeric, !sim_file);
 
   if(print_flag) {
 
+    safte_discover_step(-1);
     if(!safte_num) {
       printf("No SAF-TE devices present\n");
       exit(0);
@@ -1007,16 +2067,16 @@ int main(int argc, char **argv)
 
     saftedev = saftedev_head;
     while(saftedev->next) {
-      fd = open(saftedev->device->sg_device, O_RDWR);
-      if (fd < 0) {
-	perror("open");
-	exit(1);
+      fd = scsi_dev_open(saftedev->device);
+      if (fd < 0)
+	perror(saftedev->device->sg_device);
+      else if(get_safte_enclosure_status(saftedev) == 0 &&
+	 get_safte_device_slot_status(saftedev) == 0) {
+	/* optional, not every enclosure implements these */
+	get_safte_usage_statistics(saftedev);
+	get_safte_global_flags(saftedev);
+	print_safte_dev_info(stdout, saftedev);
       }
-      get_safte_enclosure_status(fd, saftedev);
-      get_safte_device_slot_status(fd, saftedev);
-      close(fd);
-
-      print_safte_dev_info(stdout, saftedev);
       saftedev = saftedev->next;
     }
     exit(0);
@@ -1025,6 +2085,7 @@ int main(int argc, char **argv)
   /* background mode */
   openlog("safte-monitor", LOG_PID, LOG_DAEMON);
 
+  /* the poller thread discovers the enclosures once mathopd is up */
   mathopd_main(argc, argv);
 
   closelog();
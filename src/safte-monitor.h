@@ -24,6 +24,10 @@
 #define SAFTE_MAX_FAN 16
 #define SAFTE_MAX_PSU 16
 #define SAFTE_MAX_TEMPSENSORS 16
+#define SAFTE_MAX_PATHS 8
+
+#define SAFTE_NAME_LEN 256
+#define SAFTE_SLOT_STATUS_LEN 256
 
 /* SAF-TE Read operations */
 #define SAFTE_READ_ENCLOSURE_CONFIG 0x00
@@ -33,6 +37,23 @@
 #define SAFTE_READ_DEVICE_SLOT_STATUS 0x04
 #define SAFTE_READ_GLOBAL_FLAGS 0x05
 
+/* bytes of the enclosure configuration that are decoded */
+#define SAFTE_CONFIG_LEN 7
+
+/* SAF-TE global flags, byte 0 in the low 8 bits and byte 1 above */
+#define SAFTE_GLOBAL_AUDIBLE_ALARM 0x0001
+#define SAFTE_GLOBAL_FAILURE 0x0002
+#define SAFTE_GLOBAL_WARNING 0x0004
+#define SAFTE_GLOBAL_POWER 0x0008
+#define SAFTE_GLOBAL_COOLING_FAILURE 0x0010
+#define SAFTE_GLOBAL_POWER_FAILURE 0x0020
+#define SAFTE_GLOBAL_DRIVE_FAILURE 0x0040
+#define SAFTE_GLOBAL_DRIVE_WARNING 0x0080
+#define SAFTE_GLOBAL_ARRAY_FAILURE 0x0100
+#define SAFTE_GLOBAL_ARRAY_WARNING 0x0200
+#define SAFTE_GLOBAL_ENCLOSURE_LOCK 0x0400
+#define SAFTE_GLOBAL_IDENTIFY 0x0800
+
 /* SAF-TE Write operations */
 #define SAFTE_WRITE_DEVICE_SLOT_STATUS 0x10
 #define SAFTE_SET_SCSI_ID 0x11
@@ -54,6 +75,7 @@
 #define SAFTE_SLOT_BYTE3_PRESENT 0x01
 #define SAFTE_SLOT_BYTE3_INSERTREADY 0x02
 #define SAFTE_SLOT_BYTE3_ACTIVE 0x04
+#define SAFTE_SLOT_BYTE3_MASK 0x07   /* every byte 3 bit above */
 
 /* Status codes for READ_ENCLOSURE_STATUS */
 #define SAFTE_FAN_STATUS_OPERATIONAL 0x00
@@ -76,27 +98,53 @@
 /* internally used status codes */
 #define SAFTE_TEMP_STATUS_OKAY 0x00
 #define SAFTE_TEMP_STATUS_ALERT 0x01
+#define SAFTE_LINK_STATUS_OK 0x00
+#define SAFTE_LINK_STATUS_RETRYING 0x01
+#define SAFTE_LINK_STATUS_QUARANTINED 0x02
 
 /* number of SAF-TE devices found */
 extern int safte_num;
 
 typedef struct safte_slot {
 
-  int id;
-  int status0;
-  int status1;
-  int status2;
-  int status3;
-  int insertions;
-
   scsi_device_t *device;
+  unsigned short insertions;
+  unsigned char id;
 
 } safte_slot_t;
 
 
+/* element state as of a poll. Sized to the enclosure's configuration:
+   the arrays follow the struct in the same allocation, laid out by
+   safte_state_init() */
+typedef struct safte_state {
+
+  safte_slot_t *slot;
+  unsigned char *status0;      /* slot status bytes, one array each */
+  unsigned char *status1;
+  unsigned char *status2;
+  unsigned char *status3;
+  unsigned int *slot_changed;  /* bit per slot whose byte 0 or 3 differs
+				  from the last generation */
+  float *temp;
+  unsigned char *fan;
+  unsigned char *psu;
+  unsigned char *temp_oor;     /* out of range */
+  unsigned long power_on_minutes;
+  unsigned long power_cycles;
+  unsigned short global_flags; /* global flag bytes 0 and 1 */
+  unsigned char doorlock;
+  unsigned char speaker;
+  unsigned char temp_alert;
+
+} safte_state_t;
+
+
 typedef struct safte_device {
 
-  scsi_device_t *device;
+  scsi_device_t *device;       /* path the enclosure is polled through */
+  scsi_device_t *path[SAFTE_MAX_PATHS]; /* every path, preferred first */
+  int paths;
 
   int fans;
   int psus;
@@ -105,24 +153,32 @@ typedef struct safte_device {
   int tempsensors;
   int audiblealarm;
   int thermostats;
-
-  safte_slot_t slot[SAFTE_MAX_SLOTS];
-  int fan[SAFTE_MAX_FAN];
-  int psu[SAFTE_MAX_PSU];
-  int doorlock;
-  int speaker;
-  float temp[SAFTE_MAX_TEMPSENSORS];
-  int temp_oor[SAFTE_MAX_TEMPSENSORS]; /* out of range */
-  int temp_alert;
   int celsius_flag;
 
-  struct safte_device *copy;
+  /* two generations allocated with the configuration. Replies are
+     decoded into state; at the end of a check the generations swap, so
+     last is what the check compared against next time around */
+  safte_state_t *state;
+  safte_state_t *last;         /* NULL until the first check */
+  safte_state_t *gen[2];
+
+  int valid;                   /* mask of read buffers decoded so far */
+  int degraded;                /* errno if the sg node can't be opened */
+  int link;                    /* SAFTE_LINK_STATUS code */
+
+  struct safte_poll *poll;     /* poll engine state */
+  struct safte_sched *sched;   /* read buffer schedule */
+  struct safte_render *render; /* web page cells, see safte_render_html() */
 
   struct safte_device *next;
 
 } safte_device_t;
 
 
+/* list of SAF-TE devices found */
+extern safte_device_t *saftedev_head;
+
+
 #define SAFTE_SLOT_BYTE0_STATUS 1
 #define SAFTE_SLOT_BYTE3_STATUS 2
 #define SAFTE_FAN_STATUS 3
@@ -130,6 +186,9 @@ typedef struct safte_device {
 #define SAFTE_DOOR_STATUS 5
 #define SAFTE_SPEAKER_STATUS 6
 #define SAFTE_TEMP_STATUS 7
+#define SAFTE_LINK_STATUS 8
+#define SAFTE_GLOBAL_STATUS 9
+#define SAFTE_STATUS_SYSTEMS 10
 
 typedef struct safte_status_code {
   int system;
@@ -138,6 +197,48 @@ typedef struct safte_status_code {
   char *desc;
 } safte_status_code_t;
 
+
+/* Public functions */
+extern int safte_read_r(int fd, int safte_cmd, unsigned char *buf,
+			unsigned len, scsi_cmd_status_t *st);
+extern unsigned char *safte_read(int fd, int safte_cmd);
+extern void safte_setup_read(scsi_req_t *req, int safte_cmd,
+			     unsigned char *buf, unsigned len);
+extern int decode_safte_enclosure_config(safte_device_t *safte_dev,
+					 unsigned char *buf);
+extern int decode_safte_enclosure_status(safte_device_t *safte_dev,
+					 unsigned char *buf);
+extern int decode_safte_device_insertions(safte_device_t *safte_dev,
+					  unsigned char *buf);
+extern int decode_safte_device_slot_status(safte_device_t *safte_dev,
+					   unsigned char *buf);
+extern int decode_safte_usage_statistics(safte_device_t *safte_dev,
+					 unsigned char *buf);
+extern int decode_safte_global_flags(safte_device_t *safte_dev,
+				     unsigned char *buf);
+extern int get_safte_enclosure_config(safte_device_t *safte_dev);
+extern int get_safte_enclosure_status(safte_device_t *safte_dev);
+extern int get_safte_device_insertions(safte_device_t *safte_dev);
+extern int get_safte_device_slot_status(safte_device_t *safte_dev);
+extern int get_safte_usage_statistics(safte_device_t *safte_dev);
+extern int get_safte_global_flags(safte_device_t *safte_dev);
+extern char *safte_name_r(safte_device_t *saftedev, char *buf, size_t size);
+extern char *safte_name(safte_device_t *saftedev);
+extern void safte_status_init(void);
+extern const char *slot_status_str(int byte0, int byte3, int html);
+extern const char *safte_render_html(safte_device_t *saftedev, size_t *len);
+extern void safte_render_free(safte_device_t *saftedev);
+extern safte_device_t *safte_attach(scsi_device_t *scsidev);
+extern void safte_detach(safte_device_t *saftedev);
+extern safte_device_t *safte_find_path(scsi_device_t *scsidev);
+extern int safte_detach_path(safte_device_t *saftedev,
+			     scsi_device_t *scsidev);
+extern int safte_failover(safte_device_t *saftedev);
+extern void safte_map_slots(safte_device_t *saftedev);
+extern int safte_map_device(scsi_device_t *scsidev);
+extern int map_slots_to_devices();
+extern int check_safte_status();
+
 #endif
 
 
@@ -0,0 +1,179 @@
+/*
+ *  safte_discover.c - Incremental discovery of SAF-TE enclosures
+ *
+ *  Author: Michael Clark <michael@metaparadigm.com>
+ *  Copyright Metaparadigm Pte. Ltd. 2001
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ */
+
+/*
+ * Finds the enclosures a few devices at a time, so the daemon can serve
+ * requests and poll the enclosures already found while a large SAN is
+ * still being scanned. Each sg node sysfs lists is added the way a
+ * hot-plugged one is - named, mapped to its slot and attached - and the
+ * poller calls safte_discover_step() between its cycles until the list
+ * is used up. Without sysfs the sg nodes are probed in one go on the
+ * first step, and the device list (or the simulator's devices) is then
+ * attached a few at a time.
+ *
+ * With -p discovery runs to completion before anything is printed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <syslog.h>
+
+#include "safte_discover.h"
+#include "safte_poll.h"
+#include "scsi_sysfs.h"
+#include "scsi_cache.h"
+#include "scsi_fc.h"
+
+
+enum {
+  DISCOVER_IDLE,           /* not asked to, or finished */
+  DISCOVER_PENDING,        /* nothing scanned yet */
+  DISCOVER_RUNNING
+};
+
+static int discover_state = DISCOVER_IDLE;
+static int discover_numeric = 1;
+static int discover_probe = 1;   /* 0 when the devices are listed already */
+static int discover_sysfs = 0;
+
+/* sg nodes from sysfs still to add */
+static int *discover_nodes = NULL;
+static int discover_count = 0, discover_next = 0;
+
+/* or the next entry of the device list to attach */
+static scsi_device_t *discover_dev = NULL;
+
+
+/* add sg node k and attach it if it is an enclosure. Returns the new
+   enclosure, NULL for other devices and nodes already on the list. The
+   number of slots a disk was mapped to is added to mapped */
+safte_device_t *safte_discover_sg(int k, int sg_numeric, int *mapped)
+{
+  scsi_device_t *scsidev;
+  safte_device_t *saftedev;
+  char name[PATH_MAX];
+
+  if(k < 0) return NULL;
+  make_dev_name(name, "/dev/sg", k, sg_numeric);
+  if((scsidev = find_dev_by_sg(name)) && scsidev->active > 0) return NULL;
+
+  if(!(scsidev = scan_sysfs_device(k, sg_numeric))) return NULL;
+  sysfs_fc_device(scsidev);
+  /* a disk going into a slot */
+  *mapped += safte_map_device(scsidev);
+  if(!(saftedev = safte_attach(scsidev))) return NULL;
+  safte_map_slots(saftedev);
+
+  return saftedev;
+}
+
+
+/* a device that is about to be freed, step the list walk past it */
+void safte_discover_forget(scsi_device_t *scsidev)
+{
+  if(discover_dev == scsidev) discover_dev = scsidev->next;
+}
+
+
+void safte_discover_init(int sg_numeric, int probe)
+{
+  discover_numeric = sg_numeric;
+  discover_probe = probe;
+  discover_state = DISCOVER_PENDING;
+}
+
+
+int safte_discovering(void)
+{
+  return discover_state != DISCOVER_IDLE;
+}
+
+
+static void discover_begin(void)
+{
+  discover_state = DISCOVER_RUNNING;
+  discover_dev = scsidev_head;
+  if(!discover_probe) return;
+
+  scsi_cache_load();
+  if((discover_count = sysfs_sg_nodes(&discover_nodes)) >= 0) {
+    discover_sysfs = 1;
+    discover_dev = NULL;
+  } else {
+    /* no sysfs, probe the sg nodes */
+    discover_count = 0;
+    scan_scsi_devices(discover_numeric);
+  }
+}
+
+
+static void discover_finish(void)
+{
+  free(discover_nodes);
+  discover_nodes = NULL;
+  discover_count = discover_next = 0;
+  discover_dev = NULL;
+  discover_state = DISCOVER_IDLE;
+
+  if(discover_sysfs) {
+    /* the enclosures were named as they were found, this names the
+       rest */
+    scan_sysfs_fc();
+  } else {
+    /* probing has to open every sd node to name the disks */
+    if(discover_probe) map_sg_devices(TYPE_DISK, "sd", 0);
+    map_slots_to_devices();
+  }
+
+  if(scsi_cache_save() < 0 && errno != ENOENT)
+    syslog(LOG_WARNING, "can't write discovery cache %s: %s",
+	   scsi_cache_file, strerror(errno));
+}
+
+
+/* discover for up to slice ms, to the end if slice is negative. Returns
+   the number of enclosures attached and slots mapped, plus one when
+   discovery finished */
+int safte_discover_step(long slice)
+{
+  long end = safte_poll_now() + slice;
+  scsi_device_t *scsidev;
+  int n = 0;
+
+  if(discover_state == DISCOVER_PENDING) discover_begin();
+
+  while(discover_state == DISCOVER_RUNNING) {
+    if(discover_next < discover_count) {
+      if(safte_discover_sg(discover_nodes[discover_next++],
+			   discover_numeric, &n)) {
+	safte_num++;
+	n++;
+      }
+    } else if(discover_dev && discover_dev->next) {
+      scsidev = discover_dev;
+      discover_dev = scsidev->next;
+      if(safte_attach(scsidev)) {
+	safte_num++;
+	n++;
+      }
+    } else {
+      discover_finish();
+      n++;
+    }
+    if(slice >= 0 && safte_poll_now() >= end) break;
+  }
+
+  return n;
+}
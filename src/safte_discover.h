@@ -0,0 +1,31 @@
+/*
+ *  safte_discover.h - Incremental discovery of SAF-TE enclosures
+ *
+ *  Author: Michael Clark <michael@metaparadigm.com>
+ *  Copyright Metaparadigm Pte. Ltd. 2001
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ */
+
+#ifndef _SAFTE_DISCOVER_H_
+#define _SAFTE_DISCOVER_H_
+
+#include "safte-monitor.h"
+
+
+/* longest the poller spends discovering before it polls the enclosures
+   found so far */
+#define SAFTE_DISCOVER_SLICE 100 /* ms */
+
+
+extern void safte_discover_init(int sg_numeric, int probe);
+extern int safte_discover_step(long slice);
+extern int safte_discovering(void);
+extern safte_device_t *safte_discover_sg(int k, int sg_numeric,
+					 int *mapped);
+extern void safte_discover_forget(scsi_device_t *scsidev);
+
+#endif
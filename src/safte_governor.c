@@ -0,0 +1,203 @@
+/*
+ *  safte_governor.c - Slow enclosure polling on busy SCSI buses
+ *
+ *  Author: Michael Clark <michael@metaparadigm.com>
+ *  Copyright Metaparadigm Pte. Ltd. 2001
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <dirent.h>
+#include <syslog.h>
+
+#include "safte_governor.h"
+#include "scsi_sysfs.h"
+#include "scsi_index.h"
+
+
+/* load on one host:channel, summed over the disks behind it */
+typedef struct bus_load {
+  int host;
+  int channel;
+  long sampled;     /* when, 0 if never */
+  int busy;         /* commands in flight */
+  int depth;        /* queue slots */
+  int factor;       /* current stretch */
+} bus_load_t;
+
+static bus_load_t *buses = NULL;
+static int nbuses = 0;
+
+
+static int read_int(const char *path, int *val)
+{
+  FILE *f;
+  int rv;
+
+  if(!(f = fopen(path, "r"))) return -1;
+  rv = fscanf(f, "%d", val);
+  fclose(f);
+
+  return rv == 1 ? 0 : -1;
+}
+
+
+/* the disk's directory in sysfs, or a file in it */
+static void disk_path(char *path, size_t size, scsi_device_t *scsidev,
+		      const char *file)
+{
+  snprintf(path, size, "%s" SCSI_SYSFS_DEVICES "/%d:%d:%d:%d/%s",
+	   scsi_sysfs_root, scsidev->host, scsidev->channel, scsidev->id,
+	   scsidev->lun, file);
+}
+
+
+/* in flight count for the block device behind a disk, for kernels
+   without device_busy in sysfs. From the block device's inflight in
+   sysfs, or failing that /proc/diskstats, which is only read when
+   sysfs hasn't been relocated */
+static int disk_inflight(scsi_device_t *scsidev, int *busy)
+{
+  char path[PATH_MAX], line[512], name[NAME_MAX+1];
+  struct dirent *de;
+  DIR *dir;
+  FILE *f;
+  int rv = -1, reads, writes;
+  unsigned long st[9];
+
+  disk_path(path, sizeof(path), scsidev, "block");
+  if(!(dir = opendir(path))) return -1;
+  name[0] = '\0';
+  while((de = readdir(dir))) {
+    if(de->d_name[0] == '.') continue;
+    snprintf(name, sizeof(name), "%s", de->d_name);
+    break;
+  }
+  closedir(dir);
+  if(!name[0]) return -1;
+
+  if(strlen(path) + strlen(name) + sizeof("//inflight") <= sizeof(path)) {
+    strcat(strcat(strcat(path, "/"), name), "/inflight");
+    if((f = fopen(path, "r"))) {
+      rv = fscanf(f, "%d %d", &reads, &writes) == 2 ? 0 : -1;
+      fclose(f);
+      if(rv == 0) {
+	*busy = reads + writes;
+	return 0;
+      }
+    }
+  }
+
+  if(strcmp(scsi_sysfs_root, SCSI_SYSFS_ROOT) != 0 ||
+     !(f = fopen(SAFTE_GOVERNOR_DISKSTATS, "r"))) return -1;
+  while(fgets(line, sizeof(line), f)) {
+    char dname[NAME_MAX+1];
+    if(sscanf(line, "%*u %*u %255s %lu %lu %lu %lu %lu %lu %lu %lu %lu",
+	      dname, &st[0], &st[1], &st[2], &st[3], &st[4], &st[5],
+	      &st[6], &st[7], &st[8]) == 10 && strcmp(dname, name) == 0) {
+      *busy = st[8];
+      rv = 0;
+      break;
+    }
+  }
+  fclose(f);
+
+  return rv;
+}
+
+
+/* sum in flight commands and queue depth over the disks on a bus */
+static void bus_sample(bus_load_t *bus)
+{
+  char path[PATH_MAX];
+  scsi_device_t *scsidev;
+  int busy, depth, factor;
+
+  bus->busy = bus->depth = 0;
+  for(scsidev = find_dev_by_bus(bus->host, bus->channel); scsidev;
+      scsidev = scsi_index_next(SCSI_INDEX_BUS, scsidev)) {
+    if(scsidev->type != TYPE_DISK) continue;
+
+    disk_path(path, sizeof(path), scsidev, "device_busy");
+    if(read_int(path, &busy) < 0 && disk_inflight(scsidev, &busy) < 0)
+      continue;
+
+    disk_path(path, sizeof(path), scsidev, "queue_depth");
+    if(read_int(path, &depth) < 0 || depth <= 0)
+      depth = SAFTE_GOVERNOR_DEPTH;
+
+    bus->busy += busy;
+    bus->depth += depth;
+  }
+
+  if(!bus->depth)
+    factor = 1;
+  else if(bus->busy * 100 >= bus->depth * SAFTE_GOVERNOR_SATURATED)
+    factor = 4;
+  else if(bus->busy * 100 >= bus->depth * SAFTE_GOVERNOR_BUSY)
+    factor = 2;
+  else
+    factor = 1;
+
+  if(factor > 1 && bus->factor <= 1)
+    syslog(LOG_INFO, "scsi%d channel %d busy (%d of %d queue slots in use), "
+	   "slowing enclosure polls", bus->host, bus->channel,
+	   bus->busy, bus->depth);
+  else if(factor == 1 && bus->factor > 1)
+    syslog(LOG_INFO, "scsi%d channel %d no longer busy",
+	   bus->host, bus->channel);
+  bus->factor = factor;
+}
+
+
+static bus_load_t *bus_find(int host, int channel)
+{
+  bus_load_t *nb;
+  int i;
+
+  for(i = 0; i < nbuses; i++)
+    if(buses[i].host == host && buses[i].channel == channel)
+      return &buses[i];
+
+  nb = realloc(buses, (nbuses + 1) * sizeof(bus_load_t));
+  if(!nb) return NULL;
+  buses = nb;
+  memset(&buses[nbuses], 0, sizeof(bus_load_t));
+  buses[nbuses].host = host;
+  buses[nbuses].channel = channel;
+  buses[nbuses].factor = 1;
+
+  return &buses[nbuses++];
+}
+
+
+/* stretch a poll interval by the load on the enclosure's bus. Nothing
+   is stretched while the enclosure is alerting, and never beyond
+   SAFTE_GOVERNOR_CEILING so status changes are still seen */
+long safte_governor_stretch(safte_device_t *saftedev, long interval,
+			    int alerting, long now)
+{
+  bus_load_t *bus;
+  long stretched;
+
+  if(alerting || interval >= SAFTE_GOVERNOR_CEILING) return interval;
+
+  bus = bus_find(saftedev->device->host, saftedev->device->channel);
+  if(!bus) return interval;
+  if(!bus->sampled || now - bus->sampled >= SAFTE_GOVERNOR_SAMPLE) {
+    bus_sample(bus);
+    bus->sampled = now;
+  }
+
+  stretched = interval * bus->factor;
+  if(stretched > SAFTE_GOVERNOR_CEILING) stretched = SAFTE_GOVERNOR_CEILING;
+
+  return stretched;
+}
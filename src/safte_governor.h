@@ -0,0 +1,39 @@
+/*
+ *  safte_governor.h - Slow enclosure polling on busy SCSI buses
+ *
+ *  Author: Michael Clark <michael@metaparadigm.com>
+ *  Copyright Metaparadigm Pte. Ltd. 2001
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ */
+
+#ifndef _SAFTE_GOVERNOR_H_
+#define _SAFTE_GOVERNOR_H_
+
+#include "safte-monitor.h"
+
+
+#define SAFTE_GOVERNOR_DISKSTATS "/proc/diskstats"
+
+/* how often a bus's load is sampled */
+#define SAFTE_GOVERNOR_SAMPLE 1000 /* ms */
+
+/* queue depth assumed for a disk that doesn't report one */
+#define SAFTE_GOVERNOR_DEPTH 32
+
+/* percentage of the bus's queue slots in use at which polls are
+   stretched 2x and 4x */
+#define SAFTE_GOVERNOR_BUSY 50
+#define SAFTE_GOVERNOR_SATURATED 75
+
+/* a stretched interval never goes past this */
+#define SAFTE_GOVERNOR_CEILING 30000 /* ms */
+
+
+extern long safte_governor_stretch(safte_device_t *saftedev, long interval,
+				   int alerting, long now);
+
+#endif
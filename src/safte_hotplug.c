@@ -0,0 +1,249 @@
+/*
+ *  safte_hotplug.c - Attach and detach enclosures on kernel uevents
+ *
+ *  Author: Michael Clark <michael@metaparadigm.com>
+ *  Copyright Metaparadigm Pte. Ltd. 2001
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ */
+
+/*
+ * Listens for kernel uevents so enclosures added to or removed from a
+ * running system are picked up without a restart. Only scsi_generic
+ * and enclosure devices matter; each add or remove attaches or detaches
+ * one safte_device_t, the rest of the list and its alert state are left
+ * alone.
+ *
+ * With -U <path> the events are read from a datagram socket bound at
+ * path instead, one uevent per datagram in the kernel's format
+ * ("add@/devpath" then NUL separated KEY=value pairs), so a recorded
+ * sequence can be replayed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/netlink.h>
+
+#include "safte_hotplug.h"
+#include "safte_discover.h"
+#include "scsi_sysfs.h"
+#include "scsi_index.h"
+#include "scsi_cache.h"
+
+
+int safte_hotplug_enabled = 1;
+int safte_hotplug_sg_numeric = 1;
+char *safte_hotplug_replay = NULL;
+
+static int hotplug_fd = -1;
+
+
+typedef struct uevent {
+  const char *action;
+  const char *subsystem;
+  const char *devpath;
+  const char *devname;
+} uevent_t;
+
+
+int safte_hotplug_open(void)
+{
+  struct sockaddr_nl nl;
+  struct sockaddr_un un;
+
+  if(!safte_hotplug_enabled || hotplug_fd >= 0) return hotplug_fd;
+
+  if(safte_hotplug_replay) {
+    memset(&un, 0, sizeof(un));
+    un.sun_family = AF_UNIX;
+    if(strlen(safte_hotplug_replay) >= sizeof(un.sun_path)) {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+    strcpy(un.sun_path, safte_hotplug_replay);
+    unlink(safte_hotplug_replay);
+    hotplug_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			0);
+    if(hotplug_fd >= 0 &&
+       bind(hotplug_fd, (struct sockaddr*)&un, sizeof(un)) < 0) {
+      close(hotplug_fd);
+      hotplug_fd = -1;
+    }
+  } else {
+    memset(&nl, 0, sizeof(nl));
+    nl.nl_family = AF_NETLINK;
+    nl.nl_groups = 1;                   /* kernel events, not udev's */
+    hotplug_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			NETLINK_KOBJECT_UEVENT);
+    if(hotplug_fd >= 0 &&
+       bind(hotplug_fd, (struct sockaddr*)&nl, sizeof(nl)) < 0) {
+      close(hotplug_fd);
+      hotplug_fd = -1;
+    }
+  }
+
+  return hotplug_fd;
+}
+
+
+void safte_hotplug_close(void)
+{
+  if(hotplug_fd < 0) return;
+  close(hotplug_fd);
+  hotplug_fd = -1;
+  if(safte_hotplug_replay) unlink(safte_hotplug_replay);
+}
+
+
+int safte_hotplug_fd(void)
+{
+  return hotplug_fd;
+}
+
+
+static void uevent_parse(char *buf, int len, uevent_t *ev)
+{
+  char *p, *end = buf + len;
+
+  memset(ev, 0, sizeof(uevent_t));
+  for(p = buf + strlen(buf) + 1; p < end; p += strlen(p) + 1) {
+    if(!strncmp(p, "ACTION=", 7)) ev->action = p + 7;
+    else if(!strncmp(p, "SUBSYSTEM=", 10)) ev->subsystem = p + 10;
+    else if(!strncmp(p, "DEVPATH=", 8)) ev->devpath = p + 8;
+    else if(!strncmp(p, "DEVNAME=", 8)) ev->devname = p + 8;
+  }
+}
+
+
+/* host:channel:id:lun of the scsi device an enclosure class device
+   hangs off, the path component before "/enclosure/" */
+static int uevent_hctl(const char *devpath, int *host, int *channel,
+		       int *id, int *lun)
+{
+  const char *end, *p;
+
+  if(!(end = strstr(devpath, "/enclosure/"))) return -1;
+  for(p = end; p > devpath && p[-1] != '/'; p--);
+
+  return sscanf(p, "%d:%d:%d:%d", host, channel, id, lun) == 4 ? 0 : -1;
+}
+
+
+/* devices that went away were freed, so only devices still present are
+   found */
+static scsi_device_t *hotplug_find_sg(int k)
+{
+  scsi_device_t *scsidev;
+  char name[PATH_MAX];
+
+  make_dev_name(name, "/dev/sg", k, safte_hotplug_sg_numeric);
+  scsidev = find_dev_by_sg(name);
+
+  return scsidev && scsidev->active > 0 ? scsidev : NULL;
+}
+
+
+static int hotplug_add(int k)
+{
+  safte_device_t *saftedev;
+  char name[SAFTE_NAME_LEN];
+  int n = 0;
+
+  if(!(saftedev = safte_discover_sg(k, safte_hotplug_sg_numeric, &n)))
+    return n;
+
+  syslog(LOG_INFO, "%s: enclosure added",
+	 safte_name_r(saftedev, name, sizeof(name)));
+  return n + 1;
+}
+
+
+/* drop a device that went away from its enclosure and the slots, then
+   free it */
+static int hotplug_remove(scsi_device_t *scsidev)
+{
+  safte_device_t *saftedev;
+  char name[SAFTE_NAME_LEN];
+  int n = 0;
+
+  if(!scsidev) return 0;
+  if((saftedev = safte_find_path(scsidev))) {
+    safte_name_r(saftedev, name, sizeof(name));
+    if(safte_detach_path(saftedev, scsidev) > 0) {
+      syslog(LOG_INFO, "%s: path %s removed", name, scsidev->sg_device);
+    } else {
+      syslog(LOG_INFO, "%s: enclosure removed", name);
+      safte_detach(saftedev);
+      n = 1;
+    }
+  }
+  /* out of the index first, so the slots it sat in map past it */
+  scsi_index_remove(scsidev);
+  n += safte_map_device(scsidev);
+  safte_discover_forget(scsidev);
+  scsi_cache_forget(scsidev);
+  remove_scsidev(scsidev);
+
+  return n;
+}
+
+
+static int hotplug_event(uevent_t *ev)
+{
+  int k = -1, host, channel, id, lun;
+  const char *name;
+
+  if(!ev->action || !ev->subsystem || !ev->devpath) return 0;
+
+  if(!strcmp(ev->subsystem, "scsi_generic")) {
+    if(!(name = ev->devname) && (name = strrchr(ev->devpath, '/'))) name++;
+    if(!name || sscanf(name, "sg%d", &k) != 1) return 0;
+    if(!strcmp(ev->action, "add")) return hotplug_add(k);
+    if(!strcmp(ev->action, "remove"))
+      return hotplug_remove(hotplug_find_sg(k));
+  } else if(!strcmp(ev->subsystem, "enclosure")) {
+    if(uevent_hctl(ev->devpath, &host, &channel, &id, &lun) < 0) return 0;
+    if(!strcmp(ev->action, "add"))
+      return hotplug_add(sysfs_sg_index(host, channel, id, lun));
+    if(!strcmp(ev->action, "remove"))
+      return hotplug_remove(find_dev_by_loc(host, channel, id, lun));
+  }
+
+  return 0;
+}
+
+
+/* act on the uevents waiting on the socket. Returns the number of
+   enclosures attached or detached and slots remapped */
+int safte_hotplug_handle(void)
+{
+  char buf[SAFTE_HOTPLUG_MSG_LEN];
+  uevent_t ev;
+  ssize_t len;
+  int n = 0;
+
+  if(hotplug_fd < 0) return 0;
+
+  while((len = recv(hotplug_fd, buf, sizeof(buf) - 1, 0)) > 0) {
+    buf[len] = '\0';
+    /* udev's own messages start with a "libudev" header, skip them */
+    if(!strchr(buf, '@')) continue;
+    uevent_parse(buf, len, &ev);
+    n += hotplug_event(&ev);
+  }
+  if(len < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+    syslog(LOG_WARNING, "uevent socket: %s", strerror(errno));
+
+  return n;
+}
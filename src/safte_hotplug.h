@@ -0,0 +1,38 @@
+/*
+ *  safte_hotplug.h - Attach and detach enclosures on kernel uevents
+ *
+ *  Author: Michael Clark <michael@metaparadigm.com>
+ *  Copyright Metaparadigm Pte. Ltd. 2001
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ */
+
+#ifndef _SAFTE_HOTPLUG_H_
+#define _SAFTE_HOTPLUG_H_
+
+#include "safte-monitor.h"
+
+
+/* largest uevent accepted, the kernel's limit is 2048 */
+#define SAFTE_HOTPLUG_MSG_LEN 4096
+
+
+/* 0 to ignore uevents */
+extern int safte_hotplug_enabled;
+
+/* sg device naming, as given on the command line */
+extern int safte_hotplug_sg_numeric;
+
+/* read uevents from a datagram socket bound here instead of netlink,
+   for replaying recorded events */
+extern char *safte_hotplug_replay;
+
+extern int safte_hotplug_open(void);
+extern void safte_hotplug_close(void);
+extern int safte_hotplug_fd(void);
+extern int safte_hotplug_handle(void);
+
+#endif
@@ -0,0 +1,375 @@
+/*
+ *  safte_poll.c - Concurrent SAF-TE enclosure polling
+ *
+ *  Author: Michael Clark <michael@metaparadigm.com>
+ *  Copyright Metaparadigm Pte. Ltd. 2001
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+#include "safte_poll.h"
+
+
+static void poll_abandon(safte_device_t *saftedev, int error);
+
+
+/* commands allowed in flight on one host adapter, 0 for no limit */
+int safte_poll_host_max = SAFTE_POLL_HOST_MAX;
+
+/* pollfd set, grown as needed */
+static struct pollfd *pfds = NULL;
+static safte_device_t **pdevs = NULL;
+static int npfds_max = 0;
+
+/* per host adapter state for the current run */
+typedef struct poll_host {
+  int host;
+  int inflight;        /* commands submitted and not yet reaped */
+  int channel;         /* channel served last */
+} poll_host_t;
+
+static poll_host_t *hosts = NULL;
+static int nhosts = 0, nhosts_max = 0;
+
+/* submission sequence number, for round robin within a channel */
+static unsigned long poll_seq = 0;
+
+
+/* monotonic clock in ms, shared with the scheduler */
+long safte_poll_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+int safte_poll_attach(safte_device_t *saftedev)
+{
+  safte_poll_t *sp;
+
+  if(saftedev->poll) return 0;
+  sp = calloc(1, sizeof(safte_poll_t));
+  if(!sp) return -1;
+  saftedev->poll = sp;
+
+  return 0;
+}
+
+
+void safte_poll_detach(safte_device_t *saftedev)
+{
+  if(!saftedev->poll) return;
+  scsi_dev_close(saftedev->device);
+  free(saftedev->poll);
+  saftedev->poll = NULL;
+}
+
+
+/* set the buffer ids to read from a device in the next run */
+int safte_poll_request(safte_device_t *saftedev, int mask)
+{
+  if(safte_poll_attach(saftedev) < 0) return -1;
+  saftedev->poll->wanted = mask;
+  return 0;
+}
+
+
+static poll_host_t *host_find(int host)
+{
+  int i;
+
+  for(i = 0; i < nhosts; i++)
+    if(hosts[i].host == host) return &hosts[i];
+
+  if(nhosts == nhosts_max) {
+    poll_host_t *nh = realloc(hosts, (nhosts_max + 4) * sizeof(poll_host_t));
+    if(!nh) return NULL;
+    hosts = nh;
+    nhosts_max += 4;
+  }
+  hosts[nhosts].host = host;
+  hosts[nhosts].inflight = 0;
+  hosts[nhosts].channel = -1;
+
+  return &hosts[nhosts++];
+}
+
+
+/* build a READ BUFFER request for a SAF-TE buffer id */
+static void setup_read_req(safte_device_t *saftedev, int bufid)
+{
+  safte_poll_t *sp = saftedev->poll;
+
+  safte_setup_read(&sp->req[bufid], bufid, sp->reply[bufid], READ_REPLY_LEN);
+  sp->req[bufid].priv = saftedev;
+}
+
+
+/* fail every request in mask that has not completed */
+static void poll_fail(safte_device_t *saftedev, int mask, int error)
+{
+  safte_poll_t *sp = saftedev->poll;
+  int bufid;
+
+  for(bufid = 0; bufid < SAFTE_POLL_MAX_READS; bufid++) {
+    if((mask & SAFTE_POLL_MASK(bufid)) &&
+       !(sp->done & SAFTE_POLL_MASK(bufid)) && !sp->req[bufid].error)
+      sp->req[bufid].error = error;
+  }
+}
+
+
+/* open the device and queue its requested buffer ids for submission */
+static void poll_start(safte_device_t *saftedev)
+{
+  safte_poll_t *sp = saftedev->poll;
+  int bufid;
+
+  sp->done = 0;
+  sp->pending = 0;
+  sp->queued = 0;
+  sp->reopened = 0;
+  sp->open_error = 0;
+  for(bufid = 0; bufid < SAFTE_POLL_MAX_READS; bufid++)
+    sp->req[bufid].error = 0;
+  if(!sp->wanted) return;
+
+  if(scsi_dev_open(saftedev->device) < 0) {
+    sp->open_error = errno;
+    poll_fail(saftedev, sp->wanted, errno);
+    return;
+  }
+  sp->queued = sp->wanted;
+}
+
+
+/* submit the next queued READ BUFFER on a device without waiting. If
+   the transport says the cached fd has gone stale it is reopened once,
+   and anything already in flight on it is queued again */
+static void poll_submit(safte_device_t *saftedev, poll_host_t *host)
+{
+  safte_poll_t *sp = saftedev->poll;
+  int bufid;
+
+  for(bufid = 0; !(sp->queued & SAFTE_POLL_MASK(bufid)); bufid++);
+  sp->queued &= ~SAFTE_POLL_MASK(bufid);
+  sp->seq = ++poll_seq;
+
+  setup_read_req(saftedev, bufid);
+  if(scsi_dev_submit(saftedev->device, &sp->req[bufid]) == 0) {
+    sp->pending++;
+    host->inflight++;
+    sp->deadline = safte_poll_now() + scsi_timeout + SAFTE_POLL_SLACK;
+  } else if(scsi_dev_stale(sp->req[bufid].error) && !sp->reopened) {
+    sp->reopened = 1;
+    host->inflight -= sp->pending;
+    sp->pending = 0;
+    sp->queued = sp->wanted & ~sp->done;
+    for(bufid = 0; bufid < SAFTE_POLL_MAX_READS; bufid++)
+      if(sp->queued & SAFTE_POLL_MASK(bufid)) sp->req[bufid].error = 0;
+    if(scsi_dev_reopen(saftedev->device) < 0) {
+      sp->open_error = errno;
+      sp->queued = 0;
+      poll_fail(saftedev, sp->wanted, errno);
+    }
+  }
+}
+
+
+/* pick the device to submit to next on a host. Channels take turns,
+   and within a channel the device that waited longest goes first */
+static safte_device_t *poll_next(safte_device_t *head, poll_host_t *host)
+{
+  safte_device_t *saftedev, *best = NULL;
+  int channel, best_channel = 0;
+
+  for(saftedev = head; saftedev->next; saftedev = saftedev->next) {
+    if(!saftedev->poll->queued || saftedev->device->host != host->host)
+      continue;
+    /* channels after the last one served sort first */
+    channel = saftedev->device->channel;
+    if(channel <= host->channel) channel += 0x10000;
+    if(!best || channel < best_channel ||
+       (channel == best_channel && saftedev->poll->seq < best->poll->seq)) {
+      best = saftedev;
+      best_channel = channel;
+    }
+  }
+
+  return best;
+}
+
+
+/* submit queued requests on every host up to its in flight limit */
+static void poll_refill(safte_device_t *head)
+{
+  safte_device_t *saftedev;
+  int i;
+
+  for(i = 0; i < nhosts; i++) {
+    while(!safte_poll_host_max ||
+	  hosts[i].inflight < safte_poll_host_max) {
+      if(!(saftedev = poll_next(head, &hosts[i]))) break;
+      hosts[i].channel = saftedev->device->channel;
+      poll_submit(saftedev, &hosts[i]);
+    }
+  }
+}
+
+
+/* collect whatever has completed on a device */
+static void poll_reap(safte_device_t *saftedev)
+{
+  safte_poll_t *sp = saftedev->poll;
+  poll_host_t *host = host_find(saftedev->device->host);
+  scsi_req_t *req;
+
+  while(sp->pending) {
+    req = scsi_dev_reap(saftedev->device);
+    if(!req) {
+      if(errno != EAGAIN) poll_abandon(saftedev, errno);
+      break;
+    }
+    sp->pending--;
+    host->inflight--;
+    if(!req->error) sp->done |= SAFTE_POLL_MASK(req->pack_id);
+  }
+}
+
+
+/* give up on requests still in flight or queued. Closing the fd lets
+   the sg driver discard the replies when they eventually arrive, the
+   next cycle opens it again */
+static void poll_abandon(safte_device_t *saftedev, int error)
+{
+  safte_poll_t *sp = saftedev->poll;
+
+  poll_fail(saftedev, sp->wanted, error);
+  host_find(saftedev->device->host)->inflight -= sp->pending;
+  sp->pending = 0;
+  sp->queued = 0;
+  scsi_dev_close(saftedev->device);
+}
+
+
+/* read the requested buffers from every enclosure in the list. Requests
+   are queued per host adapter and submitted up to safte_poll_host_max
+   at a time, so replies on one host overlap with every other host and
+   with the queued commands behind them. Returns the number of enclosures
+   that returned every requested buffer */
+int safte_poll_run(safte_device_t *head)
+{
+  safte_device_t *saftedev;
+  safte_poll_t *sp;
+  long now, deadline;
+  int n, i, rv, ok = 0;
+
+  n = 0;
+  for(saftedev = head; saftedev->next; saftedev = saftedev->next) n++;
+  if(n > npfds_max) {
+    struct pollfd *npfds = realloc(pfds, n * sizeof(struct pollfd));
+    safte_device_t **npdevs = realloc(pdevs, n * sizeof(safte_device_t*));
+    if(npfds) pfds = npfds;
+    if(npdevs) pdevs = npdevs;
+    if(!npfds || !npdevs) return -1;
+    npfds_max = n;
+  }
+
+  nhosts = 0;
+  for(saftedev = head; saftedev->next; saftedev = saftedev->next) {
+    if(safte_poll_attach(saftedev) < 0 ||
+       !host_find(saftedev->device->host)) return -1;
+    poll_start(saftedev);
+  }
+  poll_refill(head);
+
+  /* collect replies as they land, topping each host up as they do */
+  for(;;) {
+    n = 0;
+    deadline = 0;
+    for(saftedev = head; saftedev->next; saftedev = saftedev->next) {
+      sp = saftedev->poll;
+      if(!sp->pending) continue;
+      if(!deadline || sp->deadline < deadline) deadline = sp->deadline;
+      pfds[n].fd = saftedev->device->sg_fd;
+      pfds[n].events = POLLIN;
+      pfds[n].revents = 0;
+      pdevs[n++] = saftedev;
+    }
+    if(!n) break;
+
+    now = safte_poll_now();
+    rv = poll(pfds, n, deadline > now ? deadline - now : 0);
+    if(rv < 0 && errno != EINTR) break;
+
+    for(i = 0; rv > 0 && i < n; i++) {
+      if(pfds[i].revents & POLLIN)
+	poll_reap(pdevs[i]);
+      else if(pfds[i].revents & (POLLERR | POLLHUP | POLLNVAL))
+	poll_abandon(pdevs[i], ENODEV);
+    }
+
+    /* a device with nothing back by its deadline is given up on */
+    now = safte_poll_now();
+    for(i = 0; i < n; i++)
+      if(pdevs[i]->poll->pending && pdevs[i]->poll->deadline <= now)
+	poll_abandon(pdevs[i], ETIMEDOUT);
+
+    poll_refill(head);
+  }
+
+  for(saftedev = head; saftedev->next; saftedev = saftedev->next) {
+    sp = saftedev->poll;
+    if(sp->pending || sp->queued) poll_abandon(saftedev, ETIMEDOUT);
+    if(sp->wanted && sp->done == sp->wanted) ok++;
+  }
+
+  return ok;
+}
+
+
+/* buffer ids requested from a device in the last run */
+int safte_poll_wanted(safte_device_t *saftedev)
+{
+  if(!saftedev->poll) return 0;
+  return saftedev->poll->wanted;
+}
+
+
+/* reply to a read issued in the last cycle, NULL if it failed */
+unsigned char *safte_poll_reply(safte_device_t *saftedev, int bufid)
+{
+  if(!saftedev->poll ||
+     !(saftedev->poll->done & SAFTE_POLL_MASK(bufid))) return NULL;
+  return saftedev->poll->reply[bufid];
+}
+
+
+/* errno of a failed read from the last cycle */
+int safte_poll_error(safte_device_t *saftedev, int bufid)
+{
+  if(!saftedev->poll) return ENXIO;
+  return saftedev->poll->req[bufid].error;
+}
+
+
+/* errno if the device's sg node could not be opened in the last cycle */
+int safte_poll_open_error(safte_device_t *saftedev)
+{
+  if(!saftedev->poll) return 0;
+  return saftedev->poll->open_error;
+}
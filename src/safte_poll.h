@@ -0,0 +1,61 @@
+/*
+ *  safte_poll.h - Concurrent SAF-TE enclosure polling
+ *
+ *  Author: Michael Clark <michael@metaparadigm.com>
+ *  Copyright Metaparadigm Pte. Ltd. 2001
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ */
+
+#ifndef _SAFTE_POLL_H_
+#define _SAFTE_POLL_H_
+
+#include "safte-monitor.h"
+
+
+/* SAF-TE read buffer ids are 0x00 to 0x05 */
+#define SAFTE_POLL_MAX_READS 6
+
+#define SAFTE_POLL_MASK(bufid) (1 << (bufid))
+
+/* time allowed on top of the command timeout before a reply is abandoned */
+#define SAFTE_POLL_SLACK 1000 /* ms */
+
+/* default commands in flight per host adapter */
+#define SAFTE_POLL_HOST_MAX 4
+
+
+/* per-device poll engine state */
+typedef struct safte_poll {
+
+  int pending;          /* requests in flight */
+  int wanted;           /* mask of buffer ids requested this cycle */
+  int queued;           /* mask of buffer ids waiting to be submitted */
+  int done;             /* mask of buffer ids read successfully */
+  int open_error;       /* errno if the sg node could not be opened */
+  int reopened;         /* stale fd already reopened this cycle */
+  long deadline;        /* give up on replies after this */
+  unsigned long seq;    /* when last submitted to, for round robin */
+
+  scsi_req_t req[SAFTE_POLL_MAX_READS];
+  unsigned char reply[SAFTE_POLL_MAX_READS][READ_REPLY_LEN];
+
+} safte_poll_t;
+
+
+extern int safte_poll_host_max;
+
+extern int safte_poll_attach(safte_device_t *saftedev);
+extern void safte_poll_detach(safte_device_t *saftedev);
+extern long safte_poll_now(void);
+extern int safte_poll_request(safte_device_t *saftedev, int mask);
+extern int safte_poll_run(safte_device_t *head);
+extern int safte_poll_wanted(safte_device_t *saftedev);
+extern unsigned char *safte_poll_reply(safte_device_t *saftedev, int bufid);
+extern int safte_poll_error(safte_device_t *saftedev, int bufid);
+extern int safte_poll_open_error(safte_device_t *saftedev);
+
+#endif
@@ -0,0 +1,257 @@
+/*
+ *  safte_poller.c - Background SAF-TE poller thread
+ *
+ *  Author: Michael Clark <michael@metaparadigm.com>
+ *  Copyright Metaparadigm Pte. Ltd. 2001
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <syslog.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "safte_poller.h"
+#include "safte_sched.h"
+#include "safte_hotplug.h"
+#include "safte_discover.h"
+#include "safte_startup.h"
+
+
+static pthread_t poller_thread;
+static int poller_running = 0;
+static int poller_stopping = 0;
+static pthread_mutex_t poller_lock = PTHREAD_MUTEX_INITIALIZER;
+static int poller_wake[2] = { -1, -1 };  /* written to on stop */
+
+/* the current snapshot, swapped under snap_lock */
+static pthread_mutex_t snap_lock = PTHREAD_MUTEX_INITIALIZER;
+static safte_snapshot_t *snap_current = NULL;
+
+
+static void snapshot_free(safte_snapshot_t *snap)
+{
+  free(snap->html);
+  free(snap);
+}
+
+
+/* bring the live enclosures' web page blocks up to date and publish
+   them, one after another, as the current snapshot */
+static void snapshot_publish(void)
+{
+  safte_snapshot_t *snap, *old;
+  safte_device_t *saftedev;
+  struct { const char *html; size_t len; } *block;
+  char *p;
+  int i;
+
+  snap = calloc(1, sizeof(safte_snapshot_t));
+  if(!snap) return;
+  for(saftedev = saftedev_head; saftedev->next; saftedev = saftedev->next)
+    snap->count++;
+  if(!(block = calloc(snap->count ? snap->count : 1, sizeof(*block)))) {
+    snapshot_free(snap);
+    return;
+  }
+
+  i = 0;
+  for(saftedev = saftedev_head; saftedev->next; saftedev = saftedev->next) {
+    if((block[i].html = safte_render_html(saftedev, &block[i].len)))
+      snap->html_len += block[i].len;
+    i++;
+  }
+  if(!(p = snap->html = malloc(snap->html_len ? snap->html_len : 1))) {
+    free(block);
+    snapshot_free(snap);
+    return;
+  }
+  for(i = 0; i < snap->count; i++) {
+    if(!block[i].html) continue;
+    memcpy(p, block[i].html, block[i].len);
+    p += block[i].len;
+  }
+  free(block);
+  snap->time = time(NULL);
+  snap->discovering = safte_discovering();
+  snap->refs = 1;
+
+  pthread_mutex_lock(&snap_lock);
+  old = snap_current;
+  snap_current = snap;
+  if(old && --old->refs) old = NULL;
+  pthread_mutex_unlock(&snap_lock);
+
+  if(old) snapshot_free(old);
+}
+
+
+/* take a reference on the current snapshot, NULL before the first
+   cycle has finished */
+safte_snapshot_t *safte_snapshot_get(void)
+{
+  safte_snapshot_t *snap;
+
+  pthread_mutex_lock(&snap_lock);
+  snap = snap_current;
+  if(snap) snap->refs++;
+  pthread_mutex_unlock(&snap_lock);
+
+  return snap;
+}
+
+
+void safte_snapshot_put(safte_snapshot_t *snap)
+{
+  int last;
+
+  if(!snap) return;
+  pthread_mutex_lock(&snap_lock);
+  last = (--snap->refs == 0);
+  pthread_mutex_unlock(&snap_lock);
+
+  if(last) snapshot_free(snap);
+}
+
+
+static int poller_stopped(void)
+{
+  int stopping;
+
+  pthread_mutex_lock(&poller_lock);
+  stopping = poller_stopping;
+  pthread_mutex_unlock(&poller_lock);
+
+  return stopping;
+}
+
+
+/* discovery has finished. Without enclosures or hot-plug there is
+   nothing to do, so shut down the way a SIGTERM would */
+static void poller_discovered(long long start)
+{
+  safte_startup_time(SAFTE_STARTUP_DISCOVERY, start);
+  safte_startup_complete();
+
+  if(safte_num) {
+    syslog(LOG_INFO, "Found %d SAF-TE devices", safte_num);
+  } else if(safte_hotplug_enabled) {
+    syslog(LOG_INFO, "No SAF-TE devices present. waiting for hot-plug");
+  } else {
+    syslog(LOG_INFO, "No SAF-TE devices present. exiting");
+    kill(getpid(), SIGTERM);
+  }
+}
+
+
+static void *poller_main(void *arg)
+{
+  struct pollfd pfd[2];
+  char drain[16];
+  long due, now;
+  long long start = safte_startup_now();
+  int changed, nfds;
+
+  /* seteuid() changes every thread in the process, the raw system call
+     only this one. The poller keeps root to open sg nodes while the
+     HTTP thread stays as the configured user */
+  if(syscall(SYS_setresuid, -1, 0, -1) < 0)
+    syslog(LOG_WARNING, "poller can't regain root: %s", strerror(errno));
+
+  if(safte_hotplug_open() < 0 && safte_hotplug_enabled)
+    syslog(LOG_WARNING, "can't listen for hot-plug events: %s",
+	   strerror(errno));
+
+  pfd[0].fd = poller_wake[0];
+  pfd[0].events = POLLIN;
+  pfd[1].fd = safte_hotplug_fd();
+  pfd[1].events = POLLIN;
+  nfds = pfd[1].fd >= 0 ? 2 : 1;
+
+  while(!poller_stopped()) {
+    changed = safte_hotplug_handle();
+
+    /* discovery in slices, so the enclosures found so far are polled
+       and published while the rest are looked for */
+    if(safte_discovering()) {
+      changed += safte_discover_step(SAFTE_DISCOVER_SLICE);
+      if(!safte_discovering()) poller_discovered(start);
+    }
+
+    /* only publish when an enclosure or the list changed */
+    if(check_safte_status() > 0 || changed > 0 || !snap_current)
+      snapshot_publish();
+
+    /* sleep until the scheduler has more reads due, a uevent arrives
+       or we are asked to stop */
+    now = safte_poll_now();
+    due = safte_discovering() ? now : safte_sched_next(saftedev_head, now);
+    if(poll(pfd, nfds, due > now ? due - now : 0) > 0 &&
+       (pfd[0].revents & POLLIN))
+      while(read(poller_wake[0], drain, sizeof(drain)) > 0);
+  }
+
+  safte_hotplug_close();
+
+  return NULL;
+}
+
+
+/* start polling on a thread of its own. Signals stay with the main
+   thread so mathopd's handlers see them */
+int safte_poller_start(void)
+{
+  sigset_t all, old;
+  int rv;
+
+  if(poller_running) return 0;
+
+  if(poller_wake[0] < 0) {
+    if(pipe(poller_wake) < 0) return -1;
+    for(rv = 0; rv < 2; rv++) {
+      fcntl(poller_wake[rv], F_SETFL, O_NONBLOCK);
+      fcntl(poller_wake[rv], F_SETFD, FD_CLOEXEC);
+    }
+  }
+
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  rv = pthread_create(&poller_thread, NULL, poller_main, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if(rv) {
+    errno = rv;
+    return -1;
+  }
+  poller_running = 1;
+
+  return 0;
+}
+
+
+/* ask the poller to finish its current cycle and wait for it */
+void safte_poller_stop(void)
+{
+  if(!poller_running) return;
+
+  pthread_mutex_lock(&poller_lock);
+  poller_stopping = 1;
+  pthread_mutex_unlock(&poller_lock);
+  if(write(poller_wake[1], "", 1) < 0) {
+    /* the pipe is full, the poller is already awake */
+  }
+
+  pthread_join(poller_thread, NULL);
+  poller_running = 0;
+}
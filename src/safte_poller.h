@@ -0,0 +1,41 @@
+/*
+ *  safte_poller.h - Background SAF-TE poller thread
+ *
+ *  Author: Michael Clark <michael@metaparadigm.com>
+ *  Copyright Metaparadigm Pte. Ltd. 2001
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ */
+
+#ifndef _SAFTE_POLLER_H_
+#define _SAFTE_POLLER_H_
+
+#include <time.h>
+
+#include "safte-monitor.h"
+
+
+/* enclosure state as of the end of a poll cycle. The HTTP side only
+   ever reads one of these, never the live device list */
+typedef struct safte_snapshot {
+
+  int refs;                /* readers plus one while current */
+  time_t time;             /* when the cycle finished */
+  int count;
+  int discovering;         /* more enclosures may still be found */
+  char *html;              /* the count enclosures' web page blocks, one
+			      after another */
+  size_t html_len;
+
+} safte_snapshot_t;
+
+
+extern int safte_poller_start(void);
+extern void safte_poller_stop(void);
+extern safte_snapshot_t *safte_snapshot_get(void);
+extern void safte_snapshot_put(safte_snapshot_t *snap);
+
+#endif
@@ -0,0 +1,219 @@
+/*
+ *  safte_sched.c - Per-enclosure SAF-TE read scheduling
+ *
+ *  Author: Michael Clark <michael@metaparadigm.com>
+ *  Copyright Metaparadigm Pte. Ltd. 2001
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "safte_sched.h"
+#include "safte_governor.h"
+
+
+/* Each read buffer has its own interval. A buffer whose reply hasn't
+   changed for SAFTE_SCHED_STABLE reads has its interval doubled up to
+   max. While the enclosure is alerting or a read fails every buffer
+   drops to min, and goes back to base once things are quiet again */
+typedef struct sched_interval {
+  long base, min, max;   /* seconds, base 0 means never polled */
+} sched_interval_t;
+
+static const sched_interval_t sched_intervals[SAFTE_POLL_MAX_READS] = {
+  {   0,   0,    0 },    /* SAFTE_READ_ENCLOSURE_CONFIG, read at scan */
+  {   5,   2,   20 },    /* SAFTE_READ_ENCLOSURE_STATUS */
+  { 600, 600, 2400 },    /* SAFTE_READ_USAGE_STATISTICS */
+  {  60,  30,  240 },    /* SAFTE_READ_DEVICE_INSERTIONS */
+  {  10,   2,   40 },    /* SAFTE_READ_DEVICE_SLOT_STATUS */
+  {  60,  10,  240 },    /* SAFTE_READ_GLOBAL_FLAGS */
+};
+
+
+static int seeded = 0;
+
+/* replies read and replies the same as the last one, per buffer id over
+   every enclosure. Read from the HTTP thread */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long stats_reads[SAFTE_POLL_MAX_READS];
+static unsigned long stats_unchanged[SAFTE_POLL_MAX_READS];
+
+
+int safte_sched_attach(safte_device_t *saftedev)
+{
+  safte_sched_t *ss;
+  int bufid;
+
+  if(saftedev->sched) return 0;
+  ss = calloc(1, sizeof(safte_sched_t));
+  if(!ss) return -1;
+
+  /* everything is due soon, at a random offset so that many machines
+     started together don't poll in lockstep */
+  if(!seeded) {
+    srandom(time(NULL) ^ getpid());
+    seeded = 1;
+  }
+  for(bufid = 0; bufid < SAFTE_POLL_MAX_READS; bufid++) {
+    ss->interval[bufid] = sched_intervals[bufid].base * 1000;
+    ss->due[bufid] = safte_poll_now() + random() % SAFTE_SCHED_JITTER;
+  }
+  saftedev->sched = ss;
+
+  return 0;
+}
+
+
+void safte_sched_detach(safte_device_t *saftedev)
+{
+  free(saftedev->sched);
+  saftedev->sched = NULL;
+}
+
+
+/* mask of buffer ids due for reading on a device */
+int safte_sched_due(safte_device_t *saftedev, long now)
+{
+  safte_sched_t *ss;
+  int bufid, mask = 0;
+
+  if(safte_sched_attach(saftedev) < 0) return 0;
+  ss = saftedev->sched;
+
+  for(bufid = 0; bufid < SAFTE_POLL_MAX_READS; bufid++)
+    if(ss->interval[bufid] && ss->due[bufid] <= now)
+      mask |= SAFTE_POLL_MASK(bufid);
+
+  /* a quarantined enclosure only gets the probe */
+  if(ss->failures >= SAFTE_BREAKER_TRIP)
+    mask &= SAFTE_POLL_MASK(SAFTE_READ_ENCLOSURE_STATUS);
+
+  return mask;
+}
+
+
+/* record whether an enclosure answered any read in the last poll and
+   return its SAFTE_LINK_STATUS. Buffers it failed to answer are retried
+   with exponential backoff until SAFTE_BREAKER_TRIP polls in a row have
+   failed, then the enclosure is only probed every SAFTE_BREAKER_PROBE
+   until it answers again */
+int safte_sched_result(safte_device_t *saftedev, int ok)
+{
+  safte_sched_t *ss = saftedev->sched;
+
+  if(!ss) return SAFTE_LINK_STATUS_OK;
+  if(ok) ss->failures = 0;
+  else ss->failures++;
+
+  if(!ss->failures) return SAFTE_LINK_STATUS_OK;
+  if(ss->failures >= SAFTE_BREAKER_TRIP) return SAFTE_LINK_STATUS_QUARANTINED;
+  return SAFTE_LINK_STATUS_RETRYING;
+}
+
+
+/* adjust a buffer's interval after a read. reply is NULL if the read
+   failed, alerting is set while any element of the enclosure is */
+void safte_sched_update(safte_device_t *saftedev, int bufid,
+			unsigned char *reply, int alerting, long now)
+{
+  safte_sched_t *ss = saftedev->sched;
+  const sched_interval_t *si = &sched_intervals[bufid];
+  long interval;
+
+  if(!ss || !si->base) return;
+  interval = ss->interval[bufid];
+
+  if(!reply && ss->failures) {
+    ss->stable[bufid] = 0;
+    if(ss->failures >= SAFTE_BREAKER_TRIP)
+      ss->due[bufid] = now + SAFTE_BREAKER_PROBE;
+    else
+      ss->due[bufid] = now + (SAFTE_RETRY_BASE << (ss->failures - 1));
+    return;
+  }
+
+  if(!reply || alerting) {
+    interval = si->min * 1000;
+    ss->stable[bufid] = 0;
+  } else if(memcmp(ss->last[bufid], reply, READ_REPLY_LEN)) {
+    interval = si->base * 1000;
+    ss->stable[bufid] = 0;
+  } else if(interval < si->base * 1000) {
+    interval = si->base * 1000;
+  } else if(++ss->stable[bufid] >= SAFTE_SCHED_STABLE) {
+    interval *= 2;
+    if(interval > si->max * 1000) interval = si->max * 1000;
+    ss->stable[bufid] = 0;
+  }
+
+  if(reply) {
+    memcpy(ss->last[bufid], reply, READ_REPLY_LEN);
+    ss->seen |= SAFTE_POLL_MASK(bufid);
+  }
+  /* up to a tenth of the interval is added so enclosures drift apart */
+  ss->interval[bufid] = interval;
+  ss->due[bufid] = now + safte_governor_stretch(saftedev, interval,
+						alerting, now) +
+    random() % (interval / 10 + 1);
+}
+
+
+/* whether a reply is byte for byte the last one read from the buffer,
+   so decoding and checking it again can be skipped */
+int safte_sched_unchanged(safte_device_t *saftedev, int bufid,
+			  unsigned char *reply)
+{
+  safte_sched_t *ss = saftedev->sched;
+  int same;
+
+  same = ss && (ss->seen & SAFTE_POLL_MASK(bufid)) &&
+    !memcmp(ss->last[bufid], reply, READ_REPLY_LEN);
+
+  pthread_mutex_lock(&stats_lock);
+  stats_reads[bufid]++;
+  if(same) stats_unchanged[bufid]++;
+  pthread_mutex_unlock(&stats_lock);
+
+  return same;
+}
+
+
+/* copy out the reply counts, SAFTE_POLL_MAX_READS of each */
+void safte_sched_stats(unsigned long *reads, unsigned long *unchanged)
+{
+  pthread_mutex_lock(&stats_lock);
+  memcpy(reads, stats_reads, sizeof(stats_reads));
+  memcpy(unchanged, stats_unchanged, sizeof(stats_unchanged));
+  pthread_mutex_unlock(&stats_lock);
+}
+
+
+/* when the next read on any device falls due */
+long safte_sched_next(safte_device_t *head, long now)
+{
+  safte_device_t *saftedev;
+  long next = now + SAFTE_SCHED_IDLE;
+  int bufid;
+
+  for(saftedev = head; saftedev->next; saftedev = saftedev->next) {
+    safte_sched_t *ss = saftedev->sched;
+    if(!ss) return now;
+    for(bufid = 0; bufid < SAFTE_POLL_MAX_READS; bufid++) {
+      if(ss->failures >= SAFTE_BREAKER_TRIP &&
+	 bufid != SAFTE_READ_ENCLOSURE_STATUS) continue;
+      if(ss->interval[bufid] && ss->due[bufid] < next)
+	next = ss->due[bufid];
+    }
+  }
+
+  return next;
+}
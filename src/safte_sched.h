@@ -0,0 +1,63 @@
+/*
+ *  safte_sched.h - Per-enclosure SAF-TE read scheduling
+ *
+ *  Author: Michael Clark <michael@metaparadigm.com>
+ *  Copyright Metaparadigm Pte. Ltd. 2001
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ */
+
+#ifndef _SAFTE_SCHED_H_
+#define _SAFTE_SCHED_H_
+
+#include "safte-monitor.h"
+#include "safte_poll.h"
+
+
+/* unchanged replies in a row before a buffer's interval is doubled */
+#define SAFTE_SCHED_STABLE 6
+
+/* first reads on a device are spread over this much time */
+#define SAFTE_SCHED_JITTER 2000 /* ms */
+
+/* consecutive polls an enclosure may fail to answer before it is
+   quarantined. Until then it is retried after SAFTE_RETRY_BASE, doubled
+   for each failure */
+#define SAFTE_BREAKER_TRIP 4
+#define SAFTE_RETRY_BASE 1000 /* ms */
+
+/* how often a quarantined enclosure is probed */
+#define SAFTE_BREAKER_PROBE 60000 /* ms */
+
+/* longest the poller sleeps when nothing is scheduled */
+#define SAFTE_SCHED_IDLE 5000 /* ms */
+
+
+/* per-device schedule, one entry per SAF-TE read buffer */
+typedef struct safte_sched {
+
+  long interval[SAFTE_POLL_MAX_READS];  /* current interval in ms */
+  long due[SAFTE_POLL_MAX_READS];       /* next read, safte_poll_now() ms */
+  int stable[SAFTE_POLL_MAX_READS];     /* unchanged replies in a row */
+  int failures;                         /* polls in a row not answered */
+  int seen;                             /* mask of buffers in last */
+  unsigned char last[SAFTE_POLL_MAX_READS][READ_REPLY_LEN];
+
+} safte_sched_t;
+
+
+extern int safte_sched_attach(safte_device_t *saftedev);
+extern void safte_sched_detach(safte_device_t *saftedev);
+extern int safte_sched_due(safte_device_t *saftedev, long now);
+extern void safte_sched_update(safte_device_t *saftedev, int bufid,
+			       unsigned char *reply, int alerting, long now);
+extern int safte_sched_result(safte_device_t *saftedev, int ok);
+extern int safte_sched_unchanged(safte_device_t *saftedev, int bufid,
+				 unsigned char *reply);
+extern void safte_sched_stats(unsigned long *reads, unsigned long *unchanged);
+extern long safte_sched_next(safte_device_t *head, long now);
+
+#endif
@@ -0,0 +1,608 @@
+/*
+ *  safte_sim.c - Simulated SAF-TE enclosures
+ *
+ *  Author: Michael Clark <michael@metaparadigm.com>
+ *  Copyright Metaparadigm Pte. Ltd. 2001
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ */
+
+/*
+ * A transport that answers READ BUFFER and INQUIRY from software
+ * enclosures instead of the sg driver, so discovery, polling, alerting
+ * and the web interface can be run without hardware. Enclosures and a
+ * timeline of faults are described in a file given with -S:
+ *
+ *   # count and shape of a group of enclosures
+ *   enclosure <n> [fans=<n>] [psus=<n>] [slots=<n>] [temps=<n>]
+ *                 [latency=<ms>] [host=<n>] [paths=<n>]
+ *
+ *   # at <seconds> after startup change enclosure <n>, or * for all
+ *   at <secs> <n|*> fan <i> <code>
+ *   at <secs> <n|*> psu <i> <code>
+ *   at <secs> <n|*> slot <i> <byte0> [<byte3>]
+ *   at <secs> <n|*> temp <i> <celsius>
+ *   at <secs> <n|*> door <code>
+ *   at <secs> <n|*> speaker <code>
+ *   at <secs> <n|*> flags <code>
+ *   at <secs> <n|*> latency <ms>
+ *   at <secs> <n|*> hang
+ *   at <secs> <n|*> recover
+ *   at <secs> <n|*> pathdown <p>
+ *   at <secs> <n|*> pathup <p>
+ *
+ * An enclosure has at most 64 slots, as many as a READ DEVICE SLOT
+ * STATUS reply holds. Elements and paths count from 0.
+ *
+ * Codes are the SAF-TE status values and may be given in hex, global
+ * flags with byte 1 in the high 8 bits. A hung
+ * enclosure accepts commands and never completes them. An enclosure
+ * with more than one path appears once per path, path p on the
+ * channels after those of path p-1, and a path that is down can't be
+ * opened or sent commands.
+ *
+ * Each open enclosure has a timerfd armed for its earliest pending
+ * completion, which gives the poll engine an fd to wait on.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/timerfd.h>
+
+#include "safte_sim.h"
+#include "safte_poll.h"
+#include "scsi_index.h"
+
+
+#define SIM_FAN 1
+#define SIM_PSU 2
+#define SIM_SLOT 3
+#define SIM_TEMP 4
+#define SIM_DOOR 5
+#define SIM_SPEAKER 6
+#define SIM_LATENCY 7
+#define SIM_HANG 8
+#define SIM_RECOVER 9
+#define SIM_PATHDOWN 10
+#define SIM_PATHUP 11
+#define SIM_FLAGS 12
+
+/* channels each path of the simulated enclosures spans */
+#define SIM_PATH_CHANNELS (SAFTE_SIM_PER_HOST / SAFTE_SIM_PER_CHANNEL)
+
+#define SIM_NEVER LONG_MAX
+
+
+typedef struct sim_event {
+  long at;              /* ms after load */
+  int enclosure;        /* -1 for all */
+  int what;             /* SIM_* */
+  int index;
+  int value;
+  int value2;           /* slot byte 3, -1 to leave alone */
+  struct sim_event *next;
+} sim_event_t;
+
+
+typedef struct sim_req {
+  scsi_req_t *req;
+  long done;            /* when it completes, safte_poll_now() ms */
+  struct sim_req *next;
+} sim_req_t;
+
+
+typedef struct sim_enclosure {
+  int index;
+  int fans, psus, slots, temps;
+  int fan[SAFTE_MAX_FAN];
+  int psu[SAFTE_MAX_PSU];
+  int slot0[SAFTE_MAX_SLOTS];
+  int slot3[SAFTE_MAX_SLOTS];
+  int insertions[SAFTE_MAX_SLOTS];
+  int temp[SAFTE_MAX_TEMPSENSORS];
+  int door, speaker;
+  int flags;            /* global flags */
+  int latency;          /* ms */
+  int hung;
+  int host;
+  int paths;
+  int pathdown;         /* mask of paths that are down */
+  sim_req_t *queue;     /* submitted, in completion order */
+  struct sim_enclosure *next;
+} sim_enclosure_t;
+
+
+static sim_enclosure_t *sim_head = NULL, *sim_tail = NULL;
+static int sim_count = 0;
+static sim_event_t *sim_events = NULL;  /* in time order */
+static long sim_start;
+
+
+static void sim_set(sim_enclosure_t *enc, sim_event_t *ev)
+{
+  int i = ev->index;
+
+  switch(ev->what) {
+  case SIM_FAN:
+    if(i < enc->fans) enc->fan[i] = ev->value;
+    break;
+  case SIM_PSU:
+    if(i < enc->psus) enc->psu[i] = ev->value;
+    break;
+  case SIM_SLOT:
+    if(i >= enc->slots) break;
+    enc->slot0[i] = ev->value;
+    if(ev->value2 >= 0) {
+      if(!enc->slot3[i] && ev->value2) enc->insertions[i]++;
+      enc->slot3[i] = ev->value2;
+    }
+    break;
+  case SIM_TEMP:
+    if(i < enc->temps) enc->temp[i] = ev->value;
+    break;
+  case SIM_DOOR:
+    enc->door = ev->value;
+    break;
+  case SIM_SPEAKER:
+    enc->speaker = ev->value;
+    break;
+  case SIM_FLAGS:
+    enc->flags = ev->value;
+    break;
+  case SIM_LATENCY:
+    enc->latency = ev->value;
+    break;
+  case SIM_HANG:
+    enc->hung = 1;
+    break;
+  case SIM_RECOVER:
+    enc->hung = 0;
+    break;
+  case SIM_PATHDOWN:
+    if(ev->value < enc->paths) enc->pathdown |= 1 << ev->value;
+    break;
+  case SIM_PATHUP:
+    if(ev->value < enc->paths) enc->pathdown &= ~(1 << ev->value);
+    break;
+  }
+}
+
+
+/* play the fault timeline up to now */
+static void sim_advance(long now)
+{
+  sim_enclosure_t *enc;
+  sim_event_t *ev;
+
+  while((ev = sim_events) && ev->at <= now - sim_start) {
+    for(enc = sim_head; enc; enc = enc->next)
+      if(ev->enclosure < 0 || ev->enclosure == enc->index)
+	sim_set(enc, ev);
+    sim_events = ev->next;
+    free(ev);
+  }
+}
+
+
+/* byte p of a reply, dropped past the end of the buffer */
+static void sim_put(unsigned char *buf, int len, int p, int val)
+{
+  if(p < len) buf[p] = val;
+}
+
+
+/* SAF-TE READ BUFFER replies, laid out as in the SAF-TE specification.
+   Whatever doesn't fit in the len bytes of buf is left off */
+static void sim_read_buffer(sim_enclosure_t *enc, int bufid,
+			    unsigned char *buf, int len)
+{
+  int i, p, toorf = 0;
+
+  switch(bufid) {
+  case SAFTE_READ_ENCLOSURE_CONFIG:
+    buf[0] = enc->fans;
+    buf[1] = enc->psus;
+    buf[2] = enc->slots;
+    buf[3] = 1;                         /* door lock */
+    buf[4] = enc->temps;
+    buf[5] = 1;                         /* audible alarm */
+    buf[6] = 0x80;                      /* celsius, no thermostats */
+    break;
+  case SAFTE_READ_ENCLOSURE_STATUS:
+    p = 0;
+    for(i = 0; i < enc->fans; i++) sim_put(buf, len, p++, enc->fan[i]);
+    for(i = 0; i < enc->psus; i++) sim_put(buf, len, p++, enc->psu[i]);
+    for(i = 0; i < enc->slots; i++) sim_put(buf, len, p++, i);
+    sim_put(buf, len, p++, enc->door);
+    sim_put(buf, len, p++, enc->speaker);
+    for(i = 0; i < enc->temps; i++) {
+      sim_put(buf, len, p++, enc->temp[i] + 10);
+      if(enc->temp[i] >= SAFTE_SIM_TEMP_LIMIT) toorf |= 1 << i;
+    }
+    if(toorf) toorf |= 0x8000;
+    sim_put(buf, len, p++, toorf >> 8);
+    sim_put(buf, len, p++, toorf & 0xff);
+    break;
+  case SAFTE_READ_USAGE_STATISTICS:
+    i = (safte_poll_now() - sim_start) / 60000 + 1000;
+    buf[2] = i >> 8;
+    buf[3] = i & 0xff;
+    buf[7] = 1;
+    break;
+  case SAFTE_READ_DEVICE_INSERTIONS:
+    for(i = 0; i < enc->slots && i*2 + 1 < len; i++) {
+      buf[i*2] = enc->insertions[i] >> 8;
+      buf[i*2 + 1] = enc->insertions[i] & 0xff;
+    }
+    break;
+  case SAFTE_READ_DEVICE_SLOT_STATUS:
+    for(i = 0; i < enc->slots && i*4 + 3 < len; i++) {
+      buf[i*4] = enc->slot0[i];
+      buf[i*4 + 3] = enc->slot3[i];
+    }
+    break;
+  case SAFTE_READ_GLOBAL_FLAGS:
+    buf[0] = enc->flags & 0xff;
+    buf[1] = enc->flags >> 8;
+    break;
+  }
+}
+
+
+static void sim_inquiry(sim_enclosure_t *enc, unsigned char *cdb,
+			unsigned char *buf)
+{
+  if(cdb[1] & 1) {
+    /* unit serial number page */
+    buf[1] = 0x80;
+    buf[3] = snprintf((char*)buf + 4, INQUIRY_REPLY_LEN - 4,
+		      "SIM%05d", enc->index);
+    return;
+  }
+  buf[0] = TYPE_PROCESSOR;
+  buf[2] = 2;
+  buf[4] = INQUIRY_REPLY_LEN - 5;
+  memcpy(buf + INQUIRY_VENDOR_OFFSET, "SIMULATE", INQUIRY_VENDOR_LENGTH);
+  memcpy(buf + INQUIRY_PRODUCT_OFFSET, "SAF-TE ENCLOSURE",
+	 INQUIRY_PRODUCT_LENGTH);
+  memcpy(buf + INQUIRY_REVISION_OFFSET, "0001", INQUIRY_REVISION_LENGTH);
+  memcpy(buf + INQUIRY_SAFTEID_OFFSET, "SAF-TE", INQUIRY_SAFTEID_LENGTH);
+}
+
+
+/* carry out a completed command */
+static void sim_complete(sim_enclosure_t *enc, scsi_req_t *req)
+{
+  unsigned char buf[READ_REPLY_LEN > INQUIRY_REPLY_LEN ?
+		    READ_REPLY_LEN : INQUIRY_REPLY_LEN];
+  unsigned len;
+
+  memset(buf, 0, sizeof(buf));
+  memset(&req->st, 0, sizeof(scsi_cmd_status_t));
+  req->error = 0;
+
+  if(req->cdb[0] == READ_CMD) {
+    sim_read_buffer(enc, req->cdb[2], buf, sizeof(buf));
+  } else if(req->cdb[0] == INQUIRY_CMD) {
+    sim_inquiry(enc, req->cdb, buf);
+  } else {
+    req->st.status = 0x02;              /* check condition */
+    req->error = EIO;
+    return;
+  }
+
+  len = req->buf_len < sizeof(buf) ? req->buf_len : sizeof(buf);
+  if(req->buf) memcpy(req->buf, buf, len);
+}
+
+
+/* arm the timer for the next completion */
+static void sim_arm(scsi_device_t *scsidev)
+{
+  sim_enclosure_t *enc = scsidev->tpriv;
+  struct itimerspec its;
+
+  memset(&its, 0, sizeof(its));
+  if(enc->queue && enc->queue->done != SIM_NEVER) {
+    its.it_value.tv_sec = enc->queue->done / 1000;
+    its.it_value.tv_nsec = (enc->queue->done % 1000) * 1000000 + 1;
+  }
+  timerfd_settime(scsidev->sg_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+
+static int sim_path_down(scsi_device_t *scsidev)
+{
+  sim_enclosure_t *enc = scsidev->tpriv;
+
+  sim_advance(safte_poll_now());
+  return enc->pathdown & (1 << scsidev->channel / SIM_PATH_CHANNELS);
+}
+
+
+static int sim_open(scsi_device_t *scsidev)
+{
+  if(sim_path_down(scsidev)) {
+    errno = ENODEV;
+    return -1;
+  }
+  return timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+}
+
+
+static int sim_submit(scsi_device_t *scsidev, scsi_req_t *req)
+{
+  sim_enclosure_t *enc = scsidev->tpriv;
+  sim_req_t *sr, **p;
+  long now = safte_poll_now();
+
+  if(sim_path_down(scsidev)) {
+    req->error = ENODEV;
+    return -1;
+  }
+  if(!(sr = malloc(sizeof(sim_req_t)))) {
+    req->error = ENOMEM;
+    return -1;
+  }
+  sr->req = req;
+  sr->done = enc->hung ? SIM_NEVER : now + enc->latency;
+
+  for(p = &enc->queue; *p && (*p)->done <= sr->done; p = &(*p)->next);
+  sr->next = *p;
+  *p = sr;
+  sim_arm(scsidev);
+
+  return 0;
+}
+
+
+static scsi_req_t *sim_reap(scsi_device_t *scsidev)
+{
+  sim_enclosure_t *enc = scsidev->tpriv;
+  sim_req_t *sr = enc->queue;
+  scsi_req_t *req = NULL;
+  unsigned long long expired;
+  long now = safte_poll_now();
+
+  if(read(scsidev->sg_fd, &expired, sizeof(expired)) < 0 && errno != EAGAIN)
+    return NULL;
+
+  sim_advance(now);
+  if(sr && sr->done <= now) {
+    enc->queue = sr->next;
+    req = sr->req;
+    free(sr);
+    sim_complete(enc, req);
+  }
+  sim_arm(scsidev);
+
+  if(!req) errno = EAGAIN;
+  return req;
+}
+
+
+/* requests still queued are dropped, as the sg driver does */
+static void sim_close(scsi_device_t *scsidev)
+{
+  sim_enclosure_t *enc = scsidev->tpriv;
+  sim_req_t *sr;
+
+  while((sr = enc->queue)) {
+    enc->queue = sr->next;
+    free(sr);
+  }
+  close(scsidev->sg_fd);
+}
+
+
+scsi_transport_t safte_sim_transport = {
+  "sim", sim_open, sim_submit, sim_reap, sim_close, NULL
+};
+
+
+static int sim_parse_enclosure(char *args, const char *filename, int line)
+{
+  sim_enclosure_t proto, *enc;
+  char *tok, key[16];
+  int n, i, val;
+
+  memset(&proto, 0, sizeof(proto));
+  proto.fans = SAFTE_SIM_FANS;
+  proto.psus = SAFTE_SIM_PSUS;
+  proto.slots = SAFTE_SIM_SLOTS;
+  proto.temps = SAFTE_SIM_TEMPS;
+  proto.latency = SAFTE_SIM_LATENCY;
+  proto.host = -1;
+  proto.paths = 1;
+
+  if(!(tok = strtok(args, " \t")) || (n = strtol(tok, NULL, 0)) <= 0)
+    goto bad;
+  while((tok = strtok(NULL, " \t"))) {
+    if(sscanf(tok, "%15[a-z]=%i", key, &val) != 2 || val < 0) goto bad;
+    if(!strcmp(key, "fans") && val <= SAFTE_MAX_FAN) proto.fans = val;
+    else if(!strcmp(key, "psus") && val <= SAFTE_MAX_PSU) proto.psus = val;
+    /* as many as fit in a READ DEVICE SLOT STATUS reply */
+    else if(!strcmp(key, "slots") && val <= READ_REPLY_LEN / 4)
+      proto.slots = val;
+    else if(!strcmp(key, "temps") && val <= SAFTE_MAX_TEMPSENSORS)
+      proto.temps = val;
+    else if(!strcmp(key, "latency")) proto.latency = val;
+    else if(!strcmp(key, "host")) proto.host = val;
+    else if(!strcmp(key, "paths") && val > 0 && val <= SAFTE_MAX_PATHS)
+      proto.paths = val;
+    else goto bad;
+  }
+
+  /* everything starts out healthy */
+  for(i = 0; i < proto.slots; i++) {
+    proto.slot0[i] = SAFTE_SLOT_BYTE0_NOERROR;
+    proto.slot3[i] = SAFTE_SLOT_BYTE3_PRESENT | SAFTE_SLOT_BYTE3_ACTIVE;
+    proto.insertions[i] = 1;
+  }
+  for(i = 0; i < proto.temps; i++) proto.temp[i] = 25;
+
+  while(n--) {
+    if(!(enc = malloc(sizeof(sim_enclosure_t)))) return -1;
+    memcpy(enc, &proto, sizeof(sim_enclosure_t));
+    enc->index = sim_count++;
+    if(sim_tail) sim_tail->next = enc;
+    else sim_head = enc;
+    sim_tail = enc;
+  }
+  return 0;
+
+ bad:
+  fprintf(stderr, "%s:%d: bad enclosure line\n", filename, line);
+  return -1;
+}
+
+
+static int sim_parse_event(char *args, const char *filename, int line)
+{
+  static const struct { const char *name; int what, nargs; } kinds[] = {
+    { "fan", SIM_FAN, 2 }, { "psu", SIM_PSU, 2 }, { "slot", SIM_SLOT, 2 },
+    { "temp", SIM_TEMP, 2 }, { "door", SIM_DOOR, 1 },
+    { "speaker", SIM_SPEAKER, 1 }, { "latency", SIM_LATENCY, 1 },
+    { "hang", SIM_HANG, 0 }, { "recover", SIM_RECOVER, 0 },
+    { "pathdown", SIM_PATHDOWN, 1 }, { "pathup", SIM_PATHUP, 1 },
+    { "flags", SIM_FLAGS, 1 }, { NULL, 0, 0 }
+  };
+  sim_event_t *ev, **p;
+  char *tok, *end;
+  int i, arg[3], nargs = 0;
+  double secs;
+
+  if(!(ev = calloc(1, sizeof(sim_event_t)))) return -1;
+  ev->value2 = -1;
+
+  if(!(tok = strtok(args, " \t")) || (secs = strtod(tok, &end)) < 0 || *end)
+    goto bad;
+  ev->at = secs * 1000;
+  if(!(tok = strtok(NULL, " \t"))) goto bad;
+  if(strcmp(tok, "*")) {
+    if((ev->enclosure = strtol(tok, &end, 0)) < 0 || *end) goto bad;
+  } else {
+    ev->enclosure = -1;
+  }
+  if(!(tok = strtok(NULL, " \t"))) goto bad;
+  for(i = 0; kinds[i].name && strcmp(kinds[i].name, tok); i++);
+  if(!kinds[i].name) goto bad;
+  ev->what = kinds[i].what;
+
+  while(nargs < 3 && (tok = strtok(NULL, " \t"))) {
+    arg[nargs++] = strtol(tok, &end, 0);
+    if(*end) goto bad;
+  }
+  if(nargs < kinds[i].nargs ||
+     nargs > kinds[i].nargs + (ev->what == SIM_SLOT)) goto bad;
+  /* element indexes and path numbers count from 0 */
+  if(kinds[i].nargs == 2) {
+    if(arg[0] < 0) goto bad;
+    ev->index = arg[0];
+    ev->value = arg[1];
+    if(nargs == 3) ev->value2 = arg[2];
+  } else if(kinds[i].nargs == 1) {
+    if(arg[0] < 0 &&
+       (ev->what == SIM_PATHDOWN || ev->what == SIM_PATHUP)) goto bad;
+    ev->value = arg[0];
+  }
+
+  for(p = &sim_events; *p && (*p)->at <= ev->at; p = &(*p)->next);
+  ev->next = *p;
+  *p = ev;
+  return 0;
+
+ bad:
+  free(ev);
+  fprintf(stderr, "%s:%d: bad event line\n", filename, line);
+  return -1;
+}
+
+
+/* read a simulation file. Returns the number of enclosures or -1 */
+int safte_sim_load(const char *filename)
+{
+  FILE *f;
+  char buf[256], *p;
+  int line = 0, rv = 0;
+
+  if(!(f = fopen(filename, "r"))) {
+    perror(filename);
+    return -1;
+  }
+  sim_start = safte_poll_now();
+
+  while(rv == 0 && fgets(buf, sizeof(buf), f)) {
+    line++;
+    if((p = strchr(buf, '#'))) *p = '\0';
+    for(p = buf + strlen(buf); p > buf && isspace(p[-1]); *--p = '\0');
+    for(p = buf; isspace(*p); p++);
+    if(!*p) continue;
+
+    if(!strncmp(p, "enclosure", 9) && isspace(p[9]))
+      rv = sim_parse_enclosure(p + 10, filename, line);
+    else if(!strncmp(p, "at", 2) && isspace(p[2]))
+      rv = sim_parse_event(p + 3, filename, line);
+    else {
+      fprintf(stderr, "%s:%d: unknown keyword\n", filename, line);
+      rv = -1;
+    }
+  }
+  fclose(f);
+
+  return rv < 0 ? -1 : sim_count;
+}
+
+
+/* add the simulated enclosures to the scsi device list as processor
+   devices, the way a scan of the sg nodes would find them. An enclosure
+   with several paths is added once for each */
+int safte_sim_scan(void)
+{
+  sim_enclosure_t *enc;
+  scsi_device_t *scsidev;
+  char tmp[32];
+  int p;
+
+  for(scsidev = scsidev_head; scsidev->next; scsidev = scsidev->next);
+
+  for(enc = sim_head; enc; enc = enc->next) {
+    for(p = 0; p < enc->paths; p++) {
+      if(p) snprintf(tmp, sizeof(tmp), "sim:%d.%d", enc->index, p);
+      else snprintf(tmp, sizeof(tmp), "sim:%d", enc->index);
+      scsidev->sg_device = strdup(tmp);
+      scsidev->active = 1;
+      scsidev->host = enc->host >= 0 ? enc->host :
+	SAFTE_SIM_HOST + enc->index / SAFTE_SIM_PER_HOST;
+      scsidev->channel = (enc->index % SAFTE_SIM_PER_HOST) /
+	SAFTE_SIM_PER_CHANNEL + p * SIM_PATH_CHANNELS;
+      scsidev->id = enc->index % SAFTE_SIM_PER_CHANNEL;
+      scsidev->lun = 0;
+      scsidev->type = TYPE_PROCESSOR;
+      strcpy(scsidev->hostname, "sim");
+      strcpy(scsidev->vendor, "SIMULATE");
+      strcpy(scsidev->product, "SAF-TE ENCLOSURE");
+      strcpy(scsidev->revision, "0001");
+      strcpy(scsidev->safteid, "SAF-TE");
+      snprintf(scsidev->serial, sizeof(scsidev->serial), "SIM%05d",
+	       enc->index);
+      scsidev->transport = &safte_sim_transport;
+      scsidev->tpriv = enc;
+      scsi_index_add(scsidev);
+
+      scsidev->next = alloc_scsidev();
+      if(!scsidev->next) return -1;
+      scsidev = scsidev->next;
+    }
+  }
+
+  return sim_count;
+}
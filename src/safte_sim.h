@@ -0,0 +1,40 @@
+/*
+ *  safte_sim.h - Simulated SAF-TE enclosures
+ *
+ *  Author: Michael Clark <michael@metaparadigm.com>
+ *  Copyright Metaparadigm Pte. Ltd. 2001
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ */
+
+#ifndef _SAFTE_SIM_H_
+#define _SAFTE_SIM_H_
+
+#include "safte-monitor.h"
+
+
+/* defaults for an enclosure line that doesn't say */
+#define SAFTE_SIM_FANS 2
+#define SAFTE_SIM_PSUS 2
+#define SAFTE_SIM_SLOTS 8
+#define SAFTE_SIM_TEMPS 2
+#define SAFTE_SIM_LATENCY 5 /* ms */
+#define SAFTE_SIM_HOST 100
+
+/* enclosures per simulated host adapter, and targets per channel */
+#define SAFTE_SIM_PER_HOST 32
+#define SAFTE_SIM_PER_CHANNEL 16
+
+/* temperature reported as out of range from */
+#define SAFTE_SIM_TEMP_LIMIT 50 /* celsius */
+
+
+extern scsi_transport_t safte_sim_transport;
+
+extern int safte_sim_load(const char *filename);
+extern int safte_sim_scan(void);
+
+#endif
@@ -0,0 +1,232 @@
+/*
+ *  safte_slot.c - Slot status unpacking and change detection
+ *
+ *  Author: Michael Clark <michael@metaparadigm.com>
+ *  Copyright Metaparadigm Pte. Ltd. 2001
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ */
+
+/*
+ * READ DEVICE SLOT STATUS returns four bytes per slot. They are split
+ * into one array per byte and, in the same pass, compared with bytes 0
+ * and 3 of the last generation, setting a bit for each slot that
+ * changed, so the check only visits those slots.
+ *
+ * On x86 the work is done 32 slots at a time with AVX2 or 16 with SSE2,
+ * chosen when first called, with the scalar loop for the tail and for
+ * other machines. The old arrays may be the ones being written.
+ */
+
+#include <string.h>
+
+#include "safte_slot.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SAFTE_SLOT_X86 1
+#include <immintrin.h>
+#endif
+
+
+/* slots from first on, one at a time */
+static void slot_unpack_tail(const unsigned char *buf, int first, int n,
+			     unsigned char **status,
+			     const unsigned char *old0,
+			     const unsigned char *old3,
+			     unsigned int *changed)
+{
+  unsigned char b0, b3;
+  int i;
+
+  for(i = first; i < n; i++) {
+    b0 = buf[i*4];
+    b3 = buf[i*4 + 3];
+    if(b0 != old0[i] || b3 != old3[i]) changed[i / 32] |= 1u << (i % 32);
+    status[0][i] = b0;
+    status[1][i] = buf[i*4 + 1];
+    status[2][i] = buf[i*4 + 2];
+    status[3][i] = b3;
+  }
+}
+
+
+void safte_slot_unpack_scalar(const unsigned char *buf, int n,
+			      unsigned char **status,
+			      const unsigned char *old0,
+			      const unsigned char *old3,
+			      unsigned int *changed)
+{
+  memset(changed, 0, SAFTE_SLOT_WORDS(n) * sizeof(unsigned int));
+  slot_unpack_tail(buf, 0, n, status, old0, old3, changed);
+}
+
+
+#ifdef SAFTE_SLOT_X86
+
+/* byte k of each of 16 slots, from four loads of four slots each */
+__attribute__((target("sse2")))
+static __m128i slot_byte_sse2(__m128i a, __m128i b, __m128i c, __m128i d,
+			      int k)
+{
+  __m128i mask = _mm_set1_epi32(0xff);
+  __m128i shift = _mm_cvtsi32_si128(k * 8);
+
+  a = _mm_and_si128(_mm_srl_epi32(a, shift), mask);
+  b = _mm_and_si128(_mm_srl_epi32(b, shift), mask);
+  c = _mm_and_si128(_mm_srl_epi32(c, shift), mask);
+  d = _mm_and_si128(_mm_srl_epi32(d, shift), mask);
+
+  return _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+}
+
+
+__attribute__((target("sse2")))
+static void slot_unpack_sse2(const unsigned char *buf, int n,
+			     unsigned char **status,
+			     const unsigned char *old0,
+			     const unsigned char *old3,
+			     unsigned int *changed)
+{
+  __m128i a, b, c, d, s0, s3, same;
+  int i, k;
+
+  memset(changed, 0, SAFTE_SLOT_WORDS(n) * sizeof(unsigned int));
+  for(i = 0; i + 16 <= n; i += 16) {
+    a = _mm_loadu_si128((const __m128i*)(buf + i*4));
+    b = _mm_loadu_si128((const __m128i*)(buf + i*4 + 16));
+    c = _mm_loadu_si128((const __m128i*)(buf + i*4 + 32));
+    d = _mm_loadu_si128((const __m128i*)(buf + i*4 + 48));
+
+    s0 = slot_byte_sse2(a, b, c, d, 0);
+    s3 = slot_byte_sse2(a, b, c, d, 3);
+    same = _mm_and_si128(
+      _mm_cmpeq_epi8(s0, _mm_loadu_si128((const __m128i*)(old0 + i))),
+      _mm_cmpeq_epi8(s3, _mm_loadu_si128((const __m128i*)(old3 + i))));
+    changed[i / 32] |= (unsigned)(~_mm_movemask_epi8(same) & 0xffff)
+      << (i % 32);
+
+    _mm_storeu_si128((__m128i*)(status[0] + i), s0);
+    for(k = 1; k < 3; k++)
+      _mm_storeu_si128((__m128i*)(status[k] + i),
+		       slot_byte_sse2(a, b, c, d, k));
+    _mm_storeu_si128((__m128i*)(status[3] + i), s3);
+  }
+  slot_unpack_tail(buf, i, n, status, old0, old3, changed);
+}
+
+
+/* byte k of each of 32 slots, from four loads of eight slots each. The
+   packs work within 128 bit lanes, the permute puts the slots back in
+   order */
+__attribute__((target("avx2")))
+static __m256i slot_byte_avx2(__m256i a, __m256i b, __m256i c, __m256i d,
+			      int k)
+{
+  __m256i mask = _mm256_set1_epi32(0xff);
+  __m128i shift = _mm_cvtsi32_si128(k * 8);
+
+  a = _mm256_and_si256(_mm256_srl_epi32(a, shift), mask);
+  b = _mm256_and_si256(_mm256_srl_epi32(b, shift), mask);
+  c = _mm256_and_si256(_mm256_srl_epi32(c, shift), mask);
+  d = _mm256_and_si256(_mm256_srl_epi32(d, shift), mask);
+
+  return _mm256_permutevar8x32_epi32(
+    _mm256_packus_epi16(_mm256_packs_epi32(a, b), _mm256_packs_epi32(c, d)),
+    _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+}
+
+
+__attribute__((target("avx2")))
+static void slot_unpack_avx2(const unsigned char *buf, int n,
+			     unsigned char **status,
+			     const unsigned char *old0,
+			     const unsigned char *old3,
+			     unsigned int *changed)
+{
+  __m256i a, b, c, d, s0, s3, same;
+  int i, k;
+
+  memset(changed, 0, SAFTE_SLOT_WORDS(n) * sizeof(unsigned int));
+  for(i = 0; i + 32 <= n; i += 32) {
+    a = _mm256_loadu_si256((const __m256i*)(buf + i*4));
+    b = _mm256_loadu_si256((const __m256i*)(buf + i*4 + 32));
+    c = _mm256_loadu_si256((const __m256i*)(buf + i*4 + 64));
+    d = _mm256_loadu_si256((const __m256i*)(buf + i*4 + 96));
+
+    s0 = slot_byte_avx2(a, b, c, d, 0);
+    s3 = slot_byte_avx2(a, b, c, d, 3);
+    same = _mm256_and_si256(
+      _mm256_cmpeq_epi8(s0, _mm256_loadu_si256((const __m256i*)(old0 + i))),
+      _mm256_cmpeq_epi8(s3, _mm256_loadu_si256((const __m256i*)(old3 + i))));
+    changed[i / 32] = ~(unsigned)_mm256_movemask_epi8(same);
+
+    _mm256_storeu_si256((__m256i*)(status[0] + i), s0);
+    for(k = 1; k < 3; k++)
+      _mm256_storeu_si256((__m256i*)(status[k] + i),
+			  slot_byte_avx2(a, b, c, d, k));
+    _mm256_storeu_si256((__m256i*)(status[3] + i), s3);
+  }
+  slot_unpack_tail(buf, i, n, status, old0, old3, changed);
+}
+
+#endif
+
+
+static safte_slot_unpack_t slot_unpack = NULL;
+static const char *slot_impl = "scalar";
+
+
+static void slot_choose(void)
+{
+  slot_unpack = safte_slot_unpack_scalar;
+#ifdef SAFTE_SLOT_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")) {
+    slot_unpack = slot_unpack_avx2;
+    slot_impl = "avx2";
+  } else if(__builtin_cpu_supports("sse2")) {
+    slot_unpack = slot_unpack_sse2;
+    slot_impl = "sse2";
+  }
+#endif
+}
+
+
+/* split n slots of status bytes in buf into status[0..3], n bytes each,
+   and set bit i of changed, SAFTE_SLOT_WORDS(n) words, for each slot i
+   whose byte 0 or 3 differs from old0[i] or old3[i] */
+void safte_slot_unpack(const unsigned char *buf, int n,
+		       unsigned char **status,
+		       const unsigned char *old0, const unsigned char *old3,
+		       unsigned int *changed)
+{
+  if(!slot_unpack) slot_choose();
+  slot_unpack(buf, n, status, old0, old3, changed);
+}
+
+
+/* the implementation safte_slot_unpack() uses */
+const char *safte_slot_impl(void)
+{
+  if(!slot_unpack) slot_choose();
+  return slot_impl;
+}
+
+
+/* a kernel by name, "scalar", "sse2" or "avx2", for the benchmark to
+   check against the scalar one. NULL if this machine can't run it */
+safte_slot_unpack_t safte_slot_kernel(const char *name)
+{
+  if(!strcmp(name, "scalar")) return safte_slot_unpack_scalar;
+#ifdef SAFTE_SLOT_X86
+  __builtin_cpu_init();
+  if(!strcmp(name, "avx2") && __builtin_cpu_supports("avx2"))
+    return slot_unpack_avx2;
+  if(!strcmp(name, "sse2") && __builtin_cpu_supports("sse2"))
+    return slot_unpack_sse2;
+#endif
+  return NULL;
+}
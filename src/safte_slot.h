@@ -0,0 +1,40 @@
+/*
+ *  safte_slot.h - Slot status unpacking and change detection
+ *
+ *  Author: Michael Clark <michael@metaparadigm.com>
+ *  Copyright Metaparadigm Pte. Ltd. 2001
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ */
+
+#ifndef _SAFTE_SLOT_H_
+#define _SAFTE_SLOT_H_
+
+
+/* words of a changed slot bitmap for n slots */
+#define SAFTE_SLOT_WORDS(n) (((n) + 31) / 32)
+
+
+typedef void (*safte_slot_unpack_t)(const unsigned char *buf, int n,
+				    unsigned char **status,
+				    const unsigned char *old0,
+				    const unsigned char *old3,
+				    unsigned int *changed);
+
+extern void safte_slot_unpack(const unsigned char *buf, int n,
+			      unsigned char **status,
+			      const unsigned char *old0,
+			      const unsigned char *old3,
+			      unsigned int *changed);
+extern void safte_slot_unpack_scalar(const unsigned char *buf, int n,
+				     unsigned char **status,
+				     const unsigned char *old0,
+				     const unsigned char *old3,
+				     unsigned int *changed);
+extern const char *safte_slot_impl(void);
+extern safte_slot_unpack_t safte_slot_kernel(const char *name);
+
+#endif
@@ -0,0 +1,259 @@
+/*
+ *  safte_slotbench.c - Benchmark of slot status unpacking
+ *
+ *  Author: Michael Clark <michael@metaparadigm.com>
+ *  Copyright Metaparadigm Pte. Ltd. 2001
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ */
+
+/*
+ * Times unpacking a READ DEVICE SLOT STATUS reply and finding the
+ * changed slots: the per slot loop into a slot struct with a compare
+ * pass that safte-monitor used to run, the scalar kernel and the kernel
+ * safte_slot_unpack() picks for this machine. Built and run with "make
+ * bench".
+ *
+ * First the SSE2 and AVX2 kernels this machine can run are checked
+ * against the scalar one for 0 to CHECK_SLOTS slots, with the old
+ * arrays apart from the status arrays and the same, and any difference
+ * fails the run.
+ *
+ *   safte_slotbench [slots] [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "safte_slot.h"
+
+
+#define BENCH_SLOTS 64
+#define BENCH_ITERATIONS 1000000
+
+#define CHECK_SLOTS 64
+#define CHECK_ROUNDS 16
+
+
+/* the slot struct before the state was split per byte */
+typedef struct bench_slot {
+  int id;
+  int status0;
+  int status1;
+  int status2;
+  int status3;
+  int insertions;
+  void *device;
+} bench_slot_t;
+
+
+static double bench_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static unsigned bench_loop(const unsigned char *buf, int n,
+			   bench_slot_t *slot, bench_slot_t *copy)
+{
+  unsigned changed = 0;
+  int i;
+
+  for(i = 0; i < n; i++) {
+    slot[i].status0 = *(buf + i*4);
+    slot[i].status1 = *(buf + i*4 + 1);
+    slot[i].status2 = *(buf + i*4 + 2);
+    slot[i].status3 = *(buf + i*4 + 3);
+  }
+  for(i = 0; i < n; i++)
+    if(slot[i].status0 != copy[i].status0 ||
+       slot[i].status3 != copy[i].status3) changed++;
+  memcpy(copy, slot, n * sizeof(bench_slot_t));
+
+  return changed;
+}
+
+
+static unsigned bench_kernel(safte_slot_unpack_t unpack,
+			     const unsigned char *buf, int n,
+			     unsigned char **status, unsigned char **last,
+			     unsigned int *changed)
+{
+  unsigned char *t;
+  unsigned count = 0;
+  int w, k;
+
+  unpack(buf, n, status, last[0], last[3], changed);
+  for(w = 0; w < SAFTE_SLOT_WORDS(n); w++)
+    count += __builtin_popcount(changed[w]);
+  /* the generations swap */
+  for(k = 0; k < 4; k++) {
+    t = status[k];
+    status[k] = last[k];
+    last[k] = t;
+  }
+
+  return count;
+}
+
+
+/* every kernel starts from the same empty last generation */
+static void bench_reset(unsigned char **status, unsigned char **last, int n)
+{
+  int k;
+
+  for(k = 0; k < 4; k++) {
+    memset(status[k], 0, n);
+    memset(last[k], 0, n);
+  }
+}
+
+
+/* run a kernel over copies of the same inputs the scalar one gets and
+   compare what they write. With alias the old arrays are status[0] and
+   status[3], as when safte-monitor unpacks over the last generation */
+static int check_kernel(const char *name, safte_slot_unpack_t unpack,
+			const unsigned char *buf, const unsigned char *old0,
+			const unsigned char *old3, int n, int alias)
+{
+  unsigned char want[4][CHECK_SLOTS], got[4][CHECK_SLOTS];
+  unsigned char *ws[4], *gs[4];
+  unsigned int wc[SAFTE_SLOT_WORDS(CHECK_SLOTS)];
+  unsigned int gc[SAFTE_SLOT_WORDS(CHECK_SLOTS)];
+  int k;
+
+  for(k = 0; k < 4; k++) {
+    /* slots past n must be left alone */
+    memset(want[k], 0x5a, CHECK_SLOTS);
+    memset(got[k], 0x5a, CHECK_SLOTS);
+    ws[k] = want[k];
+    gs[k] = got[k];
+  }
+  memset(wc, 0xa5, sizeof(wc));
+  memset(gc, 0xa5, sizeof(gc));
+
+  if(alias) {
+    memcpy(want[0], old0, n);
+    memcpy(want[3], old3, n);
+    memcpy(got[0], old0, n);
+    memcpy(got[3], old3, n);
+    safte_slot_unpack_scalar(buf, n, ws, want[0], want[3], wc);
+    unpack(buf, n, gs, got[0], got[3], gc);
+  } else {
+    safte_slot_unpack_scalar(buf, n, ws, old0, old3, wc);
+    unpack(buf, n, gs, old0, old3, gc);
+  }
+
+  if(memcmp(want, got, sizeof(want)) ||
+     memcmp(wc, gc, SAFTE_SLOT_WORDS(n) * sizeof(unsigned int))) {
+    fprintf(stderr, "%s: differs from scalar with %d slots%s\n", name, n,
+	    alias ? ", old arrays aliased" : "");
+    return -1;
+  }
+
+  return 0;
+}
+
+
+/* check each kernel this machine has against the scalar one */
+static int check_kernels(void)
+{
+  static const char *names[] = { "sse2", "avx2", NULL };
+  unsigned char buf[CHECK_SLOTS * 4], old0[CHECK_SLOTS], old3[CHECK_SLOTS];
+  safte_slot_unpack_t unpack;
+  int i, n, r, rv = 0;
+  const char **name;
+
+  for(name = names; *name; name++) {
+    if(!(unpack = safte_slot_kernel(*name))) continue;
+    for(n = 0; n <= CHECK_SLOTS; n++) {
+      for(r = 0; r < CHECK_ROUNDS; r++) {
+	/* few values, so both changed and unchanged slots turn up */
+	for(i = 0; i < sizeof(buf); i++) buf[i] = random() % 4;
+	for(i = 0; i < CHECK_SLOTS; i++) {
+	  old0[i] = random() % 4;
+	  old3[i] = random() % 4;
+	}
+	if(check_kernel(*name, unpack, buf, old0, old3, n, 0) < 0 ||
+	   check_kernel(*name, unpack, buf, old0, old3, n, 1) < 0) {
+	  rv = -1;
+	  break;
+	}
+      }
+      if(r < CHECK_ROUNDS) break;
+    }
+    if(n > CHECK_SLOTS)
+      printf("%-8s matches scalar for 0 to %d slots\n", *name, CHECK_SLOTS);
+  }
+
+  return rv;
+}
+
+
+int main(int argc, char **argv)
+{
+  int n = argc > 1 ? atoi(argv[1]) : BENCH_SLOTS;
+  long iterations = argc > 2 ? atol(argv[2]) : BENCH_ITERATIONS;
+  unsigned char *buf[2], *status[4], *last[4];
+  unsigned int changed[SAFTE_SLOT_WORDS(256)];
+  bench_slot_t *slot, *copy;
+  unsigned sum;
+  double t;
+  long i;
+  int k;
+
+  if(n < 1 || n > 255 || iterations < 1) {
+    fprintf(stderr, "usage: %s [slots] [iterations]\n", argv[0]);
+    exit(1);
+  }
+
+  /* two replies, alternated so some slots change every time */
+  for(k = 0; k < 2; k++) {
+    buf[k] = malloc(n * 4);
+    for(i = 0; i < n * 4; i++) buf[k][i] = random() % 4;
+  }
+  slot = calloc(n, sizeof(bench_slot_t));
+  copy = calloc(n, sizeof(bench_slot_t));
+  for(k = 0; k < 4; k++) {
+    status[k] = calloc(n, 1);
+    last[k] = calloc(n, 1);
+  }
+
+  if(check_kernels() < 0) exit(1);
+
+  printf("%d slots, %ld iterations\n", n, iterations);
+
+  t = bench_now();
+  for(i = sum = 0; i < iterations; i++)
+    sum += bench_loop(buf[i & 1], n, slot, copy);
+  t = bench_now() - t;
+  printf("%-8s %8.1f ns  (%u changed)\n", "loop", t * 1e9 / iterations, sum);
+
+  bench_reset(status, last, n);
+  t = bench_now();
+  for(i = sum = 0; i < iterations; i++)
+    sum += bench_kernel(safte_slot_unpack_scalar, buf[i & 1], n, status,
+			last, changed);
+  t = bench_now() - t;
+  printf("%-8s %8.1f ns  (%u changed)\n", "scalar", t * 1e9 / iterations,
+	 sum);
+
+  bench_reset(status, last, n);
+  t = bench_now();
+  for(i = sum = 0; i < iterations; i++)
+    sum += bench_kernel(safte_slot_unpack, buf[i & 1], n, status, last,
+			changed);
+  t = bench_now() - t;
+  printf("%-8s %8.1f ns  (%u changed)\n", safte_slot_impl(),
+	 t * 1e9 / iterations, sum);
+
+  exit(0);
+}
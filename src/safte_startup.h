@@ -0,0 +1,38 @@
+/*
+ *  safte_startup.h - Startup phase timing
+ *
+ *  Author: Michael Clark <michael@metaparadigm.com>
+ *  Copyright Metaparadigm Pte. Ltd. 2001
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ */
+
+#ifndef _SAFTE_STARTUP_H_
+#define _SAFTE_STARTUP_H_
+
+#include <stddef.h>
+
+
+/* startup phases, in the order they are reported */
+enum {
+  SAFTE_STARTUP_FDS,       /* closing inherited fds */
+  SAFTE_STARTUP_CONFIG,    /* parsing the config file */
+  SAFTE_STARTUP_LISTEN,    /* binding the listeners */
+  SAFTE_STARTUP_DISCOVERY, /* finding the enclosures */
+  SAFTE_STARTUP_ENCLOSURE, /* reading their configuration, within discovery */
+  SAFTE_STARTUP_PHASES
+};
+
+#define SAFTE_STARTUP_REPORT_LEN 160
+
+
+extern long long safte_startup_now(void);
+extern void safte_startup_init(void);
+extern void safte_startup_time(int phase, long long start);
+extern void safte_startup_complete(void);
+extern char *safte_startup_report_r(char *buf, size_t size);
+
+#endif
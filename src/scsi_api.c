@@ -23,9 +23,12 @@
 #include <limits.h>
 #include <libgen.h>
 #include <signal.h>
+#include <poll.h>
 #include <syslog.h>
+#include <dirent.h>
 
 #include "scsi_api.h"
+#include "scsi_index.h"
 
 #ifdef USE_DMALLOC
 #include "dmalloc.h"
@@ -74,10 +77,13 @@ static int encode_strp(char *str, void *src, size_t size)
 }
 
 
+/* size is that of the pointer, the string itself is unbounded. A
+   repeated param replaces the string */
 static int decode_strp(void *dest, const char *str, size_t size)
 {
-    int l = strlen(*((char**)dest) = strdup(str));
-    return (l == size) ? -1 : l;
+    free(*((char**)dest));
+    if (!(*((char**)dest) = strdup(str))) return -1;
+    return strlen(str);
 }
 
 
@@ -104,6 +110,9 @@ static int decode_type(void *dest, const char *str, size_t size)
     } else if(strcmp(str, "scanner") == 0) {
 	*(int*)dest = TYPE_SCANNER;
 	return 1;
+    } else if(strcmp(str, "enclosure") == 0) {
+	*(int*)dest = TYPE_ENCLOSURE;
+	return 1;
     }
     return 0;
 }
@@ -133,6 +142,9 @@ static int encode_type(char *str, void *src, size_t size)
     case TYPE_SCANNER:
 	return snprintf(str, size, "%s", "scanner");
 	break;
+    case TYPE_ENCLOSURE:
+	return snprintf(str, size, "%s", "enclosure");
+	break;
     default:
 	return snprintf(str, size, "%s", "other");
     }
@@ -170,6 +182,10 @@ scsi_device_param_t params[] = {
       offsetof(scsi_device_t, revision), msizeof(scsi_device_t, revision) },
     { 'S', "serial", "Serial number Inquiry info", &encode_str, &decode_str,
       offsetof(scsi_device_t, serial), msizeof(scsi_device_t, serial) },
+    { 's', "safteid", "SAF-TE Inquiry signature", &encode_str, &decode_str,
+      offsetof(scsi_device_t, safteid), msizeof(scsi_device_t, safteid) },
+    { 'C', "channelid", "SAF-TE channel id", &encode_int, &decode_int,
+      offsetof(scsi_device_t, channelid), 0 },
     { 'D', "prefix", "Device prefix (sd, scd)", &encode_str, &decode_str,
       offsetof(scsi_device_t, prefix), msizeof(scsi_device_t, prefix) },
     { 'T', "type", "Device type (disk, cdrom)", &encode_type, &decode_type,
@@ -182,94 +198,204 @@ scsi_device_param_t params[] = {
 };
 
 
-/* process a complete SCSI cmd. Use the generic SCSI interface. */
-int handle_scsi_cmd(int fd,
-		    unsigned cmd_len,         /* command length */
-		    unsigned in_size,         /* input data size */
-		    unsigned char *i_buff,    /* input buffer */
-		    unsigned out_size,        /* output data size */
-		    unsigned char *o_buff     /* output buffer */)
+/* default per-command timeout in milliseconds */
+unsigned int scsi_timeout = SCSI_DEFAULT_TIMEOUT;
+
+
+/* fill in a sg version 3 header for a request */
+static int setup_io_hdr(sg_io_hdr_t *io_hdr, scsi_req_t *req)
 {
-    int status = 0;
-    struct sg_header *sg_hd;
+    memset(&req->st, 0, sizeof(scsi_cmd_status_t));
 
     /* safety checks */
-    if (!cmd_len) return -1;            /* need a cmd_len != 0 */
-    if (!i_buff) return -1;             /* need an input buffer != NULL */
-    if (SCSI_OFF + cmd_len + in_size > 4096) return -1;
-    if (SCSI_OFF + out_size > 4096) return -1;
-
-    if (!o_buff) out_size = 0;      /* no output buffer, no output size */
-
-    /* generic SCSI device header construction */
-    sg_hd = (struct sg_header *) i_buff;
-    sg_hd->reply_len   = SCSI_OFF + out_size;
-    sg_hd->twelve_byte = cmd_len == 12;
-    sg_hd->result = 0;
-
-    /* send command */
-    status = write( fd, i_buff, SCSI_OFF + cmd_len + in_size );
-    if ( status < 0 || status != SCSI_OFF + cmd_len + in_size || 
-	 sg_hd->result ) {
-	/* some error happened */
-	fprintf( stderr, "write(generic) result = 0x%x cmd = 0x%x\n",
-		 sg_hd->result, i_buff[SCSI_OFF] );
-	perror("");
-	return status;
-    }
-    
-    if (!o_buff) o_buff = i_buff;       /* buffer pointer check */
-
-    /* retrieve result */
-    status = read( fd, o_buff, SCSI_OFF + out_size);
-    if ( status < 0 || status != SCSI_OFF + out_size || sg_hd->result ) {
-	/* some error happened */
-	fprintf( stderr, "read(generic) status = 0x%x, result = 0x%x, "
-		 "cmd = 0x%x\n", 
-		 status, sg_hd->result, o_buff[SCSI_OFF] );
-	fprintf( stderr, "read(generic) sense "
-		 "%x %x %x %x %x %x %x %x %x %x %x %x %x %x %x %x\n", 
-		 sg_hd->sense_buffer[0], sg_hd->sense_buffer[1],
-		 sg_hd->sense_buffer[2], sg_hd->sense_buffer[3],
-		 sg_hd->sense_buffer[4], sg_hd->sense_buffer[5],
-		 sg_hd->sense_buffer[6], sg_hd->sense_buffer[7],
-		 sg_hd->sense_buffer[8], sg_hd->sense_buffer[9],
-		 sg_hd->sense_buffer[10], sg_hd->sense_buffer[11],
-		 sg_hd->sense_buffer[12], sg_hd->sense_buffer[13],
-		 sg_hd->sense_buffer[14], sg_hd->sense_buffer[15]);
-	if (status < 0)
-	    perror("");
-    }
-    /* Look if we got what we expected to get */
-    if (status == SCSI_OFF + out_size) status = 0; /* got them all */
-
-    return status;  /* 0 means no error */
+    if (!req->cdb_len || req->cdb_len > SCSI_MAX_CDB_LEN) {
+	errno = EINVAL;
+	return -1;
+    }
+    if (!req->buf || !req->buf_len) {
+	req->buf = NULL;
+	req->buf_len = 0;
+	req->dxfer_dir = SG_DXFER_NONE;
+    }
+
+    memset(io_hdr, 0, sizeof(sg_io_hdr_t));
+    io_hdr->interface_id = 'S';
+    io_hdr->cmd_len = req->cdb_len;
+    io_hdr->cmdp = req->cdb;
+    io_hdr->dxfer_direction = req->dxfer_dir;
+    io_hdr->dxferp = req->buf;
+    io_hdr->dxfer_len = req->buf_len;
+    io_hdr->mx_sb_len = sizeof(req->st.sense);
+    io_hdr->sbp = req->st.sense;
+    io_hdr->timeout = req->timeout ? req->timeout : scsi_timeout;
+    io_hdr->pack_id = req->pack_id;
+    io_hdr->usr_ptr = req;
+
+    return 0;
+}
+
+
+/* copy the completion status out of a sg version 3 header. Returns 0 if
+   the command succeeded, otherwise -1 with errno set */
+static int io_hdr_result(sg_io_hdr_t *io_hdr, scsi_cmd_status_t *st)
+{
+    st->status = io_hdr->status;
+    st->host_status = io_hdr->host_status;
+    st->driver_status = io_hdr->driver_status;
+    st->sense_len = io_hdr->sb_len_wr;
+    st->resid = io_hdr->resid;
+    st->duration = io_hdr->duration;
+
+    if (st->host_status == SG_DID_TIME_OUT ||
+	(st->driver_status & SG_DRIVER_MASK) == SG_DRIVER_TIMEOUT) {
+	errno = ETIMEDOUT;
+	return -1;
+    }
+    if ((io_hdr->info & SG_INFO_OK_MASK) != SG_INFO_OK) {
+	errno = EIO;
+	return -1;
+    }
+
+    return 0;
+}
+
+
+/* issue a SCSI command with the SG_IO ioctl (sg version 3 interface).
+   The data phase goes directly to/from the caller's buffer. Returns 0 on
+   success, -1 on error with errno set (ETIMEDOUT if the command timed out,
+   EIO if the device or the host adapter reported an error). The SCSI,
+   host and driver status and any sense data are returned in st. */
+int scsi_cmd(int fd, unsigned char *cdb, unsigned cdb_len,
+	     int dxfer_dir, unsigned char *buf, unsigned buf_len,
+	     unsigned int timeout, scsi_cmd_status_t *st)
+{
+    sg_io_hdr_t io_hdr;
+    scsi_req_t req;
+    int rv;
+
+    memset(&req, 0, sizeof(req));
+    if (cdb && cdb_len <= SCSI_MAX_CDB_LEN) {
+	memcpy(req.cdb, cdb, cdb_len);
+	req.cdb_len = cdb_len;
+    }
+    req.dxfer_dir = dxfer_dir;
+    req.buf = buf;
+    req.buf_len = buf_len;
+    req.timeout = timeout;
+
+    if (setup_io_hdr(&io_hdr, &req) < 0)
+	rv = -1;
+    else if (ioctl(fd, SG_IO, &io_hdr) < 0)
+	rv = -1;
+    else
+	rv = io_hdr_result(&io_hdr, &req.st);
+
+    if (st) memcpy(st, &req.st, sizeof(scsi_cmd_status_t));
+    return rv;
+}
+
+
+/* queue a request on a sg file descriptor without waiting for it to
+   complete. The request and its buffer must stay valid until it has been
+   returned by scsi_req_reap(). Returns 0 if the request was queued */
+int scsi_req_submit(int fd, scsi_req_t *req)
+{
+    sg_io_hdr_t io_hdr;
+
+    req->error = 0;
+    if (setup_io_hdr(&io_hdr, req) < 0) {
+	req->error = errno;
+	return -1;
+    }
+    if (write(fd, &io_hdr, sizeof(io_hdr)) != sizeof(io_hdr)) {
+	req->error = errno;
+	return -1;
+    }
+    return 0;
+}
+
+
+/* collect one completed request from a sg file descriptor opened with
+   O_NONBLOCK. Returns NULL with errno set to EAGAIN if no request has
+   completed yet. The outcome is left in req->error (0 or an errno value)
+   and req->st */
+scsi_req_t *scsi_req_reap(int fd)
+{
+    sg_io_hdr_t io_hdr;
+    scsi_req_t *req;
+
+    memset(&io_hdr, 0, sizeof(io_hdr));
+    io_hdr.interface_id = 'S';
+    io_hdr.pack_id = -1;        /* any completed request */
+    if (read(fd, &io_hdr, sizeof(io_hdr)) != sizeof(io_hdr))
+	return NULL;
+
+    req = (scsi_req_t*)io_hdr.usr_ptr;
+    if (io_hdr_result(&io_hdr, &req->st) < 0)
+	req->error = errno;
+    else
+	req->error = 0;
+
+    return req;
+}
+
+
+/* print a failed command's status and sense data to stderr */
+void scsi_cmd_perror(const char *s, unsigned char *cdb,
+		     scsi_cmd_status_t *st)
+{
+    int i;
+
+    fprintf(stderr, "%s: cmd = 0x%x: %s, status = 0x%x, "
+	    "host_status = 0x%x, driver_status = 0x%x\n",
+	    s, cdb[0], strerror(errno),
+	    st->status, st->host_status, st->driver_status);
+    if (st->sense_len > 0) {
+	fprintf(stderr, "%s: sense", s);
+	for (i = 0; i < st->sense_len; i++)
+	    fprintf(stderr, " %x", st->sense[i]);
+	fprintf(stderr, "\n");
+    }
 }
 
 
 /* request vendor brand and model - use evpd=0, op=0 */
 /* request serial number - use evpd=1, op=0x80 */
-unsigned char *scsi_inquiry (int fd, int evpd, int pg)
+/* the reply is returned in the caller's buffer. Returns 0 on success or
+   -1 with errno set and the command status in st (if not NULL) */
+int scsi_inquiry_r (int fd, int evpd, int pg, unsigned char *buf,
+		    unsigned len, scsi_cmd_status_t *st)
 {
-    static unsigned char cmd[SCSI_OFF + 18];      /* SCSI command buffer */
-    static unsigned char scsi_inquiry_buffer[SCSI_OFF + INQUIRY_REPLY_LEN];
     unsigned char cmdblk [ INQUIRY_CMDLEN ] = 
     { INQUIRY_CMD,  /* command */
       evpd,  /* lun/reserved */
       pg,  /* page code */
       0,  /* reserved */
-      INQUIRY_REPLY_LEN,  /* allocation length */
+      len > 0xff ? 0xff : len,  /* allocation length */
       0 };/* reserved/flag/link */
 
-    memcpy( cmd + SCSI_OFF, cmdblk, sizeof(cmdblk) );
+    memset(buf, 0, len);
+
+    return scsi_cmd(fd, cmdblk, sizeof(cmdblk), SG_DXFER_FROM_DEV,
+		    buf, len, scsi_timeout, st);
+}
 
-    if (handle_scsi_cmd(fd, sizeof(cmdblk), 0, cmd,
-			sizeof(scsi_inquiry_buffer) - SCSI_OFF,
-			scsi_inquiry_buffer)) {
+
+/* non-reentrant version of scsi_inquiry_r() using a static buffer.
+   Returns NULL if the command fails */
+unsigned char *scsi_inquiry (int fd, int evpd, int pg)
+{
+    static unsigned char scsi_inquiry_buffer[INQUIRY_REPLY_LEN];
+    unsigned char cmdblk [ 1 ] = { INQUIRY_CMD };
+    scsi_cmd_status_t st;
+
+    if (scsi_inquiry_r(fd, evpd, pg, scsi_inquiry_buffer,
+		       sizeof(scsi_inquiry_buffer), &st) < 0) {
+	scsi_cmd_perror("inquiry", cmdblk, &st);
 	fprintf( stderr, "Inquiry failed\n" );
-	exit(2);
+	return NULL;
     }
-    return (scsi_inquiry_buffer + SCSI_OFF);
+    return scsi_inquiry_buffer;
 }
 
 
@@ -285,7 +411,9 @@ static void str_trim(char *p)
 
 int get_scsi_dev_info(int fd, scsi_device_t *scsidev)
 {
-    unsigned char *buf;
+    unsigned char buf[INQUIRY_REPLY_LEN];
+    unsigned char cmdblk [ 1 ] = { INQUIRY_CMD };
+    scsi_cmd_status_t st;
     Sg_scsi_id scsi_id;
     char hostname[HOSTNAME_LEN+1];
     int l;
@@ -293,7 +421,7 @@ int get_scsi_dev_info(int fd, scsi_device_t *scsidev)
     /* Get host no, channel and scsi id */
     if(ioctl(fd, SG_GET_SCSI_ID, &scsi_id) < 0) {
 	perror("ioctl");
-	exit(1);
+	return -1;
     }
 
     scsidev->host = scsi_id.host_no;
@@ -302,7 +430,10 @@ int get_scsi_dev_info(int fd, scsi_device_t *scsidev)
     scsidev->lun = scsi_id.lun;
 
     /* Get scsi inquiry info */
-    buf = scsi_inquiry(fd, 0, 0);
+    if (scsi_inquiry_r(fd, 0, 0, buf, sizeof(buf), &st) < 0) {
+	scsi_cmd_perror(scsidev->sg_device, cmdblk, &st);
+	return -1;
+    }
 
     scsidev->active = 1;
 
@@ -328,12 +459,14 @@ int get_scsi_dev_info(int fd, scsi_device_t *scsidev)
 
     scsidev->channelid = *(buf+INQUIRY_CHANNELID_OFFSET);
 
-    /* Get serial number */
-    buf = scsi_inquiry(fd, 1, 0x80);
-    l = buf[3];
-    memcpy(scsidev->serial, buf + 4, l);
-    scsidev->serial[l] = '\0';
-    str_trim(scsidev->serial);
+    /* Get serial number, not all devices support the VPD page */
+    if (scsi_inquiry_r(fd, 1, 0x80, buf, sizeof(buf), &st) == 0) {
+	l = buf[3];
+	if (l > sizeof(buf) - 4) l = sizeof(buf) - 4;
+	memcpy(scsidev->serial, buf + 4, l);
+	scsidev->serial[l] = '\0';
+	str_trim(scsidev->serial);
+    }
 
     /* Get the hostname */
     *(int*)hostname = HOSTNAME_LEN;
@@ -352,114 +485,215 @@ int get_scsi_dev_info(int fd, scsi_device_t *scsidev)
 }
 
 
+/* numeric names are leadin0, leadin1, ...  alpha names run a..z, aa..zz,
+   aaa.. as the sd driver names disks */
 void make_dev_name(char * fname, const char * leadin, int k, 
 		   int do_numeric)
 {
-    char buff[64];
-    int  big,little;
+    char buff[16];
+    int  i;
 
     if(leadin[0] == '/') strcpy(fname, leadin);
     else sprintf(fname, "/dev/%s", leadin);
     if (do_numeric) {
 	sprintf(buff, "%d", k);
-	strcat(fname, buff);
     }
     else {
-	if (k < 26) {
-	    buff[0] = 'a' + (char)k;
-	    buff[1] = '\0';
-	    strcat(fname, buff);
+	i = sizeof(buff) - 1;
+	buff[i] = '\0';
+	do {
+	    buff[--i] = 'a' + k % 26;
+	    k = k / 26 - 1;
+	} while (k >= 0 && i > 0);
+	memmove(buff, buff + i, sizeof(buff) - i);
+    }
+    strcat(fname, buff);
+}
+
+
+/* the index make_dev_name would have used for the part of a device name
+   after the leadin, -1 if it isn't one */
+static int dev_name_index(const char *name, int numeric)
+{
+    int k = 0;
+
+    if (!*name) return -1;
+    if (numeric) {
+	if (name[0] == '0' && name[1]) return -1;
+	for (; *name; name++) {
+	    if (!isdigit((unsigned char)*name) || k > (INT_MAX - 9) / 10)
+		return -1;
+	    k = k * 10 + *name - '0';
 	}
-	else if (k <= 255) {
-	    /* assumes sequence goes x,y,z,aa,ab,ac etc */
-	    big    = k/26;
-	    little = k - (26 * big);
-	    big    = big - 1;
-
-	    buff[0] = 'a' + (char)big;
-	    buff[1] = 'a' + (char)little;
-	    buff[2] = '\0';
-	    strcat(fname, buff);
+	return k;
+    }
+    for (; *name; name++) {
+	if (*name < 'a' || *name > 'z' || k > (INT_MAX - 26) / 26)
+	    return -1;
+	k = k * 26 + *name - 'a' + 1;
+    }
+    return k - 1;
+}
+
+
+static int index_compare(const void *a, const void *b)
+{
+    return *(const int*)a - *(const int*)b;
+}
+
+
+/* indexes of the devices named leadin? that exist, in order. Returns the
+   number found or -1; *list is malloced */
+static int list_dev_names(const char *leadin, int numeric, int **list)
+{
+    char path[PATH_MAX+1], *dir, *base;
+    struct dirent *de;
+    DIR *d;
+    int *l = NULL, *t, n = 0, size = 0, k;
+
+    if(leadin[0] == '/') snprintf(path, sizeof(path), "%s", leadin);
+    else snprintf(path, sizeof(path), "/dev/%s", leadin);
+    if (!(base = strrchr(path, '/'))) return -1;
+    *base++ = '\0';
+    dir = path[0] ? path : "/";
+
+    if (!(d = opendir(dir))) return -1;
+    while ((de = readdir(d))) {
+	if (strncmp(de->d_name, base, strlen(base)) != 0 ||
+	    (k = dev_name_index(de->d_name + strlen(base), numeric)) < 0)
+	    continue;
+	if (n == size) {
+	    size = size ? size * 2 : 64;
+	    if (!(t = realloc(l, size * sizeof(int)))) break;
+	    l = t;
 	}
-	else
-	    strcat(fname, "xxxx");
+	l[n++] = k;
     }
+    closedir(d);
+
+    qsort(l, n, sizeof(int), index_compare);
+    *list = l;
+
+    return n;
+}
+
+
+/* first lun found of a target, the others follow with
+   scsi_index_next(SCSI_INDEX_TARGET, ...) */
+scsi_device_t* find_dev_by_target(int host, int channel, int id)
+{
+    scsi_device_t key;
+
+    key.host = host;
+    key.channel = channel;
+    key.id = id;
+    return scsi_index_find(SCSI_INDEX_TARGET, &key);
+}
+
+
+/* first device found on a bus, the others follow with
+   scsi_index_next(SCSI_INDEX_BUS, ...) */
+scsi_device_t* find_dev_by_bus(int host, int channel)
+{
+    scsi_device_t key;
+
+    key.host = host;
+    key.channel = channel;
+    return scsi_index_find(SCSI_INDEX_BUS, &key);
 }
 
 
 scsi_device_t* find_dev_by_loc(int host, int channel, int id, int lun)
 {
-    scsi_device_t *scsidev = scsidev_head;
+    scsi_device_t *scsidev;
 
-    while(scsidev->next) {
-	if (host == scsidev->host && channel == scsidev->channel &&
-	    id == scsidev->id && lun == scsidev->lun) return scsidev;
-	scsidev = scsidev->next;
-    }
+    for (scsidev = find_dev_by_target(host, channel, id); scsidev;
+	 scsidev = scsi_index_next(SCSI_INDEX_TARGET, scsidev))
+	if (scsidev->lun == lun) return scsidev;
     return NULL;
 }
 
 
-scsi_device_t* find_dev_by_name(const char* device)
+static scsi_device_t* find_dev_by_path(int index, const char* device)
 {
-    scsi_device_t *scsidev = scsidev_head;
+    scsi_device_t key;
     char device_temp[PATH_MAX+1];
 
+    if(device[0] == '/') snprintf(device_temp, sizeof(device_temp), "%s",
+				  device);
+    else snprintf(device_temp, sizeof(device_temp), "/dev/%s", device);
 
-    if(device[0] == '/') strcpy(device_temp, device);
-    else sprintf(device_temp, "/dev/%s", device);
+    key.device = key.sg_device = device_temp;
+    return scsi_index_find(index, &key);
+}
 
-    while(scsidev->next) {
-	if (scsidev->device && strcmp(device_temp, scsidev->device) == 0)
-	    return scsidev;
-	scsidev = scsidev->next;
-    }
-    return NULL;
+
+scsi_device_t* find_dev_by_name(const char* device)
+{
+    return find_dev_by_path(SCSI_INDEX_DEV, device);
+}
+
+
+scsi_device_t* find_dev_by_sg(const char* sg_device)
+{
+    return find_dev_by_path(SCSI_INDEX_SG, sg_device);
+}
+
+
+scsi_device_t* find_dev_by_wwpn(const char* wwpn)
+{
+    scsi_device_t key;
+
+    snprintf(key.wwpn, sizeof(key.wwpn), "%s", wwpn);
+    return scsi_index_find(SCSI_INDEX_WWPN, &key);
+}
+
+
+/* first path found to a device, the others follow with
+   scsi_index_next(SCSI_INDEX_SERIAL, ...) */
+scsi_device_t* find_dev_by_serial(const char* serial)
+{
+    scsi_device_t key;
+
+    snprintf(key.serial, sizeof(key.serial), "%s", serial);
+    return scsi_index_find(SCSI_INDEX_SERIAL, &key);
 }
 
 
 void map_sg_devices(int type, const char* prefix, int numeric)
 {
     scsi_device_t *scsidev = NULL;
-    int fd, k, res, num_errors = 0;
+    int fd, i, n, res, *list;
     int host, channel, id, lun;
     scsi_idlun_t idlun;
     char device[PATH_MAX+1];
 
     /* find sd? devices that map to sg? devices */
-    for (k = 0, res = 0; num_errors < MAX_ERRORS; k++) {
+    if ((n = list_dev_names(prefix, numeric, &list)) < 0) return;
+    for (i = 0; i < n; i++) {
 
-	make_dev_name(device, prefix, k, numeric);
+	make_dev_name(device, prefix, list[i], numeric);
 
 	fd = open(device, O_RDONLY | O_NONBLOCK);
 	if (fd < 0) {
-	    if (EBUSY == errno) {
+	    if (EBUSY == errno)
 		printf("Device %s is busy\n", device);
-		++num_errors;
-		continue;
-	    }
-	    else if ((ENODEV == errno) || (ENOENT == errno) ||
-		     (ENXIO == errno)) {
-		++num_errors;
-		continue;
-	    }
-	    else {
+	    else if ((ENODEV != errno) && (ENOENT != errno) &&
+		     (ENXIO != errno))
 		perror("open");
-		++num_errors;
-		continue;
-	    }
+	    continue;
 	}
 
 	res = ioctl(fd, SCSI_IOCTL_GET_IDLUN, &idlun);
 	if (res < 0) {
 	    perror("ioctl");
-	    ++num_errors;
+	    close(fd);
 	    continue;
 	}
 	res = ioctl(fd, SCSI_IOCTL_GET_BUS_NUMBER, &host);
 	if (res < 0) {
 	    perror("ioctl");
-	    ++num_errors;
+	    close(fd);
 	    continue;
 	}
 
@@ -471,6 +705,7 @@ void map_sg_devices(int type, const char* prefix, int numeric)
 	if (scsidev && scsidev->type == type) {
 	    scsidev->device = strdup(device);
 	    strncpy(scsidev->prefix, prefix, PREFIX_LEN);
+	    scsi_index_update(scsidev);
 	    /* printf("%s - %d %d %d %d maps to %s\n",
 	       device, host, channel, id, lun, scsidev->sg_device); */
 	} else {
@@ -480,6 +715,7 @@ void map_sg_devices(int type, const char* prefix, int numeric)
 	close(fd);
 
     }
+    free(list);
 }
 
 
@@ -487,39 +723,43 @@ int scan_scsi_devices(int sg_numeric)
 {
     char tmp[PATH_MAX];
     scsi_device_t *scsidev = scsidev_head;
-    int fd, k, num_errors = 0;
+    int fd, i, n, *list;
 
-    for (k = 0; (k < MAX_SCSI_DEVS)  && (num_errors < MAX_ERRORS); k++) {
+    /* only the sg nodes that exist are tried, however sparse */
+    if ((n = list_dev_names("/dev/sg", sg_numeric, &list)) < 0) return -1;
+    while (scsidev->next) scsidev = scsidev->next;
 
-	make_dev_name(tmp, "/dev/sg", k, sg_numeric);
+    for (i = 0; i < n; i++) {
+
+	make_dev_name(tmp, "/dev/sg", list[i], sg_numeric);
+	free(scsidev->sg_device);
 	scsidev->sg_device = strdup(tmp);
 
 	fd = open(scsidev->sg_device, O_RDWR);
 
 	if (fd < 0) {
-	    if (EBUSY == errno) {
-		scsidev->active = -2;
-		continue;
-	    } else if ((ENODEV == errno) ||
-		       (ENOENT == errno) || (ENXIO == errno)) {
-		++num_errors;
-		scsidev->active = -1;
-		continue;
-	    } else {
-		scsidev->active = 0;
-		++num_errors;
-		continue;
-	    }
+	    scsidev->active = (EBUSY == errno) ? -2 :
+		((ENODEV == errno) || (ENOENT == errno) ||
+		 (ENXIO == errno)) ? -1 : 0;
+	    continue;
 	}
 
-	get_scsi_dev_info(fd, scsidev);
+	if (get_scsi_dev_info(fd, scsidev) < 0) {
+	    scsidev->active = 0;
+	    close(fd);
+	    continue;
+	}
 #if DEBUG
 	print_scsi_dev_info(scsidev);
 #endif
 	close(fd);
-	scsidev->next = calloc(1, sizeof(scsi_device_t));
+	scsi_index_add(scsidev);
+	scsidev->next = alloc_scsidev();
 	scsidev = scsidev->next;
     }
+    free(scsidev->sg_device);
+    scsidev->sg_device = NULL;
+    free(list);
 
     return 0;
 }
@@ -582,6 +822,208 @@ void print_scsi_dev_info(scsi_device_t *scsidev)
 }
 
 
+scsi_device_t *alloc_scsidev(void)
+{
+    scsi_device_t *scsidev = calloc(1, sizeof(scsi_device_t));
+
+    if (scsidev) scsidev->sg_fd = -1;
+    return scsidev;
+}
+
+
+/* sg transport. The fd is non-blocking which only affects queued
+   requests (read and write), SG_IO still waits for the command to
+   complete */
+static int sg_open(scsi_device_t *scsidev)
+{
+    return open(scsidev->sg_device, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+}
+
+
+static int sg_submit(scsi_device_t *scsidev, scsi_req_t *req)
+{
+    return scsi_req_submit(scsidev->sg_fd, req);
+}
+
+
+static scsi_req_t *sg_reap(scsi_device_t *scsidev)
+{
+    return scsi_req_reap(scsidev->sg_fd);
+}
+
+
+static void sg_close(scsi_device_t *scsidev)
+{
+    close(scsidev->sg_fd);
+}
+
+
+static int sg_cmd(scsi_device_t *scsidev, scsi_req_t *req)
+{
+    req->error = 0;
+    if (scsi_cmd(scsidev->sg_fd, req->cdb, req->cdb_len, req->dxfer_dir,
+		 req->buf, req->buf_len, req->timeout, &req->st) < 0) {
+	req->error = errno;
+	return -1;
+    }
+    return 0;
+}
+
+
+scsi_transport_t scsi_sg_transport = {
+    "sg", sg_open, sg_submit, sg_reap, sg_close, sg_cmd
+};
+
+
+static scsi_transport_t *dev_transport(scsi_device_t *scsidev)
+{
+    return scsidev->transport ? scsidev->transport : &scsi_sg_transport;
+}
+
+
+/* open a device through its transport, reusing the fd cached by an
+   earlier call */
+int scsi_dev_open(scsi_device_t *scsidev)
+{
+    if (scsidev->sg_fd >= 0) return scsidev->sg_fd;
+
+    scsidev->sg_fd = dev_transport(scsidev)->open(scsidev);
+    return scsidev->sg_fd;
+}
+
+
+void scsi_dev_close(scsi_device_t *scsidev)
+{
+    if (scsidev->sg_fd < 0) return;
+    dev_transport(scsidev)->close(scsidev);
+    scsidev->sg_fd = -1;
+}
+
+
+/* drop a stale cached fd and open the device again */
+int scsi_dev_reopen(scsi_device_t *scsidev)
+{
+    scsi_dev_close(scsidev);
+    return scsi_dev_open(scsidev);
+}
+
+
+/* queue a request on an open device. Returns 0 if it was queued,
+   otherwise -1 with the reason in req->error */
+int scsi_dev_submit(scsi_device_t *scsidev, scsi_req_t *req)
+{
+    req->error = 0;
+    if (scsidev->sg_fd < 0) {
+	req->error = EBADF;
+	return -1;
+    }
+    return dev_transport(scsidev)->submit(scsidev, req);
+}
+
+
+/* collect a completed request from an open device, NULL with errno
+   EAGAIN if none is ready */
+scsi_req_t *scsi_dev_reap(scsi_device_t *scsidev)
+{
+    if (scsidev->sg_fd < 0) {
+	errno = EBADF;
+	return NULL;
+    }
+    return dev_transport(scsidev)->reap(scsidev);
+}
+
+
+/* issue a command and wait for it, opening the device if need be.
+   Returns 0 on success or -1 with errno and req->error set */
+int scsi_dev_cmd(scsi_device_t *scsidev, scsi_req_t *req)
+{
+    scsi_transport_t *t = dev_transport(scsidev);
+    struct pollfd pfd;
+    scsi_req_t *done;
+    unsigned timeout;
+    int rv;
+
+    if (scsi_dev_open(scsidev) < 0) {
+	req->error = errno;
+	return -1;
+    }
+    if (t->cmd) {
+	rv = t->cmd(scsidev, req);
+	errno = req->error;
+	return rv;
+    }
+
+    if (scsi_dev_submit(scsidev, req) < 0) {
+	errno = req->error;
+	return -1;
+    }
+    timeout = req->timeout ? req->timeout : scsi_timeout;
+    pfd.fd = scsidev->sg_fd;
+    pfd.events = POLLIN;
+    for (;;) {
+	rv = poll(&pfd, 1, timeout);
+	if (rv < 0 && errno == EINTR) continue;
+	if (rv <= 0) {
+	    /* closing discards the request when it does complete */
+	    scsi_dev_close(scsidev);
+	    req->error = rv < 0 ? errno : ETIMEDOUT;
+	    break;
+	}
+	done = scsi_dev_reap(scsidev);
+	if (!done && errno != EAGAIN) {
+	    req->error = errno;
+	    break;
+	}
+	if (done == req) break;
+    }
+
+    errno = req->error;
+    return req->error ? -1 : 0;
+}
+
+
+void scsi_dev_close_all(void)
+{
+    scsi_device_t *scsidev;
+
+    for (scsidev = scsidev_head; scsidev && scsidev->next;
+	 scsidev = scsidev->next)
+	scsi_dev_close(scsidev);
+}
+
+
+/* errors on a sg fd that mean it must be reopened */
+int scsi_dev_stale(int error)
+{
+    return (error == ENODEV || error == ENXIO || error == EIO);
+}
+
+
+/* free the strings the params decode into, the device itself is the
+   caller's */
+void free_scsidev_strs(scsi_device_t *scsidev)
+{
+    scsi_device_param_t *param;
+    char **p;
+
+    for (param = params; param->dec; param++) {
+	if (param->dec != decode_strp) continue;
+	p = (char**)(((void*)scsidev) + param->offset);
+	free(*p);
+	*p = NULL;
+    }
+}
+
+
+static void release_scsidev(scsi_device_t *t)
+{
+    scsi_index_remove(t);
+    scsi_dev_close(t);
+    free_scsidev_strs(t);
+    free(t);
+}
+
+
 int free_scsidev(scsi_device_t *scsidev)
 {
     scsi_device_t *c_scsidev = scsidev;
@@ -589,11 +1031,23 @@ int free_scsidev(scsi_device_t *scsidev)
     while(c_scsidev->next) {
 	scsi_device_t *t = c_scsidev;
 	c_scsidev = c_scsidev->next;
-	if(t->device) free(t->device);
-	if(t->sg_device) free(t->sg_device);
-	free(t);
+	release_scsidev(t);
     }
     return 0;
 }
 
 
+/* take a device that has gone away off the list and free it. Anything
+   still pointing at it has to let go first */
+void remove_scsidev(scsi_device_t *scsidev)
+{
+    scsi_device_t **p;
+
+    for (p = &scsidev_head; *p != scsidev; p = &(*p)->next)
+	if (!(*p)->next) return;
+    *p = scsidev->next;
+
+    release_scsidev(scsidev);
+}
+
+
@@ -21,11 +21,23 @@
 #define SCSI_IOCTL_GET_PCI 0x5387
 #endif
 
-#define MAX_ERRORS 5
-#define MAX_SCSI_DEVS 255
-
 #define SCSI_OFF sizeof(struct sg_header)
 
+#define SCSI_MAX_CDB_LEN 16
+#define SCSI_SENSE_LEN 32
+#define SCSI_DEFAULT_TIMEOUT 10000 /* ms */
+
+/* host_status and driver_status values from the kernel's scsi.h */
+#ifndef SG_DID_TIME_OUT
+#define SG_DID_TIME_OUT 0x03
+#endif
+#ifndef SG_DRIVER_TIMEOUT
+#define SG_DRIVER_TIMEOUT 0x06
+#endif
+#ifndef SG_DRIVER_MASK
+#define SG_DRIVER_MASK 0x0f
+#endif
+
 #define INQUIRY_CMD     0x12
 #define INQUIRY_CMDLEN  6
 #define INQUIRY_REPLY_LEN 96
@@ -64,12 +76,26 @@ typedef struct scsi_idlun {
 } scsi_idlun_t;
 
 
+struct scsi_transport;
+
+/* hash indexes kept over the device list, see scsi_index.c */
+#define SCSI_INDEX_TARGET 0     /* host:channel:id, all luns of a target */
+#define SCSI_INDEX_SG 1         /* sg_device */
+#define SCSI_INDEX_DEV 2        /* device, eg. /dev/sda */
+#define SCSI_INDEX_WWPN 3
+#define SCSI_INDEX_SERIAL 4
+#define SCSI_INDEX_BUS 5        /* host:channel, every device on a bus */
+#define SCSI_INDEX_COUNT 6
+
 typedef struct scsi_device {
 
   int active;
   char hostname[HOSTNAME_LEN+1];
   char pciinfo[PCIINFO_LEN+1];
   char *sg_device;
+  int sg_fd;            /* cached pollable fd, -1 if not open */
+  struct scsi_transport *transport; /* NULL for the sg driver */
+  void *tpriv;          /* transport's per device data */
   char *device;
   char prefix[PREFIX_LEN+1];
 
@@ -96,6 +122,10 @@ typedef struct scsi_device {
   char portid[PORTID_STR_LEN+1];
   int loopid;
 
+  /* index chains, and the hash each index filed the device under */
+  int indexed;          /* mask of indexes the device is in */
+  unsigned hkey[SCSI_INDEX_COUNT];
+  struct scsi_device *hnext[SCSI_INDEX_COUNT];
 
   struct scsi_device *next;
 
@@ -117,6 +147,57 @@ typedef struct fc_device {
   struct fc_device *next;
 } fc_device_t;
 
+/* completion status of a command issued with scsi_cmd() */
+typedef struct scsi_cmd_status {
+
+  int status;           /* SCSI status byte */
+  int host_status;      /* host adapter status (DID_*) */
+  int driver_status;    /* mid level driver status (DRIVER_*) */
+  int resid;            /* data bytes not transferred */
+  int duration;         /* command duration in ms */
+  int sense_len;
+  unsigned char sense[SCSI_SENSE_LEN];
+
+} scsi_cmd_status_t;
+
+
+/* a command queued with scsi_req_submit() and collected with
+   scsi_req_reap() */
+typedef struct scsi_req {
+
+  unsigned char cdb[SCSI_MAX_CDB_LEN];
+  unsigned cdb_len;
+  int dxfer_dir;        /* SG_DXFER_FROM_DEV, SG_DXFER_TO_DEV, ... */
+  unsigned char *buf;
+  unsigned buf_len;
+  unsigned int timeout; /* ms, 0 for scsi_timeout */
+  int pack_id;
+
+  /* completion */
+  int error;            /* 0 or an errno value */
+  scsi_cmd_status_t st;
+
+  void *priv;           /* owner's data */
+
+} scsi_req_t;
+
+/* How commands reach a device. open returns an fd that poll() reports
+   readable when a submitted request can be reaped, and is cached in
+   sg_fd. submit queues a request without waiting, reap returns one
+   completed request or NULL with errno EAGAIN. cmd, if set, issues a
+   command synchronously, otherwise submit and reap are used */
+typedef struct scsi_transport {
+
+  const char *name;
+  int (*open)(struct scsi_device *scsidev);
+  int (*submit)(struct scsi_device *scsidev, scsi_req_t *req);
+  scsi_req_t *(*reap)(struct scsi_device *scsidev);
+  void (*close)(struct scsi_device *scsidev);
+  int (*cmd)(struct scsi_device *scsidev, scsi_req_t *req);
+
+} scsi_transport_t;
+
+
 typedef int (*decode_func_t)(void *dest, const char *str, size_t size);
 typedef int (*encode_func_t)(char *str, void *src, size_t size);
 
@@ -139,22 +220,47 @@ extern scsi_device_param_t params[];
 /* global linked list of scsi devices */
 extern scsi_device_t *scsidev_head;
 
+/* default per-command timeout in ms */
+extern unsigned int scsi_timeout;
+
+/* the Linux sg driver */
+extern scsi_transport_t scsi_sg_transport;
+
 /* Public functions */
-extern int handle_scsi_cmd(int fd,
-			   unsigned cmd_len,         /* command length */
-			   unsigned in_size,         /* input data size */
-			   unsigned char *i_buff,    /* input buffer */
-			   unsigned out_size,        /* output data size */
-			   unsigned char *o_buff     /* output buffer */);
+extern int scsi_cmd(int fd, unsigned char *cdb, unsigned cdb_len,
+		    int dxfer_dir, unsigned char *buf, unsigned buf_len,
+		    unsigned int timeout, scsi_cmd_status_t *st);
+extern int scsi_req_submit(int fd, scsi_req_t *req);
+extern scsi_req_t *scsi_req_reap(int fd);
+extern void scsi_cmd_perror(const char *s, unsigned char *cdb,
+			    scsi_cmd_status_t *st);
+extern int scsi_inquiry_r (int fd, int evpd, int pg, unsigned char *buf,
+			   unsigned len, scsi_cmd_status_t *st);
 extern unsigned char *scsi_inquiry (int fd, int evpd, int pg);
 extern int get_scsi_dev_info(int fd, scsi_device_t *scsidev);
 extern void make_dev_name(char * fname, const char * leadin, int k, 
                           int do_numeric);
 extern scsi_device_t* find_dev_by_loc(int host, int channel, int id, int lun);
 extern scsi_device_t* find_dev_by_name(const char* device);
+extern scsi_device_t* find_dev_by_target(int host, int channel, int id);
+extern scsi_device_t* find_dev_by_bus(int host, int channel);
+extern scsi_device_t* find_dev_by_sg(const char* sg_device);
+extern scsi_device_t* find_dev_by_wwpn(const char* wwpn);
+extern scsi_device_t* find_dev_by_serial(const char* serial);
 extern void map_sg_devices(int type, const char* prefix, int numeric);
 extern int scan_scsi_devices(int sg_numeric);
 extern void print_scsi_dev_info(scsi_device_t *scsidev);
+extern scsi_device_t *alloc_scsidev(void);
+extern int scsi_dev_open(scsi_device_t *scsidev);
+extern void scsi_dev_close(scsi_device_t *scsidev);
+extern int scsi_dev_reopen(scsi_device_t *scsidev);
+extern int scsi_dev_submit(scsi_device_t *scsidev, scsi_req_t *req);
+extern scsi_req_t *scsi_dev_reap(scsi_device_t *scsidev);
+extern int scsi_dev_cmd(scsi_device_t *scsidev, scsi_req_t *req);
+extern void scsi_dev_close_all(void);
+extern int scsi_dev_stale(int error);
 extern int free_scsidev(scsi_device_t *scsidev);
+extern void remove_scsidev(scsi_device_t *scsidev);
+extern void free_scsidev_strs(scsi_device_t *scsidev);
 
 #endif
@@ -0,0 +1,366 @@
+/*
+ *  scsi_cache.c - Persistent cache of SCSI discovery results
+ *
+ *  Author: Michael Clark <michael@metaparadigm.com>
+ *  Copyright Metaparadigm Pte. Ltd. 2001
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ */
+
+/*
+ * Keeps what INQUIRY and the SCSI ioctls returned for each processor
+ * and enclosure device across restarts, so a restart doesn't have to
+ * send them again. One line per device in the params table's
+ * name="value" form, plus up to SCSI_CACHE_DATA_LEN bytes of data the
+ * caller keeps with the device (the SAF-TE enclosure configuration):
+ *
+ *   boot 5d0c8e3a-...
+ *   device sg_device="/dev/sg3" host=0 channel=0 id=5 lun=0 ... data=0202...
+ *
+ * An entry is only used for a device at the same sg node and
+ * host:channel:id:lun whose type, vendor, product and revision as read
+ * from sysfs still match. Across a reboot the serial number must match
+ * too, so entries for devices without a serial in sysfs are dropped.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "scsi_cache.h"
+
+#ifdef USE_DMALLOC
+#include "dmalloc.h"
+#endif
+
+
+typedef struct cache_entry {
+
+    scsi_device_t dev;          /* as cached */
+    scsi_device_t *match;       /* live device this entry was used for */
+    unsigned char data[SCSI_CACHE_DATA_LEN];
+    int data_len;
+
+    struct cache_entry *next;
+
+} cache_entry_t;
+
+
+const char *scsi_cache_file = SCSI_CACHE_FILE;
+
+static cache_entry_t *cache_head = NULL;
+static char cache_boot[64] = "";    /* boot the cache was written in */
+static char boot_id[64] = "";       /* this boot */
+
+
+static void read_boot_id(void)
+{
+    FILE *f;
+
+    if (boot_id[0] || !(f = fopen(SCSI_CACHE_BOOT_ID, "r"))) return;
+    if (fscanf(f, "%63s", boot_id) != 1) boot_id[0] = '\0';
+    fclose(f);
+}
+
+
+static scsi_device_param_t *find_param(char substchar)
+{
+    scsi_device_param_t *param;
+
+    for (param = params; param->substchar; param++)
+	if (param->substchar == substchar) return param;
+    return NULL;
+}
+
+
+static scsi_device_param_t *find_param_name(const char *name)
+{
+    scsi_device_param_t *param;
+
+    for (param = params; param->substchar; param++)
+	if (strcmp(param->name, name) == 0) return param;
+    return NULL;
+}
+
+
+/* quotes, % and control characters are written as %XX */
+static void cache_escape(FILE *f, const char *s)
+{
+    for (; *s; s++) {
+	if (*s == '"' || *s == '%' || !isprint((unsigned char)*s))
+	    fprintf(f, "%%%02X", (unsigned char)*s);
+	else
+	    fputc(*s, f);
+    }
+}
+
+
+static void cache_unescape(char *s)
+{
+    char *d = s;
+    unsigned c;
+
+    while (*s) {
+	if (*s == '%' && sscanf(s + 1, "%2x", &c) == 1) {
+	    *d++ = c;
+	    s += 3;
+	} else {
+	    *d++ = *s++;
+	}
+    }
+    *d = '\0';
+}
+
+
+/* name=value pairs of a device line into an entry */
+static int cache_parse(char *p, cache_entry_t *e)
+{
+    scsi_device_param_t *param;
+    char *name, *value;
+    unsigned c;
+
+    while (*p) {
+	while (isspace((unsigned char)*p)) p++;
+	if (!*p) break;
+	name = p;
+	if (!(p = strchr(p, '='))) return -1;
+	*p++ = '\0';
+	if (*p == '"') {
+	    value = ++p;
+	    if (!(p = strchr(p, '"'))) return -1;
+	    *p++ = '\0';
+	} else {
+	    value = p;
+	    while (*p && !isspace((unsigned char)*p)) p++;
+	    if (*p) *p++ = '\0';
+	}
+	cache_unescape(value);
+
+	if (strcmp(name, "data") == 0) {
+	    for (e->data_len = 0; e->data_len < SCSI_CACHE_DATA_LEN &&
+		     sscanf(value + e->data_len * 2, "%2x", &c) == 1;
+		 e->data_len++)
+		e->data[e->data_len] = c;
+	} else if ((param = find_param_name(name)) &&
+		   param->dec(((void*)&e->dev) + param->offset, value,
+			      param->size) < 0) {
+	    return -1;
+	}
+    }
+
+    return 0;
+}
+
+
+/* read the cache file. Returns the number of entries, a missing or
+   unreadable cache is just empty */
+int scsi_cache_load(void)
+{
+    char line[SCSI_CACHE_LINE_LEN];
+    cache_entry_t *e, **tail = &cache_head;
+    FILE *f;
+    int n = 0;
+
+    read_boot_id();
+    if (!scsi_cache_file || !(f = fopen(scsi_cache_file, "r"))) return 0;
+
+    while (fgets(line, sizeof(line), f)) {
+	line[strcspn(line, "\n")] = '\0';
+	if (strncmp(line, "boot ", 5) == 0) {
+	    sscanf(line + 5, "%63s", cache_boot);
+	} else if (strncmp(line, "device ", 7) == 0) {
+	    if (!(e = calloc(1, sizeof(cache_entry_t)))) break;
+	    e->dev.sg_fd = -1;
+	    if (cache_parse(line + 7, e) < 0 || !e->dev.sg_device) {
+		free_scsidev_strs(&e->dev);
+		free(e);
+		continue;
+	    }
+	    *tail = e;
+	    tail = &e->next;
+	    n++;
+	}
+    }
+    fclose(f);
+
+    return n;
+}
+
+
+static int cache_valid(cache_entry_t *e, scsi_device_t *scsidev)
+{
+    scsi_device_t *c = &e->dev;
+
+    if (e->match || !scsidev->sg_device || !c->sg_device ||
+	strcmp(c->sg_device, scsidev->sg_device) != 0 ||
+	c->host != scsidev->host || c->channel != scsidev->channel ||
+	c->id != scsidev->id || c->lun != scsidev->lun ||
+	c->type != scsidev->type ||
+	strcmp(c->vendor, scsidev->vendor) != 0 ||
+	strcmp(c->product, scsidev->product) != 0 ||
+	strcmp(c->revision, scsidev->revision) != 0) return 0;
+
+    /* the same boot, or a serial number sysfs can vouch for */
+    if (boot_id[0] && strcmp(boot_id, cache_boot) == 0) return 1;
+    return scsidev->serial[0] && strcmp(c->serial, scsidev->serial) == 0;
+}
+
+
+/* fill in the INQUIRY and ioctl results for a device already filled
+   from sysfs. Returns 0 if the cache had them, -1 if the device must be
+   asked */
+int scsi_cache_fill(scsi_device_t *scsidev)
+{
+    cache_entry_t *e;
+
+    for (e = cache_head; e; e = e->next) {
+	if (!cache_valid(e, scsidev)) continue;
+
+	memcpy(scsidev->serial, e->dev.serial, sizeof(scsidev->serial));
+	memcpy(scsidev->safteid, e->dev.safteid, sizeof(scsidev->safteid));
+	memcpy(scsidev->hostname, e->dev.hostname,
+	       sizeof(scsidev->hostname));
+	memcpy(scsidev->pciinfo, e->dev.pciinfo, sizeof(scsidev->pciinfo));
+	scsidev->channelid = e->dev.channelid;
+	scsidev->active = 1;
+	e->match = scsidev;
+	return 0;
+    }
+
+    return -1;
+}
+
+
+static cache_entry_t *cache_find(scsi_device_t *scsidev)
+{
+    cache_entry_t *e;
+
+    for (e = cache_head; e; e = e->next)
+	if (e->match == scsidev) return e;
+    return NULL;
+}
+
+
+/* data kept with a device that was filled from the cache. Returns its
+   length or -1 */
+int scsi_cache_data(scsi_device_t *scsidev, unsigned char *buf, int len)
+{
+    cache_entry_t *e = cache_find(scsidev);
+
+    if (!e || !e->data_len) return -1;
+    if (len > e->data_len) len = e->data_len;
+    memcpy(buf, e->data, len);
+
+    return len;
+}
+
+
+/* an entry's copy of a live device, through the params a cache line
+   holds, so it is matched and filled from like one read from the
+   file */
+static int cache_copy(cache_entry_t *e, scsi_device_t *scsidev)
+{
+    char value[SCSI_CACHE_LINE_LEN];
+    scsi_device_param_t *param;
+    const char *code;
+
+    for (code = SCSI_CACHE_PARAMS; *code; code++) {
+	if (!(param = find_param(*code)) ||
+	    param->enc(value, ((void*)scsidev) + param->offset,
+		       sizeof(value)) < 0) continue;
+	if (param->dec(((void*)&e->dev) + param->offset, value,
+		       param->size) < 0) return -1;
+    }
+
+    return e->dev.sg_device ? 0 : -1;
+}
+
+
+/* keep data with a device. Nothing is kept without a cache file */
+void scsi_cache_set_data(scsi_device_t *scsidev, unsigned char *buf, int len)
+{
+    cache_entry_t *e = cache_find(scsidev);
+
+    if (!scsi_cache_file) return;
+    if (!e) {
+	if (!(e = calloc(1, sizeof(cache_entry_t)))) return;
+	e->dev.sg_fd = -1;
+	if (cache_copy(e, scsidev) < 0) {
+	    free_scsidev_strs(&e->dev);
+	    free(e);
+	    return;
+	}
+	e->match = scsidev;
+	e->next = cache_head;
+	cache_head = e;
+    }
+    if (len > SCSI_CACHE_DATA_LEN) len = SCSI_CACHE_DATA_LEN;
+    memcpy(e->data, buf, len);
+    e->data_len = len;
+}
+
+
+/* a device that is about to be freed. Its entry is kept, and can be
+   used again if the device comes back */
+void scsi_cache_forget(scsi_device_t *scsidev)
+{
+    cache_entry_t *e;
+
+    while ((e = cache_find(scsidev))) e->match = NULL;
+}
+
+
+/* write out the processor and enclosure devices in the device list.
+   The file is replaced atomically */
+int scsi_cache_save(void)
+{
+    char tmp[PATH_MAX], value[SCSI_CACHE_LINE_LEN];
+    scsi_device_param_t *param;
+    scsi_device_t *scsidev;
+    cache_entry_t *e;
+    const char *code;
+    FILE *f;
+    int i;
+
+    if (!scsi_cache_file) return 0;
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", scsi_cache_file) >= sizeof(tmp))
+	return -1;
+    if (!(f = fopen(tmp, "w"))) return -1;
+
+    fprintf(f, "boot %s\n", boot_id);
+    for (scsidev = scsidev_head; scsidev->next; scsidev = scsidev->next) {
+	if (scsidev->active <= 0 || !scsidev->sg_device ||
+	    (scsidev->type != TYPE_PROCESSOR &&
+	     scsidev->type != TYPE_ENCLOSURE)) continue;
+
+	fprintf(f, "device");
+	for (code = SCSI_CACHE_PARAMS; *code; code++) {
+	    if (!(param = find_param(*code)) ||
+		param->enc(value, ((void*)scsidev) + param->offset,
+			   sizeof(value)) < 0) continue;
+	    fprintf(f, " %s=", param->name);
+	    if (param->size) fputc('"', f);
+	    cache_escape(f, value);
+	    if (param->size) fputc('"', f);
+	}
+	if ((e = cache_find(scsidev)) && e->data_len) {
+	    fprintf(f, " data=");
+	    for (i = 0; i < e->data_len; i++) fprintf(f, "%02x", e->data[i]);
+	}
+	fprintf(f, "\n");
+    }
+
+    if (fclose(f) != 0 || rename(tmp, scsi_cache_file) < 0) {
+	unlink(tmp);
+	return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,47 @@
+/*
+ *  scsi_cache.h - Persistent cache of SCSI discovery results
+ *
+ *  Author: Michael Clark <michael@metaparadigm.com>
+ *  Copyright Metaparadigm Pte. Ltd. 2001
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ */
+
+#ifndef _SCSI_CACHE_H_
+#define _SCSI_CACHE_H_
+
+#include "scsi_api.h"
+
+
+#ifndef SCSI_CACHE_FILE
+#define SCSI_CACHE_FILE "/var/lib/safte-monitor/cache"
+#endif
+
+#define SCSI_CACHE_BOOT_ID "/proc/sys/kernel/random/boot_id"
+
+/* device parameters kept in the cache, as substitution chars of the
+   params table */
+#define SCSI_CACHE_PARAMS "dhctlTVPRSHBsC"
+
+/* bytes of opaque per-device data a caller may keep with an entry */
+#define SCSI_CACHE_DATA_LEN 16
+
+#define SCSI_CACHE_LINE_LEN 2048
+
+
+/* cache file, NULL for no cache */
+extern const char *scsi_cache_file;
+
+extern int scsi_cache_load(void);
+extern int scsi_cache_fill(scsi_device_t *scsidev);
+extern int scsi_cache_data(scsi_device_t *scsidev, unsigned char *buf,
+			   int len);
+extern void scsi_cache_set_data(scsi_device_t *scsidev, unsigned char *buf,
+				int len);
+extern int scsi_cache_save(void);
+extern void scsi_cache_forget(scsi_device_t *scsidev);
+
+#endif
@@ -0,0 +1,113 @@
+/*
+ *  scsi_cache_test.c - Checks of the discovery cache
+ *
+ *  Author: Michael Clark <michael@metaparadigm.com>
+ *  Copyright Metaparadigm Pte. Ltd. 2001
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ */
+
+/*
+ * Runs an enclosure being added, removed and added again through the
+ * cache the way hot-plug does, with and without a cache file, without
+ * reading or writing one. Built and run with "make check".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scsi_cache.h"
+
+
+static int failed = 0;
+
+
+#define CHECK(cond, what) \
+  do { if(!(cond)) { fprintf(stderr, "FAIL: %s\n", what); failed++; } } \
+  while(0)
+
+
+/* a SAF-TE processor device as sysfs would fill it in */
+static scsi_device_t *test_dev(void)
+{
+  scsi_device_t *scsidev = alloc_scsidev();
+
+  scsidev->sg_device = strdup("/dev/sg3");
+  scsidev->host = 0;
+  scsidev->channel = 0;
+  scsidev->id = 5;
+  scsidev->lun = 0;
+  scsidev->type = TYPE_PROCESSOR;
+  strcpy(scsidev->vendor, "ESG-SHV");
+  strcpy(scsidev->product, "SCA HSBP M17");
+  strcpy(scsidev->revision, "0.19");
+  strcpy(scsidev->serial, "SN0042");
+  return scsidev;
+}
+
+
+static void test_free(scsi_device_t *scsidev)
+{
+  free_scsidev_strs(scsidev);
+  free(scsidev);
+}
+
+
+/* add, remove, add. The second add gets back what the first one kept */
+static void test_readd(void)
+{
+  unsigned char data[SCSI_CACHE_DATA_LEN] = { 2, 2, 8, 1 }, got[sizeof(data)];
+  scsi_device_t *a, *b;
+
+  scsi_cache_file = "/nonexistent/cache";
+
+  a = test_dev();
+  CHECK(scsi_cache_fill(a) < 0, "empty cache filled a device");
+  strcpy(a->safteid, "SAF-TE");
+  scsi_cache_set_data(a, data, sizeof(data));
+  CHECK(scsi_cache_data(a, got, sizeof(got)) == sizeof(got) &&
+	!memcmp(got, data, sizeof(data)), "data not kept with the device");
+  scsi_cache_forget(a);
+  test_free(a);
+
+  b = test_dev();
+  CHECK(scsi_cache_fill(b) == 0, "re-added device not filled");
+  CHECK(!strcmp(b->safteid, "SAF-TE"), "re-added device lost its SAF-TE id");
+  CHECK(scsi_cache_data(b, got, sizeof(got)) == sizeof(got) &&
+	!memcmp(got, data, sizeof(data)), "re-added device lost its data");
+  scsi_cache_forget(b);
+  test_free(b);
+}
+
+
+/* -C none keeps nothing */
+static void test_none(void)
+{
+  unsigned char data[SCSI_CACHE_DATA_LEN] = { 1 }, got[sizeof(data)];
+  scsi_device_t *a;
+
+  scsi_cache_file = NULL;
+
+  a = test_dev();
+  a->id = 6;
+  scsi_cache_set_data(a, data, sizeof(data));
+  CHECK(scsi_cache_data(a, got, sizeof(got)) < 0, "data kept without a cache");
+  scsi_cache_forget(a);
+  CHECK(scsi_cache_fill(a) < 0, "device filled without a cache");
+  test_free(a);
+}
+
+
+int main(void)
+{
+  test_readd();
+  test_none();
+
+  if(failed) exit(1);
+  printf("scsi_cache: ok\n");
+  exit(0);
+}
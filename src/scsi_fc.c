@@ -0,0 +1,176 @@
+/*
+ *  scsi_fc.c - Fibre channel names of SCSI devices from sysfs
+ *
+ *  Author: Michael Clark <michael@metaparadigm.com>
+ *  Copyright Metaparadigm Pte. Ltd. 2001
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ */
+
+/*
+ * Fill in the WWPN, WWNN and port id of devices behind any HBA driver
+ * that uses the kernel's FC transport class, in place of the QLogic
+ * ioctls. Each remote port bound to a SCSI target
+ * (fc_remote_ports/rport-H:C-N with its scsi_target_id) and each FC
+ * target (fc_transport/targetH:C:T) is read once and joined to the
+ * devices on that target through the target index, so every lun of the
+ * target gets the port's names without a search.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <string.h>
+#include <limits.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#include "scsi_fc.h"
+#include "scsi_sysfs.h"
+#include "scsi_index.h"
+
+#ifdef USE_DMALLOC
+#include "dmalloc.h"
+#endif
+
+
+/* a hex name attribute ("0x21000024ff3dc9f0") as the digits alone,
+   zero padded to the width the qlogic code used */
+static int fc_read_hex(const char *dir, const char *attr, char *buf,
+		       int digits)
+{
+    char tmp[64], *p = tmp;
+    int n;
+
+    if (sysfs_read_str(dir, attr, tmp, sizeof(tmp)) <= 0) return -1;
+    if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) p += 2;
+    if ((n = strlen(p)) == 0 || n > digits) return -1;
+
+    memset(buf, '0', digits - n);
+    for (buf += digits - n; *p; p++) {
+	if (!isxdigit((unsigned char)*p)) return -1;
+	*buf++ = tolower((unsigned char)*p);
+    }
+    *buf = '\0';
+
+    return 0;
+}
+
+
+/* give every device on a target the names of the port in dir. Returns
+   the number of devices named */
+static int fc_apply(int host, int channel, int id, const char *dir)
+{
+    char wwpn[WWN_STR_LEN+1], wwnn[WWN_STR_LEN+1];
+    char portid[PORTID_STR_LEN+1];
+    scsi_device_t *scsidev;
+    int n = 0;
+
+    if (fc_read_hex(dir, "port_name", wwpn, WWN_STR_LEN) < 0) return 0;
+    if (fc_read_hex(dir, "node_name", wwnn, WWN_STR_LEN) < 0)
+	wwnn[0] = '\0';
+    if (fc_read_hex(dir, "port_id", portid, PORTID_STR_LEN) < 0)
+	portid[0] = '\0';
+
+    for (scsidev = find_dev_by_target(host, channel, id); scsidev;
+	 scsidev = scsi_index_next(SCSI_INDEX_TARGET, scsidev)) {
+	scsidev->isfc = 1;
+	strcpy(scsidev->wwpn, wwpn);
+	strcpy(scsidev->wwnn, wwnn);
+	strcpy(scsidev->portid, portid);
+	scsi_index_update(scsidev);
+	n++;
+    }
+
+    return n;
+}
+
+
+/* remote ports that are SCSI targets */
+static int fc_scan_rports(void)
+{
+    char classdir[PATH_MAX], dir[PATH_MAX], tmp[16];
+    struct dirent *de;
+    DIR *d;
+    int host, channel, port, id, n = 0;
+
+    snprintf(classdir, sizeof(classdir), "%s" SCSI_SYSFS_FC_RPORTS,
+	     scsi_sysfs_root);
+    if (!(d = opendir(classdir))) return -1;
+    while ((de = readdir(d))) {
+	if (sscanf(de->d_name, "rport-%d:%d-%d", &host, &channel,
+		   &port) != 3 ||
+	    snprintf(dir, sizeof(dir), "%s/%s", classdir,
+		     de->d_name) >= sizeof(dir) ||
+	    sysfs_read_str(dir, "scsi_target_id", tmp,
+			   sizeof(tmp)) <= 0 ||
+	    (id = atoi(tmp)) < 0) continue;
+	n += fc_apply(host, channel, id, dir);
+    }
+    closedir(d);
+
+    return n;
+}
+
+
+/* FC targets, which older kernels name only here */
+static int fc_scan_targets(void)
+{
+    char classdir[PATH_MAX], dir[PATH_MAX];
+    struct dirent *de;
+    DIR *d;
+    int host, channel, id, n = 0;
+
+    snprintf(classdir, sizeof(classdir), "%s" SCSI_SYSFS_FC_TRANSPORT,
+	     scsi_sysfs_root);
+    if (!(d = opendir(classdir))) return -1;
+    while ((de = readdir(d))) {
+	if (sscanf(de->d_name, "target%d:%d:%d", &host, &channel,
+		   &id) != 3 ||
+	    snprintf(dir, sizeof(dir), "%s/%s", classdir,
+		     de->d_name) >= sizeof(dir)) continue;
+	n += fc_apply(host, channel, id, dir);
+    }
+    closedir(d);
+
+    return n;
+}
+
+
+/* name the devices on the scsi device list that sit behind FC ports.
+   Returns the number of devices named, -1 if sysfs has no FC transport
+   class */
+int scan_sysfs_fc(void)
+{
+    int rports = fc_scan_rports(), targets = fc_scan_targets();
+
+    if (rports < 0 && targets < 0) return -1;
+    return (rports > 0 ? rports : 0) + (targets > 0 ? targets : 0);
+}
+
+
+/* name a device added after the initial scan, and the other luns of its
+   target */
+int sysfs_fc_device(scsi_device_t *scsidev)
+{
+    char dir[PATH_MAX];
+    int n;
+
+    /* nothing to do unless the device is behind an FC HBA */
+    if (snprintf(dir, sizeof(dir), "%s" SCSI_SYSFS_FC_HOST "/host%d",
+		 scsi_sysfs_root, scsidev->host) >= sizeof(dir) ||
+	access(dir, F_OK) < 0) return 0;
+
+    if (snprintf(dir, sizeof(dir), "%s" SCSI_SYSFS_FC_TRANSPORT
+		 "/target%d:%d:%d", scsi_sysfs_root, scsidev->host,
+		 scsidev->channel, scsidev->id) < sizeof(dir) &&
+	(n = fc_apply(scsidev->host, scsidev->channel, scsidev->id,
+		      dir)) > 0)
+	return n;
+
+    /* the rport directory isn't named after the target */
+    return fc_scan_rports();
+}
@@ -0,0 +1,27 @@
+/*
+ *  scsi_fc.h - Fibre channel names of SCSI devices from sysfs
+ *
+ *  Author: Michael Clark <michael@metaparadigm.com>
+ *  Copyright Metaparadigm Pte. Ltd. 2001
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ */
+
+#ifndef _SCSI_FC_H_
+#define _SCSI_FC_H_
+
+#include "scsi_api.h"
+
+
+#define SCSI_SYSFS_FC_HOST "/class/fc_host"
+#define SCSI_SYSFS_FC_RPORTS "/class/fc_remote_ports"
+#define SCSI_SYSFS_FC_TRANSPORT "/class/fc_transport"
+
+
+extern int scan_sysfs_fc(void);
+extern int sysfs_fc_device(scsi_device_t *scsidev);
+
+#endif
@@ -0,0 +1,231 @@
+/*
+ *  scsi_index.c - Hash indexes over the SCSI device list
+ *
+ *  Author: Michael Clark <michael@metaparadigm.com>
+ *  Copyright Metaparadigm Pte. Ltd. 2001
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ */
+
+/*
+ * Chained hash tables over scsidev_head, one per SCSI_INDEX_* key, so
+ * looking a device up by address, bus, device path, WWPN or serial
+ * number doesn't walk the list. The chains run through the devices
+ * themselves (hnext), and each table doubles when it holds as many
+ * devices as it has buckets.
+ *
+ * Scanners add a device once its fields are filled in. Anything that
+ * changes a key field afterwards (device, wwpn) calls
+ * scsi_index_update() so the device is refiled. Keys may be shared -
+ * every lun of a target, every device on a bus, every path to a
+ * multipathed device - and scsi_index_next() walks the devices with
+ * the same key.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "scsi_index.h"
+
+#ifdef USE_DMALLOC
+#include "dmalloc.h"
+#endif
+
+
+typedef struct index_table {
+
+    scsi_device_t **bucket;
+    unsigned size;              /* power of two, 0 until first used */
+    unsigned count;
+
+} index_table_t;
+
+
+static index_table_t tables[SCSI_INDEX_COUNT];
+
+
+/* keyed by the device's address rather than one of its names */
+static int index_addr(int index)
+{
+    return index == SCSI_INDEX_TARGET || index == SCSI_INDEX_BUS;
+}
+
+
+static const char *index_str(int index, scsi_device_t *scsidev)
+{
+    switch (index) {
+    case SCSI_INDEX_SG:
+	return scsidev->sg_device;
+    case SCSI_INDEX_DEV:
+	return scsidev->device;
+    case SCSI_INDEX_WWPN:
+	return scsidev->wwpn;
+    case SCSI_INDEX_SERIAL:
+	return scsidev->serial;
+    }
+    return NULL;
+}
+
+
+/* devices with an empty key aren't indexed under it */
+static int index_keyed(int index, scsi_device_t *scsidev)
+{
+    const char *s;
+
+    if (index_addr(index)) return 1;
+    return (s = index_str(index, scsidev)) && *s;
+}
+
+
+static unsigned index_hash(int index, scsi_device_t *scsidev)
+{
+    const unsigned char *s;
+    unsigned h = 2166136261u;
+
+    if (index_addr(index)) {
+	h = (h ^ scsidev->host) * 16777619u;
+	h = (h ^ scsidev->channel) * 16777619u;
+	if (index == SCSI_INDEX_TARGET) h = (h ^ scsidev->id) * 16777619u;
+	return h ^ (h >> 15);
+    }
+    for (s = (const unsigned char*)index_str(index, scsidev); *s; s++)
+	h = (h ^ *s) * 16777619u;
+    return h ^ (h >> 15);
+}
+
+
+static int index_match(int index, scsi_device_t *a, scsi_device_t *b)
+{
+    if (index == SCSI_INDEX_TARGET)
+	return a->host == b->host && a->channel == b->channel &&
+	    a->id == b->id;
+    if (index == SCSI_INDEX_BUS)
+	return a->host == b->host && a->channel == b->channel;
+    return strcmp(index_str(index, a), index_str(index, b)) == 0;
+}
+
+
+static int index_grow(index_table_t *t, int index)
+{
+    scsi_device_t **bucket, *scsidev, *next;
+    unsigned size = t->size ? t->size * 2 : SCSI_INDEX_MIN;
+    unsigned i;
+
+    if (!(bucket = calloc(size, sizeof(scsi_device_t*)))) return -1;
+    for (i = 0; i < t->size; i++) {
+	for (scsidev = t->bucket[i]; scsidev; scsidev = next) {
+	    next = scsidev->hnext[index];
+	    scsidev->hnext[index] = bucket[scsidev->hkey[index] & (size - 1)];
+	    bucket[scsidev->hkey[index] & (size - 1)] = scsidev;
+	}
+    }
+    free(t->bucket);
+    t->bucket = bucket;
+    t->size = size;
+
+    return 0;
+}
+
+
+static void index_add(int index, scsi_device_t *scsidev)
+{
+    index_table_t *t = &tables[index];
+    unsigned b;
+
+    if ((scsidev->indexed & (1 << index)) || !index_keyed(index, scsidev) ||
+	(t->count >= t->size && index_grow(t, index) < 0)) return;
+
+    scsidev->hkey[index] = index_hash(index, scsidev);
+    b = scsidev->hkey[index] & (t->size - 1);
+    scsidev->hnext[index] = t->bucket[b];
+    t->bucket[b] = scsidev;
+    t->count++;
+    scsidev->indexed |= 1 << index;
+}
+
+
+/* uses the hash the device was filed under, so it can be removed after
+   its key has changed */
+static void index_remove(int index, scsi_device_t *scsidev)
+{
+    index_table_t *t = &tables[index];
+    scsi_device_t **p;
+
+    if (!(scsidev->indexed & (1 << index))) return;
+    for (p = &t->bucket[scsidev->hkey[index] & (t->size - 1)]; *p;
+	 p = &(*p)->hnext[index]) {
+	if (*p != scsidev) continue;
+	*p = scsidev->hnext[index];
+	t->count--;
+	break;
+    }
+    scsidev->hnext[index] = NULL;
+    scsidev->indexed &= ~(1 << index);
+}
+
+
+void scsi_index_add(scsi_device_t *scsidev)
+{
+    int i;
+
+    for (i = 0; i < SCSI_INDEX_COUNT; i++) index_add(i, scsidev);
+}
+
+
+void scsi_index_remove(scsi_device_t *scsidev)
+{
+    int i;
+
+    for (i = 0; i < SCSI_INDEX_COUNT; i++) index_remove(i, scsidev);
+}
+
+
+/* refile a device after one of its name fields (device, wwpn, serial)
+   changed. A device's address never changes, so its place in the
+   target and bus indexes is kept and a walk of them may update devices
+   as it goes */
+void scsi_index_update(scsi_device_t *scsidev)
+{
+    int i;
+
+    for (i = 0; i < SCSI_INDEX_COUNT; i++) {
+	if (index_addr(i)) continue;
+	index_remove(i, scsidev);
+	index_add(i, scsidev);
+    }
+}
+
+
+/* first device whose key matches the same field of key */
+scsi_device_t *scsi_index_find(int index, scsi_device_t *key)
+{
+    index_table_t *t = &tables[index];
+    scsi_device_t *scsidev;
+    unsigned h;
+
+    if (!t->size || !index_keyed(index, key)) return NULL;
+    h = index_hash(index, key);
+    for (scsidev = t->bucket[h & (t->size - 1)]; scsidev;
+	 scsidev = scsidev->hnext[index])
+	if (scsidev->hkey[index] == h && index_match(index, scsidev, key))
+	    return scsidev;
+
+    return NULL;
+}
+
+
+/* the next device filed under the same key as prev */
+scsi_device_t *scsi_index_next(int index, scsi_device_t *prev)
+{
+    scsi_device_t *scsidev;
+
+    for (scsidev = prev->hnext[index]; scsidev;
+	 scsidev = scsidev->hnext[index])
+	if (scsidev->hkey[index] == prev->hkey[index] &&
+	    index_match(index, scsidev, prev)) return scsidev;
+
+    return NULL;
+}
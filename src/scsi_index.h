@@ -0,0 +1,29 @@
+/*
+ *  scsi_index.h - Hash indexes over the SCSI device list
+ *
+ *  Author: Michael Clark <michael@metaparadigm.com>
+ *  Copyright Metaparadigm Pte. Ltd. 2001
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ */
+
+#ifndef _SCSI_INDEX_H_
+#define _SCSI_INDEX_H_
+
+#include "scsi_api.h"
+
+
+/* buckets a table starts with, doubled as it fills */
+#define SCSI_INDEX_MIN 64
+
+
+extern void scsi_index_add(scsi_device_t *scsidev);
+extern void scsi_index_remove(scsi_device_t *scsidev);
+extern void scsi_index_update(scsi_device_t *scsidev);
+extern scsi_device_t *scsi_index_find(int index, scsi_device_t *key);
+extern scsi_device_t *scsi_index_next(int index, scsi_device_t *prev);
+
+#endif
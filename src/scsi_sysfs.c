@@ -0,0 +1,308 @@
+/*
+ *  scsi_sysfs.c - SCSI device discovery from sysfs
+ *
+ *  Author: Michael Clark <michael@metaparadigm.com>
+ *  Copyright Metaparadigm Pte. Ltd. 2001
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ */
+
+/*
+ * Build the scsi device list from /sys/class/scsi_generic instead of
+ * opening every /dev/sg node. Type, vendor, model and revision come
+ * from the sysfs attributes of the device behind each sg node, so only
+ * processor and enclosure devices - the ones that may be SAF-TE - are
+ * opened and sent INQUIRY. Disks never see a command.
+ *
+ * The block device of each disk is taken from the block directory of
+ * its scsi device (a block:<name> link on older kernels), which is what
+ * maps enclosure slots to disks.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <libgen.h>
+
+#include "scsi_sysfs.h"
+#include "scsi_cache.h"
+#include "scsi_index.h"
+
+#ifdef USE_DMALLOC
+#include "dmalloc.h"
+#endif
+
+
+const char *scsi_sysfs_root = SCSI_SYSFS_ROOT;
+
+
+/* read a sysfs attribute, without the trailing newline and padding */
+int sysfs_read_str(const char *dir, const char *attr,
+		   char *buf, size_t len)
+{
+    char path[PATH_MAX];
+    ssize_t n;
+    int fd;
+
+    if (snprintf(path, sizeof(path), "%s/%s", dir, attr) >= sizeof(path) ||
+	(fd = open(path, O_RDONLY)) < 0) return -1;
+    n = read(fd, buf, len - 1);
+    close(fd);
+    if (n < 0) return -1;
+
+    buf[n] = '\0';
+    while (n > 0 && isspace((unsigned char)buf[n-1])) buf[--n] = '\0';
+
+    return n;
+}
+
+
+/* read a binary sysfs attribute, returns its length */
+static int sysfs_read_bin(const char *dir, const char *attr,
+			  unsigned char *buf, size_t len)
+{
+    char path[PATH_MAX];
+    ssize_t n;
+    int fd;
+
+    if (snprintf(path, sizeof(path), "%s/%s", dir, attr) >= sizeof(path) ||
+	(fd = open(path, O_RDONLY)) < 0) return -1;
+    n = read(fd, buf, len);
+    close(fd);
+
+    return n;
+}
+
+
+static int sg_index(const char *name)
+{
+    char *end;
+    long k;
+
+    if (strncmp(name, "sg", 2) != 0) return -1;
+    k = strtol(name + 2, &end, 10);
+    if (end == name + 2 || *end) return -1;
+
+    return k;
+}
+
+
+static int sg_select(const struct dirent *de)
+{
+    return sg_index(de->d_name) >= 0;
+}
+
+
+/* sg0, sg1, ... sg10 rather than directory order */
+static int sg_compare(const struct dirent **a, const struct dirent **b)
+{
+    return sg_index((*a)->d_name) - sg_index((*b)->d_name);
+}
+
+
+/* fill in a device from the sysfs attributes in devdir. hctl is the
+   name of the scsi device directory, host:channel:id:lun */
+static int sysfs_dev_info(scsi_device_t *scsidev, const char *devdir,
+			  const char *hctl)
+{
+    char path[PATH_MAX], buf[64];
+    unsigned char inq[INQUIRY_REPLY_LEN];
+    int n;
+
+    if (sscanf(hctl, "%d:%d:%d:%d", &scsidev->host, &scsidev->channel,
+	       &scsidev->id, &scsidev->lun) != 4) return -1;
+
+    if (sysfs_read_str(devdir, "type", buf, sizeof(buf)) < 0) return -1;
+    scsidev->type = atoi(buf);
+
+    sysfs_read_str(devdir, "vendor", scsidev->vendor,
+		   sizeof(scsidev->vendor));
+    sysfs_read_str(devdir, "model", scsidev->product,
+		   sizeof(scsidev->product));
+    sysfs_read_str(devdir, "rev", scsidev->revision,
+		   sizeof(scsidev->revision));
+
+    /* the kernel's copy of the standard INQUIRY data, where exported */
+    n = sysfs_read_bin(devdir, "inquiry", inq, sizeof(inq));
+    if (n >= INQUIRY_SAFTEID_OFFSET + INQUIRY_SAFTEID_LENGTH) {
+	memcpy(scsidev->safteid, inq + INQUIRY_SAFTEID_OFFSET,
+	       INQUIRY_SAFTEID_LENGTH);
+	scsidev->safteid[INQUIRY_SAFTEID_LENGTH] = '\0';
+	scsidev->channelid = inq[INQUIRY_CHANNELID_OFFSET];
+    }
+
+    /* unit serial number VPD page, if the kernel read it */
+    n = sysfs_read_bin(devdir, "vpd_pg80", inq, sizeof(inq));
+    if (n > 4) {
+	n = inq[3] < n - 4 ? inq[3] : n - 4;
+	memcpy(scsidev->serial, inq + 4, n);
+	scsidev->serial[n] = '\0';
+	while (n > 0 && scsidev->serial[n-1] == ' ')
+	    scsidev->serial[--n] = '\0';
+    }
+
+    snprintf(path, sizeof(path), "%s" SCSI_SYSFS_HOST "/host%d",
+	     scsi_sysfs_root, scsidev->host);
+    sysfs_read_str(path, "proc_name", scsidev->hostname,
+		   sizeof(scsidev->hostname));
+
+    scsidev->active = 1;
+
+    return 0;
+}
+
+
+/* the block device behind a scsi device, if it has one */
+static void sysfs_block_dev(scsi_device_t *scsidev, const char *devdir)
+{
+    char path[PATH_MAX], name[NAME_MAX+1] = "";
+    struct dirent *de;
+    DIR *dir;
+
+    if (snprintf(path, sizeof(path), "%s/block", devdir) < sizeof(path) &&
+	(dir = opendir(path))) {
+	while ((de = readdir(dir)) && de->d_name[0] == '.');
+	if (de) snprintf(name, sizeof(name), "%s", de->d_name);
+    } else if ((dir = opendir(devdir))) {
+	while ((de = readdir(dir)) && strncmp(de->d_name, "block:", 6));
+	if (de) snprintf(name, sizeof(name), "%s", de->d_name + 6);
+    }
+    if (dir) closedir(dir);
+    if (!name[0]) return;
+
+    snprintf(path, sizeof(path), "/dev/%s", name);
+    scsidev->device = strdup(path);
+    strcpy(scsidev->prefix, scsidev->type == TYPE_ROM ? "sr" : "sd");
+}
+
+
+/* reset a list entry that turned out not to be usable */
+static void sysfs_dev_clear(scsi_device_t *scsidev)
+{
+    free(scsidev->device);
+    free(scsidev->sg_device);
+    memset(scsidev, 0, sizeof(scsi_device_t));
+    scsidev->sg_fd = -1;
+}
+
+
+/* fill in the list entry scsidev from sysfs for sg node k */
+static int sysfs_add(scsi_device_t *scsidev, const char *classdir, int k,
+		     int sg_numeric)
+{
+    char path[PATH_MAX], link[PATH_MAX], tmp[PATH_MAX];
+    ssize_t l;
+    int fd;
+
+    /* the device link points at the host:channel:id:lun directory */
+    if (snprintf(path, sizeof(path), "%s/sg%d/device", classdir, k) >=
+	sizeof(path) ||
+	(l = readlink(path, link, sizeof(link) - 1)) < 0) return -1;
+    link[l] = '\0';
+
+    if (sysfs_dev_info(scsidev, path, basename(link)) < 0) {
+	sysfs_dev_clear(scsidev);
+	return -1;
+    }
+
+    make_dev_name(tmp, "/dev/sg", k, sg_numeric);
+    scsidev->sg_device = strdup(tmp);
+    sysfs_block_dev(scsidev, path);
+
+    if (scsidev->type == TYPE_PROCESSOR || scsidev->type == TYPE_ENCLOSURE) {
+	/* may be SAF-TE, ask the device itself unless the cache knows
+	   it already */
+	if (scsi_cache_fill(scsidev) == 0) return 0;
+	if ((fd = open(scsidev->sg_device, O_RDWR)) < 0) {
+	    sysfs_dev_clear(scsidev);
+	    return -1;
+	}
+	if (get_scsi_dev_info(fd, scsidev) < 0) {
+	    close(fd);
+	    sysfs_dev_clear(scsidev);
+	    return -1;
+	}
+	close(fd);
+    }
+#if DEBUG
+    print_scsi_dev_info(scsidev);
+#endif
+
+    return 0;
+}
+
+
+/* the sg nodes sysfs knows of, in order, for the caller to add one at a
+   time with scan_sysfs_device(). Returns the number of nodes, or -1 if
+   sysfs has no scsi_generic class and the caller should probe the sg
+   nodes */
+int sysfs_sg_nodes(int **list)
+{
+    char classdir[PATH_MAX];
+    struct dirent **names;
+    int i, n;
+
+    snprintf(classdir, sizeof(classdir), "%s" SCSI_SYSFS_GENERIC,
+	     scsi_sysfs_root);
+    if ((n = scandir(classdir, &names, sg_select, sg_compare)) < 0)
+	return -1;
+
+    if ((*list = malloc((n ? n : 1) * sizeof(int))))
+	for (i = 0; i < n; i++) (*list)[i] = sg_index(names[i]->d_name);
+
+    for (i = 0; i < n; i++) free(names[i]);
+    free(names);
+
+    return *list ? n : 0;
+}
+
+
+/* add sg node k to the end of the device list */
+scsi_device_t *scan_sysfs_device(int k, int sg_numeric)
+{
+    char classdir[PATH_MAX];
+    scsi_device_t *scsidev, *next;
+
+    snprintf(classdir, sizeof(classdir), "%s" SCSI_SYSFS_GENERIC,
+	     scsi_sysfs_root);
+
+    for (scsidev = scsidev_head; scsidev->next; scsidev = scsidev->next);
+    if (!(next = alloc_scsidev())) return NULL;
+    if (sysfs_add(scsidev, classdir, k, sg_numeric) < 0) {
+	free(next);
+	return NULL;
+    }
+    scsi_index_add(scsidev);
+    scsidev->next = next;
+
+    return scsidev;
+}
+
+
+/* index of the sg node attached to a scsi device, -1 if it has none */
+int sysfs_sg_index(int host, int channel, int id, int lun)
+{
+    char path[PATH_MAX];
+    struct dirent *de;
+    DIR *dir;
+    int k = -1;
+
+    snprintf(path, sizeof(path), "%s" SCSI_SYSFS_DEVICES
+	     "/%d:%d:%d:%d/scsi_generic", scsi_sysfs_root,
+	     host, channel, id, lun);
+    if (!(dir = opendir(path))) return -1;
+    while ((de = readdir(dir)) && (k = sg_index(de->d_name)) < 0);
+    closedir(dir);
+
+    return k;
+}
@@ -0,0 +1,35 @@
+/*
+ *  scsi_sysfs.h - SCSI device discovery from sysfs
+ *
+ *  Author: Michael Clark <michael@metaparadigm.com>
+ *  Copyright Metaparadigm Pte. Ltd. 2001
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ */
+
+#ifndef _SCSI_SYSFS_H_
+#define _SCSI_SYSFS_H_
+
+#include "scsi_api.h"
+
+
+#define SCSI_SYSFS_ROOT "/sys"
+
+#define SCSI_SYSFS_GENERIC "/class/scsi_generic"
+#define SCSI_SYSFS_HOST "/class/scsi_host"
+#define SCSI_SYSFS_DEVICES "/bus/scsi/devices"
+
+
+/* where sysfs is mounted, SCSI_SYSFS_ROOT unless relocated */
+extern const char *scsi_sysfs_root;
+
+extern int sysfs_sg_nodes(int **list);
+extern scsi_device_t *scan_sysfs_device(int k, int sg_numeric);
+extern int sysfs_sg_index(int host, int channel, int id, int lun);
+extern int sysfs_read_str(const char *dir, const char *attr,
+			  char *buf, size_t len);
+
+#endif